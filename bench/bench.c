@@ -0,0 +1,808 @@
+/* ------------------------------------------------------------------------- *
+ * License: LGPLv2.1
+ * ------------------------------------------------------------------------- */
+
+/* ========================================================================= *
+ * Benchmark driver for hybris plugin running on top of fake hal.
+ *
+ * Reports:
+ * - throughput and latency of brightness / power / led setters
+ * - sensor events per second delivered via the poll thread
+ * - sysfs writes and main loop wakeups per led breathing cycle
+ * - wakeups, writes and bytes per minute for each led style, timing
+ *   and color combination
+ * - sysfs traffic and final led state under rapid pattern changes
+ *
+ * Output is one line per measurement, with space separated key=value
+ * pairs after the measurement name.
+ * ========================================================================= */
+
+#define MCE_HYBRIS_INTERNAL 2
+#include "../mce-hybris.h"
+#include "fakehal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <syslog.h>
+#include <time.h>
+#include <ftw.h>
+
+#include <glib.h>
+
+/** Helper to get number of elements in statically allocated array */
+#define numof(a) (sizeof(a)/sizeof*(a))
+
+/* ========================================================================= *
+ * OPTIONS
+ * ========================================================================= */
+
+/** Number of calls made per setter */
+static int  bench_iterations = 1000;
+
+/** Duration of sensor benchmark [ms] */
+static int  bench_duration = 5000;
+
+/** Number of measured breathing cycles */
+static int  bench_cycles = 5;
+
+/** Minimum measurement window per led pattern [ms] */
+static int  bench_led_window = 6000;
+
+/** Number of pattern changes per churn interval */
+static int  bench_churn_changes = 200;
+
+/** Comma separated list of suites to run, or NULL for defaults */
+static const char *bench_suites = 0;
+
+/** Flag for: show plugin diagnostics */
+static bool bench_verbose = false;
+
+/** Fake hal configuration */
+static fakehal_config_t bench_hal =
+{
+  .root            = 0,
+  .latency_us      = 0,
+  .event_hz        = 100,
+  .sysfs_backlight = false,
+  .led_pattern     = false,
+};
+
+/* ========================================================================= *
+ * UTILITY
+ * ========================================================================= */
+
+/** Get CLOCK_MONOTONIC time [us] */
+static int64_t bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+
+/** Plugin diagnostic output handler */
+static void bench_log(int lev, const char *file, const char *func,
+                      const char *text)
+{
+  (void)file;
+
+  if( bench_verbose || lev <= LOG_WARNING ) {
+    fprintf(stderr, "hybris: %s: %s\n", func, text);
+  }
+}
+
+/** nftw callback for removing fake sysfs tree */
+static int bench_remove_cb(const char *path, const struct stat *st,
+                           int type, struct FTW *ftw)
+{
+  (void)st, (void)type, (void)ftw;
+
+  if( remove(path) == -1 ) {
+    fprintf(stderr, "%s: can't remove: %m\n", path);
+  }
+
+  return 0;
+}
+
+/** Remove directory tree, depth first, without following symlinks */
+static void bench_remove_tree(const char *root)
+{
+  nftw(root, bench_remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/** qsort callback for latency samples */
+static int bench_cmp(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* ========================================================================= *
+ * MAIN LOOP
+ * ========================================================================= */
+
+/** Number of main loop iterations, i.e. wakeups */
+static int64_t bench_wakeups = 0;
+
+/** Flag for: bench_run_loop() should return */
+static bool    bench_loop_done = false;
+
+/** Timer callback for ending bench_run_loop() */
+static gboolean bench_loop_end_cb(gpointer aptr)
+{
+  (void)aptr;
+  bench_loop_done = true;
+  return FALSE;
+}
+
+/** Run glib main loop for given time, counting wakeups
+ *
+ * @param ms duration [ms]
+ */
+static void bench_run_loop(int ms)
+{
+  bench_loop_done = false;
+  g_timeout_add(ms, bench_loop_end_cb, 0);
+
+  while( !bench_loop_done ) {
+    g_main_context_iteration(0, TRUE);
+    ++bench_wakeups;
+  }
+}
+
+/** Dispatch whatever the main loop has pending, without blocking
+ */
+static void bench_flush_loop(void)
+{
+  while( g_main_context_iteration(0, FALSE) ) {}
+}
+
+/* ========================================================================= *
+ * SETTERS
+ * ========================================================================= */
+
+static bool bench_set_backlight(int i)
+{
+  return mce_hybris_backlight_set_brightness(i & 255);
+}
+
+static bool bench_set_keypad(int i)
+{
+  return mce_hybris_keypad_set_brightness((i & 1) ? 255 : 0);
+}
+
+static bool bench_set_framebuffer(int i)
+{
+  return mce_hybris_framebuffer_set_power(i & 1);
+}
+
+static bool bench_set_indicator(int i)
+{
+  return mce_hybris_indicator_set_pattern(i & 255, 0, 0, 0, 0);
+}
+
+/** Setters to measure */
+static const struct
+{
+  const char *name;
+  bool      (*init)(void);
+  bool      (*call)(int i);
+} bench_setter[] =
+{
+  { "backlight",   mce_hybris_backlight_init,   bench_set_backlight   },
+  { "keypad",      mce_hybris_keypad_init,      bench_set_keypad      },
+  { "framebuffer", mce_hybris_framebuffer_init, bench_set_framebuffer },
+  { "indicator",   mce_hybris_indicator_init,   bench_set_indicator   },
+};
+
+/** Measure throughput and latency of setter functions
+ */
+static void bench_setters(void)
+{
+  int64_t *lat = calloc(bench_iterations, sizeof *lat);
+
+  if( !lat ) {
+    goto cleanup;
+  }
+
+  for( size_t s = 0; s < numof(bench_setter); ++s ) {
+    if( !bench_setter[s].init() ) {
+      printf("setter name=%s available=0\n", bench_setter[s].name);
+      continue;
+    }
+
+    fakehal_stats_t hal;
+    int             fails = 0;
+    int64_t         total = 0;
+
+    fakehal_reset_stats();
+
+    for( int i = 0; i < bench_iterations; ++i ) {
+      int64_t t0 = bench_now();
+      if( !bench_setter[s].call(i) ) {
+        ++fails;
+      }
+      int64_t t1 = bench_now();
+
+      lat[i] = t1 - t0;
+      total += lat[i];
+
+      /* Dispatch whatever the setter queued for immediate handling */
+      bench_flush_loop();
+    }
+
+    fakehal_get_stats(&hal);
+    qsort(lat, bench_iterations, sizeof *lat, bench_cmp);
+
+    printf("setter name=%s calls=%d fails=%d rate=%.0f/s"
+           " avg_us=%.1f p50_us=%lld p99_us=%lld max_us=%lld"
+           " hal_calls=%llu sysfs_writes=%llu\n",
+           bench_setter[s].name, bench_iterations, fails,
+           total > 0 ? bench_iterations * 1e6 / total : 0.0,
+           (double)total / bench_iterations,
+           (long long)lat[bench_iterations / 2],
+           (long long)lat[bench_iterations * 99 / 100],
+           (long long)lat[bench_iterations - 1],
+           (unsigned long long)(hal.set_light + hal.enable_screen),
+           (unsigned long long)hal.sysfs_writes);
+  }
+
+cleanup:
+  free(lat);
+}
+
+/* ========================================================================= *
+ * SENSORS
+ * ========================================================================= */
+
+/** Number of ALS events seen by the callback */
+static uint64_t bench_als_events = 0;
+
+/** Number of PS events seen by the callback */
+static uint64_t bench_ps_events = 0;
+
+static void bench_als_cb(int64_t timestamp, float light)
+{
+  (void)timestamp;
+  (void)light;
+  __atomic_fetch_add(&bench_als_events, 1, __ATOMIC_RELAXED);
+}
+
+static void bench_ps_cb(int64_t timestamp, float distance)
+{
+  (void)timestamp;
+  (void)distance;
+  __atomic_fetch_add(&bench_ps_events, 1, __ATOMIC_RELAXED);
+}
+
+/** Print delivery latency summary for one sensor type
+ */
+static void bench_sensor_latency(const mce_hybris_sensor_stats_t *stats,
+                                 const char *name, int type)
+{
+  const mce_hybris_sensor_type_stats_t *t = &stats->type[type];
+
+  printf("latency sensor=%s events=%llu avg_us=%.1f max_us=%llu\n",
+         name, (unsigned long long)t->events,
+         t->events ? (double)t->latency_sum / t->events : 0.0,
+         (unsigned long long)t->latency_max);
+}
+
+/** Measure event throughput through the sensor poll thread
+ */
+static void bench_sensors(void)
+{
+  mce_hybris_sensor_stats_t before, after;
+  fakehal_stats_t           hal;
+
+  if( !mce_hybris_als_init() || !mce_hybris_ps_init() ) {
+    printf("sensors available=0\n");
+    goto cleanup;
+  }
+
+  mce_hybris_als_set_hook(bench_als_cb);
+  mce_hybris_ps_set_hook(bench_ps_cb);
+
+  mce_hybris_get_sensor_stats(&before);
+  fakehal_reset_stats();
+  __atomic_store_n(&bench_als_events, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&bench_ps_events, 0, __ATOMIC_RELAXED);
+
+  int64_t t0 = bench_now();
+
+  mce_hybris_als_set_active(true);
+  mce_hybris_ps_set_active(true);
+
+  bench_run_loop(bench_duration);
+
+  mce_hybris_als_set_active(false);
+  mce_hybris_ps_set_active(false);
+
+  int64_t t1 = bench_now();
+
+  fakehal_get_stats(&hal);
+  mce_hybris_get_sensor_stats(&after);
+
+  uint64_t als = __atomic_load_n(&bench_als_events, __ATOMIC_RELAXED);
+  uint64_t ps  = __atomic_load_n(&bench_ps_events, __ATOMIC_RELAXED);
+  double   sec = (t1 - t0) / 1e6;
+
+  printf("sensors hal_events=%llu polls=%llu delivered_als=%llu"
+         " delivered_ps=%llu rate=%.1f/s\n",
+         (unsigned long long)hal.events, (unsigned long long)hal.polls,
+         (unsigned long long)als, (unsigned long long)ps,
+         sec > 0 ? (als + ps) / sec : 0.0);
+
+  /* Statistics are cumulative; report only this run */
+  for( int t = 0; t < MCE_HYBRIS_SENSOR_TYPE_COUNT; ++t ) {
+    after.type[t].events      -= before.type[t].events;
+    after.type[t].latency_sum -= before.type[t].latency_sum;
+  }
+
+  bench_sensor_latency(&after, "als", MCE_HYBRIS_SENSOR_TYPE_LIGHT);
+  bench_sensor_latency(&after, "ps",  MCE_HYBRIS_SENSOR_TYPE_PROXIMITY);
+
+  mce_hybris_als_set_hook(0);
+  mce_hybris_ps_set_hook(0);
+
+cleanup:
+  return;
+}
+
+/* ========================================================================= *
+ * LED BREATHING
+ * ========================================================================= */
+
+/** Measure sysfs writes and wakeups needed for led breathing
+ */
+static void bench_breathing(void)
+{
+  const int on  = 1000;
+  const int off = 1000;
+
+  fakehal_stats_t hal;
+
+  if( !mce_hybris_indicator_init() ) {
+    printf("breathing available=0\n");
+    goto cleanup;
+  }
+
+  /* Breathing applies to patterns with color and timing; set first */
+  mce_hybris_indicator_set_brightness(255);
+  mce_hybris_indicator_set_pattern(0, 255, 0, on, off);
+  mce_hybris_indicator_enable_breathing(true);
+
+  /* Skip the transition from previous state */
+  bench_run_loop(on + off);
+
+  fakehal_reset_stats();
+  bench_wakeups = 0;
+
+  bench_run_loop((on + off) * bench_cycles);
+
+  fakehal_get_stats(&hal);
+
+  printf("breathing on_ms=%d off_ms=%d cycles=%d"
+         " writes_per_cycle=%.1f bytes_per_cycle=%.1f"
+         " wakeups_per_cycle=%.1f\n",
+         on, off, bench_cycles,
+         (double)hal.sysfs_writes / bench_cycles,
+         (double)hal.sysfs_bytes / bench_cycles,
+         (double)bench_wakeups / bench_cycles);
+
+  mce_hybris_indicator_set_pattern(0, 0, 0, 0, 0);
+  mce_hybris_indicator_enable_breathing(false);
+  bench_flush_loop();
+
+cleanup:
+  return;
+}
+
+/* ========================================================================= *
+ * LED BUDGET
+ * ========================================================================= */
+
+/** Led styles as seen by the plugin led controller */
+typedef enum {
+  BENCH_LED_STATIC,
+  BENCH_LED_BLINK,
+  BENCH_LED_BREATH,
+} bench_led_style_t;
+
+/** Names for bench_led_style_t values */
+static const char * const bench_led_style_name[] =
+{
+  [BENCH_LED_STATIC] = "STATIC",
+  [BENCH_LED_BLINK]  = "BLINK",
+  [BENCH_LED_BREATH] = "BREATH",
+};
+
+/** Led pattern timings to measure; all allow breathing */
+static const struct
+{
+  int on, off;
+} bench_led_timing[] =
+{
+  {  200,  200 },
+  {  500, 1500 },
+  { 1000, 1000 },
+  { 1000, 5000 },
+};
+
+/** Led pattern colors to measure: one channel, all channels, mixed */
+static const unsigned bench_led_color[] =
+{
+  0xff0000,
+  0xffffff,
+  0x40c020,
+};
+
+/** Plugin settle delays, rounded up generously [ms] */
+#define BENCH_LED_SETTLE_MS 200
+
+/** Activate led pattern via the public indicator api
+ *
+ * @param rgb     color as 0xRRGGBB
+ * @param on      on period [ms], or 0 for static led
+ * @param off     off period [ms], or 0 for static led
+ * @param breathe true to request breathing instead of blinking
+ */
+static void bench_led_set(unsigned rgb, int on, int off, bool breathe)
+{
+  mce_hybris_indicator_set_pattern((rgb >> 16) & 255, (rgb >> 8) & 255,
+                                   (rgb >> 0) & 255, on, off);
+  mce_hybris_indicator_enable_breathing(breathe);
+}
+
+/** Measure wakeups and sysfs traffic of one led pattern
+ *
+ * The measurement window is extended to cover whole pattern
+ * periods so that results do not depend on the phase.
+ */
+static void bench_led_measure(bench_led_style_t style, unsigned rgb,
+                              int on, int off)
+{
+  fakehal_stats_t hal;
+
+  int period = on + off;
+  int window = bench_led_window;
+
+  if( period > 0 ) {
+    window = (window + period - 1) / period * period;
+  }
+
+  bench_led_set(rgb, on, off, style == BENCH_LED_BREATH);
+
+  /* Skip the transition from previous state */
+  bench_run_loop(BENCH_LED_SETTLE_MS + period);
+
+  fakehal_reset_stats();
+  bench_wakeups = 0;
+
+  bench_run_loop(window);
+
+  fakehal_get_stats(&hal);
+
+  /* Exclude the wakeup from timer ending the window */
+  int64_t wakeups = bench_wakeups > 0 ? bench_wakeups - 1 : 0;
+
+  double scale = 60000.0 / window;
+
+  printf("led style=%s on_ms=%d off_ms=%d color=%06x window_ms=%d"
+         " wakeups_per_min=%.1f writes_per_min=%.1f bytes_per_min=%.1f\n",
+         bench_led_style_name[style], on, off, rgb, window,
+         wakeups * scale,
+         hal.sysfs_writes * scale,
+         hal.sysfs_bytes * scale);
+}
+
+/** Measure wakeup and syscall budget for all led styles
+ */
+static void bench_leds(void)
+{
+  if( !mce_hybris_indicator_init() ) {
+    printf("led available=0\n");
+    goto cleanup;
+  }
+
+  mce_hybris_indicator_set_brightness(255);
+
+  for( size_t c = 0; c < numof(bench_led_color); ++c ) {
+    bench_led_measure(BENCH_LED_STATIC, bench_led_color[c], 0, 0);
+  }
+
+  for( size_t t = 0; t < numof(bench_led_timing); ++t ) {
+    for( size_t c = 0; c < numof(bench_led_color); ++c ) {
+      bench_led_measure(BENCH_LED_BLINK, bench_led_color[c],
+                        bench_led_timing[t].on, bench_led_timing[t].off);
+      bench_led_measure(BENCH_LED_BREATH, bench_led_color[c],
+                        bench_led_timing[t].on, bench_led_timing[t].off);
+    }
+  }
+
+  bench_led_set(0, 0, 0, false);
+  bench_run_loop(BENCH_LED_SETTLE_MS);
+
+cleanup:
+  return;
+}
+
+/* ========================================================================= *
+ * LED CHURN
+ * ========================================================================= */
+
+/** Intervals between pattern changes; mostly below led settle delays */
+static const int bench_churn_interval[] = { 0, 1, 5, 20, 100 };
+
+/** Patterns cycled through, covering all style transitions */
+static const struct
+{
+  unsigned rgb;
+  int      on, off;
+  bool     breathe;
+} bench_churn_pattern[] =
+{
+  { 0x00ff00,    0,    0, false },
+  { 0xff0000,  200,  200, false },
+  { 0x0000ff,  500,  500, true  },
+  { 0xffffff,  500,  500, true  },
+  { 0x000000,    0,    0, false },
+  { 0x808080, 1000, 1000, false },
+};
+
+/** Read integer value from fake sysfs led attribute
+ *
+ * @return attribute value, or -1 on failure
+ */
+static int bench_churn_read(const char *led, const char *attr)
+{
+  int   val = -1;
+  FILE *file = 0;
+  char  path[PATH_MAX];
+
+  snprintf(path, sizeof path, "%s/sys/class/leds/%s/%s",
+           bench_hal.root, led, attr);
+
+  if( !(file = fopen(path, "r")) ) {
+    goto cleanup;
+  }
+
+  if( fscanf(file, "%d", &val) != 1 ) {
+    val = -1;
+  }
+
+cleanup:
+  if( file ) fclose(file);
+  return val;
+}
+
+/** Check that fake sysfs led state matches static color
+ *
+ * @return true if all channels have expected values, false otherwise
+ */
+static bool bench_churn_check(unsigned rgb)
+{
+  static const char * const name[] = { "red", "green", "blue" };
+
+  for( size_t i = 0; i < numof(name); ++i ) {
+    int want = (rgb >> (16 - 8 * i)) & 255;
+
+    if( bench_churn_read(name[i], "brightness") != want ||
+        bench_churn_read(name[i], "blink_delay_on") > 0 ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Stress led controller restart logic with rapid pattern changes
+ *
+ * After the last change, a static final color is requested and the
+ * fake sysfs led state is verified once the controller has settled.
+ */
+static void bench_churn(void)
+{
+  const unsigned final = 0x123456;
+
+  fakehal_stats_t hal;
+
+  if( !mce_hybris_indicator_init() ) {
+    printf("churn available=0\n");
+    goto cleanup;
+  }
+
+  mce_hybris_indicator_set_brightness(255);
+
+  for( size_t k = 0; k < numof(bench_churn_interval); ++k ) {
+    int interval = bench_churn_interval[k];
+
+    bench_led_set(0, 0, 0, false);
+    bench_run_loop(BENCH_LED_SETTLE_MS);
+
+    fakehal_reset_stats();
+    bench_wakeups = 0;
+
+    int64_t t0 = bench_now();
+
+    for( int i = 0; i < bench_churn_changes; ++i ) {
+      size_t j = i % numof(bench_churn_pattern);
+
+      bench_led_set(bench_churn_pattern[j].rgb,
+                    bench_churn_pattern[j].on,
+                    bench_churn_pattern[j].off,
+                    bench_churn_pattern[j].breathe);
+
+      if( interval > 0 )
+        bench_run_loop(interval);
+      else
+        bench_flush_loop();
+    }
+
+    bench_led_set(final, 0, 0, false);
+    bench_run_loop(BENCH_LED_SETTLE_MS);
+
+    int64_t t1 = bench_now();
+
+    fakehal_get_stats(&hal);
+
+    printf("churn interval_ms=%d changes=%d elapsed_ms=%.1f"
+           " writes=%llu bytes=%llu wakeups=%lld"
+           " writes_per_change=%.2f final_ok=%d\n",
+           interval, bench_churn_changes, (t1 - t0) * 1e-3,
+           (unsigned long long)hal.sysfs_writes,
+           (unsigned long long)hal.sysfs_bytes,
+           (long long)bench_wakeups,
+           (double)hal.sysfs_writes / bench_churn_changes,
+           bench_churn_check(final));
+  }
+
+  bench_led_set(0, 0, 0, false);
+  bench_run_loop(BENCH_LED_SETTLE_MS);
+
+cleanup:
+  return;
+}
+
+/* ========================================================================= *
+ * MAIN
+ * ========================================================================= */
+
+/** Benchmark suites */
+static const struct
+{
+  const char *name;
+  void      (*run)(void);
+  bool        dflt;
+} bench_suite[] =
+{
+  { "setters",   bench_setters,   true  },
+  { "sensors",   bench_sensors,   true  },
+  { "breathing", bench_breathing, true  },
+  { "leds",      bench_leds,      false },
+  { "churn",     bench_churn,     false },
+};
+
+/** Check if benchmark suite is selected
+ *
+ * @param name suite name
+ * @param dflt whether the suite is run by default
+ *
+ * @return true if suite should be run, false otherwise
+ */
+static bool bench_suite_selected(const char *name, bool dflt)
+{
+  if( !bench_suites ) {
+    return dflt;
+  }
+
+  size_t len = strlen(name);
+
+  for( const char *pos = bench_suites; *pos; ) {
+    size_t n = strcspn(pos, ",");
+    if( n == len && !strncmp(pos, name, n) ) {
+      return true;
+    }
+    pos += n;
+    if( *pos ) ++pos;
+  }
+  return false;
+}
+
+static void bench_usage(const char *prog)
+{
+  printf("Usage: %s [options]\n"
+         "\n"
+         "  -n <count>   calls per setter (default %d)\n"
+         "  -d <ms>      sensor benchmark duration (default %d)\n"
+         "  -c <count>   breathing cycles to measure (default %d)\n"
+         "  -w <ms>      minimum window per led pattern (default %d)\n"
+         "  -k <count>   pattern changes per churn interval (default %d)\n"
+         "  -m <list>    comma separated suites to run: setters, sensors,\n"
+         "               breathing, leds, churn (default: first three)\n"
+         "  -l <us>      fake hal latency per setter call (default %d)\n"
+         "  -r <hz>      fake sensor event rate (default %d)\n"
+         "  -b           use sysfs backlight controls\n"
+         "  -p           provide kernel led pattern trigger\n"
+         "  -o <dir>     directory for fake sysfs tree (default: temporary)\n"
+         "  -v           show plugin diagnostics\n"
+         "  -h           show this help\n",
+         prog, bench_iterations, bench_duration, bench_cycles,
+         bench_led_window, bench_churn_changes,
+         bench_hal.latency_us, bench_hal.event_hz);
+}
+
+int main(int argc, char **argv)
+{
+  int  rc = EXIT_FAILURE;
+  char tmp[] = "/tmp/fakehal-XXXXXX";
+  bool tmp_created = false;
+  int  opt;
+
+  while( (opt = getopt(argc, argv, "n:d:c:w:k:m:l:r:bpo:vh")) != -1 ) {
+    switch( opt ) {
+    case 'n': bench_iterations      = atoi(optarg); break;
+    case 'd': bench_duration        = atoi(optarg); break;
+    case 'c': bench_cycles          = atoi(optarg); break;
+    case 'w': bench_led_window      = atoi(optarg); break;
+    case 'k': bench_churn_changes   = atoi(optarg); break;
+    case 'm': bench_suites          = optarg;       break;
+    case 'l': bench_hal.latency_us  = atoi(optarg); break;
+    case 'r': bench_hal.event_hz    = atoi(optarg); break;
+    case 'b': bench_hal.sysfs_backlight = true;     break;
+    case 'p': bench_hal.led_pattern = true;         break;
+    case 'o': bench_hal.root        = optarg;       break;
+    case 'v': bench_verbose         = true;         break;
+    case 'h': bench_usage(*argv); rc = EXIT_SUCCESS; goto cleanup;
+    default:  bench_usage(*argv); goto cleanup;
+    }
+  }
+
+  if( bench_iterations < 1 ) bench_iterations = 1;
+  if( bench_cycles < 1 )     bench_cycles     = 1;
+  if( bench_led_window < 1 ) bench_led_window = 1;
+  if( bench_churn_changes < 1 ) bench_churn_changes = 1;
+
+  if( !bench_hal.root ) {
+    if( !mkdtemp(tmp) ) {
+      perror("mkdtemp");
+      goto cleanup;
+    }
+    bench_hal.root = tmp;
+    tmp_created = true;
+  }
+
+  if( !fakehal_init(&bench_hal) ) {
+    goto cleanup;
+  }
+
+  mce_hybris_set_log_hook(bench_log);
+  mce_hybris_set_log_level(bench_verbose ? LOG_DEBUG : LOG_WARNING);
+
+  printf("config root=%s latency_us=%d event_hz=%d"
+         " sysfs_backlight=%d led_pattern=%d\n",
+         bench_hal.root, bench_hal.latency_us, bench_hal.event_hz,
+         bench_hal.sysfs_backlight, bench_hal.led_pattern);
+
+  for( size_t i = 0; i < numof(bench_suite); ++i ) {
+    if( bench_suite_selected(bench_suite[i].name, bench_suite[i].dflt) ) {
+      bench_suite[i].run();
+    }
+  }
+
+  mce_hybris_quit();
+  bench_flush_loop();
+
+  rc = EXIT_SUCCESS;
+
+cleanup:
+  /* Remove temporary tree; directories given via -o are left alone */
+  if( tmp_created ) {
+    bench_remove_tree(tmp);
+  }
+
+  return rc;
+}
@@ -0,0 +1,941 @@
+/* ------------------------------------------------------------------------- *
+ * License: LGPLv2.1
+ * ------------------------------------------------------------------------- */
+
+/* ========================================================================= *
+ * Fake android hal for running hybris plugin benchmarks off-device.
+ *
+ * Provides:
+ * - hw_get_module() returning fake lights, framebuffer and sensors
+ *   modules with configurable per call latency and event rate
+ * - redirection of /sys paths opened by the plugin to a fake sysfs
+ *   tree, with counting of write() calls made to those files
+ *
+ * The library must be linked before libc so that the open(), write()
+ * etc wrappers take precedence over the real functions.
+ * ========================================================================= */
+
+/* The wrappers define both plain and 64 bit variants explicitly */
+#undef _FILE_OFFSET_BITS
+#undef _FORTIFY_SOURCE
+
+#include "fakehal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+
+#include <android/hardware/lights.h>
+#include <android/hardware/fb.h>
+#include <android/hardware/sensors.h>
+
+/** Helper to get number of elements in statically allocated array */
+#define numof(a) (sizeof(a)/sizeof*(a))
+
+/* ========================================================================= *
+ * CONFIGURATION & STATISTICS
+ * ========================================================================= */
+
+/** Root of the fake sysfs tree, or empty string for no redirection */
+static char fakehal_root[PATH_MAX] = "";
+
+/** Delay added to hal setter calls [us] */
+static int fakehal_latency_us = 0;
+
+/** Events per second per active sensor */
+static int fakehal_event_hz = 10;
+
+/** Counters; updated with atomic operations */
+static fakehal_stats_t fakehal_stats;
+
+/** Increment counter in fakehal_stats */
+#define FAKEHAL_INC(FIELD, AMOUNT) \
+  __atomic_fetch_add(&fakehal_stats.FIELD, (AMOUNT), __ATOMIC_RELAXED)
+
+/** Get time stamp from given clock [ns] */
+static int64_t fakehal_now(clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/** Simulate time spent by the hal in kernel / firmware
+ */
+static void fakehal_delay(void)
+{
+  int us = __atomic_load_n(&fakehal_latency_us, __ATOMIC_RELAXED);
+
+  if( us > 0 ) {
+    struct timespec ts = {
+      .tv_sec  = us / 1000000,
+      .tv_nsec = (us % 1000000) * 1000l,
+    };
+    while( nanosleep(&ts, &ts) == -1 && errno == EINTR ) {}
+  }
+}
+
+/** Set delay to add to hal setter calls
+ *
+ * @param latency_us delay [us]
+ */
+void fakehal_set_latency(int latency_us)
+{
+  __atomic_store_n(&fakehal_latency_us, latency_us > 0 ? latency_us : 0,
+                   __ATOMIC_RELAXED);
+}
+
+/** Set rate of generated sensor events
+ *
+ * @param event_hz events per second per active sensor
+ */
+void fakehal_set_event_rate(int event_hz)
+{
+  __atomic_store_n(&fakehal_event_hz, event_hz > 0 ? event_hz : 1,
+                   __ATOMIC_RELAXED);
+}
+
+/** Get snapshot of fake hal counters
+ *
+ * @param stats where to store the counters
+ */
+void fakehal_get_stats(fakehal_stats_t *stats)
+{
+  const uint64_t *src = (const uint64_t *)&fakehal_stats;
+  uint64_t       *dst = (uint64_t *)stats;
+
+  for( size_t i = 0; i < sizeof *stats / sizeof *dst; ++i ) {
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+/** Reset fake hal counters
+ */
+void fakehal_reset_stats(void)
+{
+  uint64_t *dst = (uint64_t *)&fakehal_stats;
+
+  for( size_t i = 0; i < sizeof fakehal_stats / sizeof *dst; ++i ) {
+    __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+/* ========================================================================= *
+ * SYSFS redirection
+ * ========================================================================= */
+
+/** Highest file descriptor that can be tracked */
+#define FAKEHAL_MAX_FD 1024
+
+/** Flags for: file descriptor refers to fake sysfs file */
+static bool fakehal_fd_tracked[FAKEHAL_MAX_FD];
+
+/** Real libc functions */
+static int     (*real_open)(const char *, int, ...) = 0;
+static int     (*real_open64)(const char *, int, ...) = 0;
+static int     (*real_close)(int) = 0;
+static ssize_t (*real_write)(int, const void *, size_t) = 0;
+static DIR    *(*real_opendir)(const char *) = 0;
+static int     (*real_scandir)(const char *, struct dirent ***,
+                               int (*)(const struct dirent *),
+                               int (*)(const struct dirent **,
+                                       const struct dirent **)) = 0;
+static int     (*real_scandir64)(const char *, struct dirent64 ***,
+                                 int (*)(const struct dirent64 *),
+                                 int (*)(const struct dirent64 **,
+                                         const struct dirent64 **)) = 0;
+
+/** Look up real libc functions
+ *
+ * Called on library load, and from the wrappers too in case some
+ * other library constructor gets to use them first.
+ */
+static void __attribute__((constructor)) fakehal_resolve(void)
+{
+  real_open      = dlsym(RTLD_NEXT, "open");
+  real_open64    = dlsym(RTLD_NEXT, "open64");
+  real_close     = dlsym(RTLD_NEXT, "close");
+  real_write     = dlsym(RTLD_NEXT, "write");
+  real_opendir   = dlsym(RTLD_NEXT, "opendir");
+  real_scandir   = dlsym(RTLD_NEXT, "scandir");
+  real_scandir64 = dlsym(RTLD_NEXT, "scandir64");
+}
+
+/** Map /sys paths to the fake sysfs tree
+ *
+ * @param path path used by the plugin
+ * @param buff buffer for the mapped path
+ * @param size size of the buffer
+ *
+ * @return path to use
+ */
+static const char *fakehal_path(const char *path, char *buff, size_t size)
+{
+  if( !*fakehal_root || !path || strncmp(path, "/sys/", 5) ) {
+    return path;
+  }
+
+  snprintf(buff, size, "%s%s", fakehal_root, path);
+  return buff;
+}
+
+/** Start / stop tracking writes to a file descriptor
+ */
+static void fakehal_track(int fd, bool track)
+{
+  if( fd >= 0 && fd < FAKEHAL_MAX_FD ) {
+    __atomic_store_n(&fakehal_fd_tracked[fd], track, __ATOMIC_RELAXED);
+  }
+}
+
+/** Check if file descriptor refers to fake sysfs file
+ */
+static bool fakehal_is_tracked(int fd)
+{
+  return (fd >= 0 && fd < FAKEHAL_MAX_FD &&
+          __atomic_load_n(&fakehal_fd_tracked[fd], __ATOMIC_RELAXED));
+}
+
+/** Common part of open() and open64() wrappers
+ */
+static int fakehal_open(int (*real)(const char *, int, ...),
+                        const char *path, int flags, mode_t mode)
+{
+  char        buff[PATH_MAX];
+  const char *use = fakehal_path(path, buff, sizeof buff);
+  int         fd  = real(use, flags, mode);
+
+  if( use != path && fd != -1 ) {
+    FAKEHAL_INC(sysfs_opens, 1);
+    fakehal_track(fd, true);
+  }
+
+  return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+
+  if( flags & O_CREAT ) {
+    va_list va;
+    va_start(va, flags);
+    mode = va_arg(va, mode_t);
+    va_end(va);
+  }
+
+  if( !real_open ) fakehal_resolve();
+  return fakehal_open(real_open, path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+
+  if( flags & O_CREAT ) {
+    va_list va;
+    va_start(va, flags);
+    mode = va_arg(va, mode_t);
+    va_end(va);
+  }
+
+  if( !real_open64 ) fakehal_resolve();
+  return fakehal_open(real_open64, path, flags, mode);
+}
+
+int close(int fd)
+{
+  if( !real_close ) fakehal_resolve();
+  fakehal_track(fd, false);
+  return real_close(fd);
+}
+
+/** Write wrapper that counts sysfs writes
+ *
+ * Sysfs attributes take the whole value with each write, so fake
+ * attribute files are truncated first instead of growing without limit.
+ */
+ssize_t write(int fd, const void *buf, size_t cnt)
+{
+  if( !real_write ) fakehal_resolve();
+
+  if( fakehal_is_tracked(fd) ) {
+    FAKEHAL_INC(sysfs_writes, 1);
+    FAKEHAL_INC(sysfs_bytes, cnt);
+    if( ftruncate(fd, 0) == -1 ) {
+      /* Not a regular file; write as is */
+    }
+  }
+
+  return real_write(fd, buf, cnt);
+}
+
+DIR *opendir(const char *path)
+{
+  char buff[PATH_MAX];
+  if( !real_opendir ) fakehal_resolve();
+  return real_opendir(fakehal_path(path, buff, sizeof buff));
+}
+
+int scandir(const char *path, struct dirent ***names,
+            int (*filter)(const struct dirent *),
+            int (*compar)(const struct dirent **, const struct dirent **))
+{
+  char buff[PATH_MAX];
+  if( !real_scandir ) fakehal_resolve();
+  return real_scandir(fakehal_path(path, buff, sizeof buff),
+                      names, filter, compar);
+}
+
+int scandir64(const char *path, struct dirent64 ***names,
+              int (*filter)(const struct dirent64 *),
+              int (*compar)(const struct dirent64 **,
+                            const struct dirent64 **))
+{
+  char buff[PATH_MAX];
+  if( !real_scandir64 ) fakehal_resolve();
+  return real_scandir64(fakehal_path(path, buff, sizeof buff),
+                        names, filter, compar);
+}
+
+/* ========================================================================= *
+ * SYSFS tree
+ * ========================================================================= */
+
+/** Create directory and missing parent directories
+ *
+ * @param path directory path
+ *
+ * @return true on success, false on failure
+ */
+static bool fakehal_mkdir(const char *path)
+{
+  char tmp[PATH_MAX];
+
+  snprintf(tmp, sizeof tmp, "%s", path);
+
+  for( char *pos = tmp + 1; *pos; ++pos ) {
+    if( *pos == '/' ) {
+      *pos = 0;
+      mkdir(tmp, 0755);
+      *pos = '/';
+    }
+  }
+
+  return mkdir(tmp, 0755) == 0 || errno == EEXIST;
+}
+
+/** Create fake sysfs attribute file
+ *
+ * @param dir  directory path
+ * @param name attribute name
+ * @param text initial content
+ *
+ * @return true on success, false on failure
+ */
+static bool fakehal_attr(const char *dir, const char *name, const char *text)
+{
+  bool  ack = false;
+  char  path[PATH_MAX];
+  FILE *file;
+
+  int len = snprintf(path, sizeof path, "%s/%s", dir, name);
+
+  if( len < 0 || (size_t)len >= sizeof path ) {
+    fprintf(stderr, "fakehal: %s/%s: path too long\n", dir, name);
+    goto cleanup;
+  }
+
+  if( (file = fopen(path, "w")) ) {
+    ack = fputs(text, file) >= 0;
+    ack = (fclose(file) == 0) && ack;
+  }
+
+  if( !ack ) {
+    fprintf(stderr, "fakehal: %s: %m\n", path);
+  }
+
+cleanup:
+  return ack;
+}
+
+/** Create fake led class device
+ *
+ * @param name    led name
+ * @param blink   true to provide blink delay controls
+ * @param pattern true to provide ledtrig-pattern controls
+ *
+ * @return true on success, false on failure
+ */
+static bool fakehal_add_led(const char *name, bool blink, bool pattern)
+{
+  bool ack = false;
+  char dir[PATH_MAX];
+
+  int len = snprintf(dir, sizeof dir, "%s/sys/class/leds/%s",
+                     fakehal_root, name);
+
+  if( len < 0 || (size_t)len >= sizeof dir ) {
+    fprintf(stderr, "fakehal: %s: led path too long\n", name);
+    goto cleanup;
+  }
+
+  if( !fakehal_mkdir(dir) ) {
+    goto cleanup;
+  }
+
+  if( !fakehal_attr(dir, "brightness", "0\n") ||
+      !fakehal_attr(dir, "max_brightness", "255\n") ) {
+    goto cleanup;
+  }
+
+  if( blink ) {
+    if( !fakehal_attr(dir, "blink_delay_on", "0\n") ||
+        !fakehal_attr(dir, "blink_delay_off", "0\n") ) {
+      goto cleanup;
+    }
+  }
+
+  if( pattern ) {
+    if( !fakehal_attr(dir, "trigger", "[none] timer pattern\n") ||
+        !fakehal_attr(dir, "pattern", "\n") ||
+        !fakehal_attr(dir, "repeat", "-1\n") ) {
+      goto cleanup;
+    }
+  }
+  else {
+    if( !fakehal_attr(dir, "trigger", "[none] timer\n") ) {
+      goto cleanup;
+    }
+  }
+
+  ack = true;
+
+cleanup:
+  return ack;
+}
+
+/** Initialize fake hal
+ *
+ * Must be called before the plugin is used. Creates the fake sysfs
+ * tree under the given root directory and enables path redirection.
+ *
+ * @param cfg configuration to use
+ *
+ * @return true on success, false on failure
+ */
+bool fakehal_init(const fakehal_config_t *cfg)
+{
+  bool ack = false;
+
+  fakehal_set_latency(cfg->latency_us);
+  fakehal_set_event_rate(cfg->event_hz);
+
+  if( !cfg->root ) {
+    *fakehal_root = 0;
+    ack = true;
+    goto cleanup;
+  }
+
+  snprintf(fakehal_root, sizeof fakehal_root, "%s", cfg->root);
+
+  if( !fakehal_add_led("red",   true, cfg->led_pattern) ||
+      !fakehal_add_led("green", true, cfg->led_pattern) ||
+      !fakehal_add_led("blue",  true, cfg->led_pattern) ) {
+    goto cleanup;
+  }
+
+  if( cfg->sysfs_backlight && !fakehal_add_led("lcd-backlight", false, false) ) {
+    goto cleanup;
+  }
+
+  ack = true;
+
+cleanup:
+  return ack;
+}
+
+/* ========================================================================= *
+ * LIGHTS module
+ * ========================================================================= */
+
+/** Close any fake device object
+ */
+static int fakehal_device_close(struct hw_device_t *dev)
+{
+  free(dev);
+  return 0;
+}
+
+/** Fake set_light() method
+ */
+static int fakehal_set_light(struct light_device_t *dev,
+                             struct light_state_t const *state)
+{
+  (void)dev;
+  (void)state;
+
+  FAKEHAL_INC(set_light, 1);
+  fakehal_delay();
+
+  return 0;
+}
+
+/** Open fake light device
+ */
+static int fakehal_lights_open(const struct hw_module_t *mod, const char *id,
+                               struct hw_device_t **dev)
+{
+  static const char * const known[] =
+  {
+    LIGHT_ID_BACKLIGHT,
+    LIGHT_ID_KEYBOARD,
+    LIGHT_ID_BUTTONS,
+    LIGHT_ID_NOTIFICATIONS,
+  };
+
+  struct light_device_t *light = 0;
+
+  for( size_t i = 0; i < numof(known); ++i ) {
+    if( !strcmp(known[i], id) ) {
+      light = calloc(1, sizeof *light);
+      break;
+    }
+  }
+
+  if( !light ) {
+    return -EINVAL;
+  }
+
+  light->common.tag     = HARDWARE_DEVICE_TAG;
+  light->common.version = 0;
+  light->common.module  = (struct hw_module_t *)mod;
+  light->common.close   = fakehal_device_close;
+  light->set_light      = fakehal_set_light;
+
+  *dev = &light->common;
+  return 0;
+}
+
+static struct hw_module_methods_t fakehal_lights_methods =
+{
+  .open = fakehal_lights_open,
+};
+
+static struct hw_module_t fakehal_lights_module =
+{
+  .tag     = HARDWARE_MODULE_TAG,
+  .id      = LIGHTS_HARDWARE_MODULE_ID,
+  .name    = "fake lights",
+  .author  = "fakehal",
+  .methods = &fakehal_lights_methods,
+};
+
+/* ========================================================================= *
+ * FRAMEBUFFER module
+ * ========================================================================= */
+
+/** Fake enableScreen() method
+ */
+static int fakehal_enable_screen(struct framebuffer_device_t *dev, int enable)
+{
+  (void)dev;
+  (void)enable;
+
+  FAKEHAL_INC(enable_screen, 1);
+  fakehal_delay();
+
+  return 0;
+}
+
+/** Open fake framebuffer device
+ */
+static int fakehal_fb_open(const struct hw_module_t *mod, const char *id,
+                           struct hw_device_t **dev)
+{
+  struct framebuffer_device_t *fb = 0;
+
+  if( strcmp(id, GRALLOC_HARDWARE_FB0) ) {
+    return -EINVAL;
+  }
+
+  if( !(fb = calloc(1, sizeof *fb)) ) {
+    return -ENOMEM;
+  }
+
+  fb->common.tag     = HARDWARE_DEVICE_TAG;
+  fb->common.version = 0;
+  fb->common.module  = (struct hw_module_t *)mod;
+  fb->common.close   = fakehal_device_close;
+  fb->enableScreen   = fakehal_enable_screen;
+
+  *dev = &fb->common;
+  return 0;
+}
+
+static struct hw_module_methods_t fakehal_fb_methods =
+{
+  .open = fakehal_fb_open,
+};
+
+static struct hw_module_t fakehal_fb_module =
+{
+  .tag     = HARDWARE_MODULE_TAG,
+  .id      = GRALLOC_HARDWARE_FB0,
+  .name    = "fake framebuffer",
+  .author  = "fakehal",
+  .methods = &fakehal_fb_methods,
+};
+
+/* ========================================================================= *
+ * SENSORS module
+ * ========================================================================= */
+
+/** Sensors provided by the fake hal */
+static const struct sensor_t fakehal_sensors[] =
+{
+  {
+    .name       = "fake light",
+    .vendor     = "fakehal",
+    .version    = 1,
+    .handle     = 1,
+    .type       = SENSOR_TYPE_LIGHT,
+    .maxRange   = 10000.0f,
+    .resolution = 1.0f,
+    .power      = 0.1f,
+  },
+  {
+    .name       = "fake proximity",
+    .vendor     = "fakehal",
+    .version    = 1,
+    .handle     = 2,
+    .type       = SENSOR_TYPE_PROXIMITY,
+    .maxRange   = 5.0f,
+    .resolution = 5.0f,
+    .power      = 0.1f,
+  },
+};
+
+/** Maximum number of pending flush requests */
+#define FAKEHAL_FLUSH_MAX 16
+
+/** Mutex protecting fakehal_poll */
+static pthread_mutex_t fakehal_poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Condition for waking up poll(); uses CLOCK_MONOTONIC */
+static pthread_cond_t  fakehal_poll_cond;
+
+/** Sensor poll state; protected by fakehal_poll_mutex */
+static struct
+{
+  bool     active[numof(fakehal_sensors)];
+  int64_t  due[numof(fakehal_sensors)];     // next event [ns]
+  uint32_t seq[numof(fakehal_sensors)];     // events generated
+  int      flush[FAKEHAL_FLUSH_MAX];        // handles to report
+  int      flushes;
+} fakehal_poll;
+
+/** Map sensor handle to index in fakehal_sensors
+ *
+ * @return index, or -1 for unknown handle
+ */
+static int fakehal_sensor_index(int handle)
+{
+  for( size_t i = 0; i < numof(fakehal_sensors); ++i ) {
+    if( fakehal_sensors[i].handle == handle ) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/** Fill in event data for a sensor
+ *
+ * Light level drifts slowly back and forth, proximity alternates
+ * between near and far every few events.
+ */
+static void fakehal_sensor_event(int idx, sensors_event_t *eve)
+{
+  const struct sensor_t *sensor = &fakehal_sensors[idx];
+  uint32_t               seq    = fakehal_poll.seq[idx]++;
+
+  memset(eve, 0, sizeof *eve);
+  eve->version   = sizeof *eve;
+  eve->sensor    = sensor->handle;
+  eve->type      = sensor->type;
+  eve->timestamp = fakehal_now(CLOCK_BOOTTIME);
+
+  if( sensor->type == SENSOR_TYPE_LIGHT ) {
+    eve->data[0] = 100.0f + 90.0f * sinf(seq * 0.05f);
+  }
+  else {
+    eve->data[0] = ((seq / 8) & 1) ? sensor->maxRange : 0.0f;
+  }
+}
+
+/** Fake poll() method
+ *
+ * Blocks until an active sensor has an event due, or flush is requested.
+ */
+static int fakehal_poll_events(struct sensors_poll_device_t *dev,
+                               sensors_event_t *data, int count)
+{
+  (void)dev;
+
+  int n = 0;
+
+  FAKEHAL_INC(polls, 1);
+
+  pthread_mutex_lock(&fakehal_poll_mutex);
+
+  for( ;; ) {
+    while( n < count && fakehal_poll.flushes > 0 ) {
+      sensors_event_t *eve = &data[n++];
+      memset(eve, 0, sizeof *eve);
+      eve->version  = META_DATA_VERSION;
+      eve->type     = SENSOR_TYPE_META_DATA;
+      eve->meta_data.what   = META_DATA_FLUSH_COMPLETE;
+      eve->meta_data.sensor = fakehal_poll.flush[--fakehal_poll.flushes];
+    }
+
+    int64_t now      = fakehal_now(CLOCK_MONOTONIC);
+    int64_t wake     = INT64_MAX;
+    int64_t interval = 1000000000ll /
+      __atomic_load_n(&fakehal_event_hz, __ATOMIC_RELAXED);
+
+    for( size_t i = 0; i < numof(fakehal_sensors); ++i ) {
+      if( !fakehal_poll.active[i] ) {
+        continue;
+      }
+
+      while( n < count && fakehal_poll.due[i] <= now ) {
+        fakehal_sensor_event(i, &data[n++]);
+        fakehal_poll.due[i] += interval;
+      }
+
+      /* Do not try to catch up after stalls */
+      if( fakehal_poll.due[i] < now ) {
+        fakehal_poll.due[i] = now + interval;
+      }
+
+      if( wake > fakehal_poll.due[i] ) {
+        wake = fakehal_poll.due[i];
+      }
+    }
+
+    if( n > 0 ) {
+      break;
+    }
+
+    if( wake == INT64_MAX ) {
+      pthread_cond_wait(&fakehal_poll_cond, &fakehal_poll_mutex);
+    }
+    else {
+      struct timespec ts = {
+        .tv_sec  = wake / 1000000000,
+        .tv_nsec = wake % 1000000000,
+      };
+      pthread_cond_timedwait(&fakehal_poll_cond, &fakehal_poll_mutex, &ts);
+    }
+  }
+
+  pthread_mutex_unlock(&fakehal_poll_mutex);
+
+  FAKEHAL_INC(events, n);
+
+  return n;
+}
+
+/** Fake activate() method
+ */
+static int fakehal_activate(struct sensors_poll_device_t *dev,
+                            int handle, int enabled)
+{
+  (void)dev;
+
+  int idx = fakehal_sensor_index(handle);
+
+  if( idx < 0 ) {
+    return -EINVAL;
+  }
+
+  FAKEHAL_INC(activate, 1);
+  fakehal_delay();
+
+  pthread_mutex_lock(&fakehal_poll_mutex);
+  if( enabled && !fakehal_poll.active[idx] ) {
+    fakehal_poll.due[idx] = fakehal_now(CLOCK_MONOTONIC);
+  }
+  fakehal_poll.active[idx] = (enabled != 0);
+  pthread_cond_broadcast(&fakehal_poll_cond);
+  pthread_mutex_unlock(&fakehal_poll_mutex);
+
+  return 0;
+}
+
+/** Fake setDelay() method
+ *
+ * The requested period is ignored; event rate is set via fakehal config.
+ */
+static int fakehal_set_delay(struct sensors_poll_device_t *dev,
+                             int handle, int64_t ns)
+{
+  (void)dev;
+  (void)ns;
+
+  if( fakehal_sensor_index(handle) < 0 ) {
+    return -EINVAL;
+  }
+
+  FAKEHAL_INC(batch, 1);
+  fakehal_delay();
+
+  return 0;
+}
+
+/** Fake batch() method
+ */
+static int fakehal_batch(struct sensors_poll_device_1 *dev, int handle,
+                         int flags, int64_t period_ns, int64_t timeout)
+{
+  (void)flags;
+  (void)timeout;
+
+  return fakehal_set_delay(&dev->v0, handle, period_ns);
+}
+
+/** Fake flush() method
+ */
+static int fakehal_flush(struct sensors_poll_device_1 *dev, int handle)
+{
+  (void)dev;
+
+  if( fakehal_sensor_index(handle) < 0 ) {
+    return -EINVAL;
+  }
+
+  FAKEHAL_INC(flush, 1);
+
+  pthread_mutex_lock(&fakehal_poll_mutex);
+  if( fakehal_poll.flushes < FAKEHAL_FLUSH_MAX ) {
+    fakehal_poll.flush[fakehal_poll.flushes++] = handle;
+  }
+  pthread_cond_broadcast(&fakehal_poll_cond);
+  pthread_mutex_unlock(&fakehal_poll_mutex);
+
+  return 0;
+}
+
+/** Initialize poll wakeup condition to use CLOCK_MONOTONIC
+ */
+static void fakehal_poll_init(void)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&fakehal_poll_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/** Open fake sensor poll device
+ */
+static int fakehal_sensors_open(const struct hw_module_t *mod, const char *id,
+                                struct hw_device_t **dev)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  sensors_poll_device_1_t *poll = 0;
+
+  if( strcmp(id, SENSORS_HARDWARE_POLL) ) {
+    return -EINVAL;
+  }
+
+  if( !(poll = calloc(1, sizeof *poll)) ) {
+    return -ENOMEM;
+  }
+
+  pthread_once(&once, fakehal_poll_init);
+
+  poll->common.tag     = HARDWARE_DEVICE_TAG;
+  poll->common.version = SENSORS_DEVICE_API_VERSION_1_3;
+  poll->common.module  = (struct hw_module_t *)mod;
+  poll->common.close   = fakehal_device_close;
+  poll->activate       = fakehal_activate;
+  poll->setDelay       = fakehal_set_delay;
+  poll->poll           = fakehal_poll_events;
+  poll->batch          = fakehal_batch;
+  poll->flush          = fakehal_flush;
+
+  *dev = &poll->common;
+  return 0;
+}
+
+/** List sensors provided by the fake hal
+ */
+static int fakehal_get_sensors_list(struct sensors_module_t *mod,
+                                    struct sensor_t const **list)
+{
+  (void)mod;
+
+  *list = fakehal_sensors;
+  return (int)numof(fakehal_sensors);
+}
+
+static struct hw_module_methods_t fakehal_sensors_methods =
+{
+  .open = fakehal_sensors_open,
+};
+
+static struct sensors_module_t fakehal_sensors_module =
+{
+  .common =
+  {
+    .tag     = HARDWARE_MODULE_TAG,
+    .id      = SENSORS_HARDWARE_MODULE_ID,
+    .name    = "fake sensors",
+    .author  = "fakehal",
+    .methods = &fakehal_sensors_methods,
+  },
+  .get_sensors_list = fakehal_get_sensors_list,
+};
+
+/* ========================================================================= *
+ * LIBHARDWARE replacement
+ * ========================================================================= */
+
+/** Get fake hal module by id
+ *
+ * @param id     module id
+ * @param module where to store module pointer
+ *
+ * @return 0 on success, or negative error code
+ */
+int hw_get_module(const char *id, const struct hw_module_t **module)
+{
+  if( !strcmp(id, LIGHTS_HARDWARE_MODULE_ID) ) {
+    *module = &fakehal_lights_module;
+  }
+  else if( !strcmp(id, GRALLOC_HARDWARE_FB0) ) {
+    *module = &fakehal_fb_module;
+  }
+  else if( !strcmp(id, SENSORS_HARDWARE_MODULE_ID) ) {
+    *module = &fakehal_sensors_module.common;
+  }
+  else {
+    return -ENOENT;
+  }
+
+  return 0;
+}
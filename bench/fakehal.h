@@ -0,0 +1,61 @@
+/* ------------------------------------------------------------------------- *
+ * License: LGPLv2.1
+ * ------------------------------------------------------------------------- */
+
+/* Fake android hal for benchmarking hybris plugin without a device
+ *
+ * The library provides hw_get_module() with fake lights, framebuffer
+ * and sensors modules, and redirects /sys/class paths opened by the
+ * plugin to a fake sysfs tree so that led and backlight writes can be
+ * counted.
+ */
+
+#ifndef FAKEHAL_H_
+# define FAKEHAL_H_
+
+# include <stdbool.h>
+# include <stdint.h>
+
+# ifdef __cplusplus
+extern "C" {
+# elif 0
+} /* fool JED indentation ... */
+# endif
+
+/** Fake hal configuration */
+typedef struct
+{
+  const char *root;            // directory for the fake sysfs tree
+  int         latency_us;      // delay added to each hal setter call
+  int         event_hz;        // events per second per active sensor
+  bool        sysfs_backlight; // provide lcd-backlight sysfs controls
+  bool        led_pattern;     // provide ledtrig-pattern controls
+} fakehal_config_t;
+
+/** Counters for hal calls and fake sysfs access */
+typedef struct
+{
+  uint64_t set_light;       // lights hal set_light() calls
+  uint64_t enable_screen;   // framebuffer enableScreen() calls
+  uint64_t activate;        // sensor activate() calls
+  uint64_t batch;           // sensor batch() and setDelay() calls
+  uint64_t flush;           // sensor flush() calls
+  uint64_t polls;           // sensor poll() calls
+  uint64_t events;          // events returned from poll()
+
+  uint64_t sysfs_opens;     // open() calls within fake sysfs tree
+  uint64_t sysfs_writes;    // write() calls to fake sysfs files
+  uint64_t sysfs_bytes;     // bytes written to fake sysfs files
+} fakehal_stats_t;
+
+bool fakehal_init(const fakehal_config_t *cfg);
+void fakehal_set_latency(int latency_us);
+void fakehal_set_event_rate(int event_hz);
+void fakehal_get_stats(fakehal_stats_t *stats);
+void fakehal_reset_stats(void);
+
+# ifdef __cplusplus
+};
+# endif
+
+#endif /* FAKEHAL_H_ */
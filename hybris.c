@@ -38,8 +38,20 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <sched.h>
+
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <glib.h>
 
@@ -51,7 +63,40 @@
 /** Helper to get number of elements in statically allocated array */
 #define numof(a) (sizeof(a)/sizeof*(a))
 
+/** Clamp integer values to given range
+ *
+ * @param lo  minimum value allowed
+ * @param hi  maximum value allowed
+ * @param val value to clamp
+ *
+ * @return val clamped to [lo, hi]
+ */
+static inline int clamp_to_range(int lo, int hi, int val)
+{
+  return val <= lo ? lo : val <= hi ? val : hi;
+}
+
+/** Format file path from directory and file name
+ *
+ * @param buff where to store the path
+ * @param size size of buff
+ * @param dir  directory path
+ * @param name file name
+ *
+ * @return true on success, false if the path does not fit in buff
+ */
+static inline bool path_format(char *buff, size_t size,
+                               const char *dir, const char *name)
+{
+  int len = snprintf(buff, size, "%s/%s", dir, name);
+  return len >= 0 && (size_t)len < size;
+}
+
 static void mce_hybris_sensors_quit(void);
+static int  read_number(const char *path);
+static void lw_stop(void);
+static void fbw_stop(void);
+static bool fbw_enable_screen(bool state, bool force);
 
 static void mce_hybris_log(int lev, const char *file,
                            const char *func, const char *fmt,
@@ -73,1628 +118,8582 @@ void mce_hybris_set_log_hook(mce_hybris_log_fn cb)
   log_cb = cb;
 }
 
-/** Wrapper for diagnostic logging
+/** Highest syslog priority value that is not filtered out */
+static int log_level = LOG_DEBUG;
+
+/** Set level above which diagnostic messages are discarded
  *
- * @param lev  syslog priority (=mce_log level) i.e. LOG_ERR etc
- * @param file source code path
- * @param func name of function within file
- * @param fmt  printf compatible format string
- * @param ...  parameters required by the format string
+ * Messages at disabled levels are not formatted at all.
+ *
+ * @param lev syslog priority (=mce_log level) i.e. LOG_WARNING etc
  */
-static void mce_hybris_log(int lev, const char *file, const char *func,
-                           const char *fmt, ...)
+void mce_hybris_set_log_level(int lev)
 {
-  char *msg = 0;
-  va_list va;
-
-  va_start(va, fmt);
-  if( vasprintf(&msg, fmt, va) < 0 ) msg = 0;
-  va_end(va);
-
-  if( msg ) {
-    if( log_cb ) log_cb(lev, file, func, msg);
-    else         fprintf(stderr, "%s: %s: %s\n", file, func, msg);
-    free(msg);
-  }
+  __atomic_store_n(&log_level, lev, __ATOMIC_RELAXED);
 }
 
-/** Logging from hybris plugin mimics mce-log.h API */
-#define mce_log(LEV,FMT,ARGS...) \
-   mce_hybris_log(LEV, __FILE__, __FUNCTION__ ,FMT, ## ARGS)
-
-/* ========================================================================= *
- * THREAD helpers
- * ========================================================================= */
-
-/** Thread start details; used for inserting custom thread setup code */
-typedef struct
-{
-  void  *data;
-  void (*func)(void *);
-} gate_t;
-
-/** Mutex used for synchronous worker thread startup */
-static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-/** Condition used for signaling worker thread startup */
-static pthread_cond_t  gate_cond  = PTHREAD_COND_INITIALIZER;
-
-/** Wrapper for starting new worker thread
- *
- * For use from mce_hybris_start_thread().
+/** Check if messages at given level should be emitted
  *
- * Before the actual thread start routine is called, the
- * new thread is put in to asynchronously cancellabe state
- * and the starter is woken up via condition.
- *
- * @param aptr wrapper data as void pointer
+ * Can be called from any thread.
  *
- * @return 0 on thread exit - via pthread_join()
+ * @param lev syslog priority
  */
-static void *gate_start(void *aptr)
+static inline bool mce_hybris_log_p(int lev)
 {
-  gate_t *gate = aptr;
-
-  void  (*func)(void*);
-  void   *data;
-
-  /* Allow quick and dirty cancellation */
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
-
-  /* Tell thread gate we're up and running */
-  pthread_mutex_lock(&gate_mutex);
-  pthread_cond_broadcast(&gate_cond);
-  pthread_mutex_unlock(&gate_mutex);
-
-  /* Collect data we need, release rest */
-  func = gate->func;
-  data = gate->data;
-  free(gate), gate = 0;
-
-  /* Call the real thread start */
-  func(data);
-
-  return 0;
+  return lev <= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
 }
 
-/** Helper for starting new worker thread
- *
- * @param start function to call from new thread
- * @param arg   data to pass to start function
+/** Pass formatted message to mce, or stderr
  *
- * @return thread id on success, or 0 on error
+ * For use from the glib main loop only.
  */
-static pthread_t mce_hybris_start_thread(void (*start)(void *),
-                                         void* arg)
+static void mce_hybris_log_emit(int lev, const char *file, const char *func,
+                                const char *msg)
 {
-  pthread_t  res = 0;
-  gate_t   *gate = 0;
+  if( log_cb ) log_cb(lev, file, func, msg);
+  else         fprintf(stderr, "%s: %s: %s\n", file, func, msg);
+}
 
-  if( !(gate = calloc(1, sizeof gate)) ) {
-    goto EXIT;
-  }
+/* ------------------------------------------------------------------------- *
+ * deferred logging from worker threads
+ *
+ * Worker threads can not call log_cb directly. Instead each of them
+ * gets a single producer / single consumer ring of fixed size records.
+ * On the hot path the format string is only scanned for argument types
+ * and the arguments are stored as is - no malloc, no formatting. The
+ * glib main loop drains the rings and formats the messages one
+ * conversion at a time.
+ * ------------------------------------------------------------------------- */
 
-  gate->data = arg;
-  gate->func = start;
+/** Number of records in a ring; must be a power of two */
+#define DLOG_RING_SIZE  64
 
-  pthread_mutex_lock(&gate_mutex);
+/** Maximum number of threads with a log ring */
+#define DLOG_RING_COUNT 8
 
-  if( pthread_create(&res, 0, gate_start, gate) != 0 ) {
-    mce_log(LOG_ERR, "could not start worker thread");
+/** Maximum number of arguments stored per record */
+#define DLOG_ARGS_MAX   8
 
-    /* content of res is undefined on failure, force to zero */
-    res = 0;
-  }
-  else {
-    /* wait until thread has had time to start and set
-     * up the cancellation parameters */
-    mce_log(LOG_DEBUG, "waiting worker to start ...");
-    pthread_cond_wait(&gate_cond, &gate_mutex);
-    mce_log(LOG_DEBUG, "worker started");
+/** Space for copies of string arguments per record */
+#define DLOG_TEXT_MAX   64
 
-    /* the thread owns the gate now */
-    gate = 0;
-  }
+/** Stored argument value */
+typedef union
+{
+  int64_t     i;  // integers, %s offset in text[] or -1 for NULL
+  double      d;  // floating point values
+  const void *p;  // pointers
+} dlog_arg_t;
 
-  pthread_mutex_unlock(&gate_mutex);
+/** Unformatted log message */
+typedef struct
+{
+  int         lev;
+  const char *file;
+  const char *func;
+  const char *fmt;    // must be a string literal
+  int         err;    // errno at the time of logging, for %m
+  int         argc;   // number of arg[] used, or -1 if fmt not handled
+  int         textlen;
+  dlog_arg_t  arg[DLOG_ARGS_MAX];
+  char        text[DLOG_TEXT_MAX];
+} dlog_rec_t;
+
+/** Log record ring for one thread
+ *
+ * The owner thread is the only writer of head, and the glib main
+ * loop the only writer of tail. Both indices run freely and are
+ * masked when the record array is accessed.
+ */
+typedef struct
+{
+  dlog_rec_t rec[DLOG_RING_SIZE];
+  unsigned   head;     // next slot to write
+  unsigned   tail;     // next slot to read
+  unsigned   dropped;  // records lost due to full ring
+  int        state;    // DLOG_RING_FREE etc
+} dlog_ring_t;
+
+/** Log ring ownership states */
+enum
+{
+  DLOG_RING_FREE,      // available for claiming
+  DLOG_RING_USED,      // owned by a running thread
+  DLOG_RING_DETACHED,  // owner has exited; release once drained
+};
 
-EXIT:
+/** Log rings for worker threads */
+static dlog_ring_t dlog_ring[DLOG_RING_COUNT];
 
-  free(gate);
+/** Log ring of the current thread, or NULL */
+static __thread dlog_ring_t *dlog_self = 0;
 
-  return res;
-}
+/** Flag for: current thread is a worker that must not call log_cb */
+static __thread bool dlog_worker = false;
 
-/* ========================================================================= *
- * FRAMEBUFFER module
- * ========================================================================= */
+/** Eventfd for waking up the main loop, or -1 if not created */
+static int      dlog_fd  = -1;
 
-/** Handle for libhybris framebuffer plugin */
-static const struct hw_module_t    *mod_fb = 0;
+/** Flag for: main loop wakeup has been requested */
+static bool     dlog_wake = false;
 
-/** Pointer to libhybris frame buffer device object */
-static struct framebuffer_device_t *dev_fb = 0;
+/** Glib source for draining the log rings, or NULL if not attached */
+static GSource *dlog_src = 0;
 
-/** Load libhybris framebuffer plugin
+/** Poll record for dlog_fd */
+static GPollFD  dlog_pfd;
+
+/** Wake up the main loop unless already done
  *
- * @return true on success, false on failure
+ * Can be called from any thread.
  */
-static bool mce_hybris_modfb_load(void)
+static void dlog_kick(void)
 {
-  static bool done = false;
-
-  if( !done ) {
-    done = true;
-    hw_get_module(GRALLOC_HARDWARE_FB0, &mod_fb);
-    if( !mod_fb ) {
-      mce_log(LOG_WARNING, "failed to open frame buffer module");
-    }
-    else {
-      mce_log(LOG_DEBUG, "mod_fb = %p", mod_fb);
+  if( !__atomic_exchange_n(&dlog_wake, true, __ATOMIC_ACQ_REL) ) {
+    uint64_t one = 1;
+    if( write(dlog_fd, &one, sizeof one) == -1 ) {
+      /* EAGAIN = counter saturated, main loop is going to wake up anyway */
     }
   }
-
-  return mod_fb != 0;
 }
 
-/** Unload libhybris framebuffer plugin
+/** Claim a log ring for the current thread
+ *
+ * Called from new worker threads before the actual thread function.
  */
-static void mce_hybris_modfb_unload(void)
+static void dlog_attach(void)
 {
+  dlog_worker = true;
 
-  /* cleanup dependencies */
-  mce_hybris_framebuffer_quit();
+  if( dlog_fd == -1 ) {
+    goto cleanup;
+  }
 
-  /* actually unload the module */
-  // FIXME: how to unload libhybris modules?
-}
+  for( int i = 0; i < DLOG_RING_COUNT; ++i ) {
+    int want = DLOG_RING_FREE;
+    if( __atomic_compare_exchange_n(&dlog_ring[i].state, &want,
+                                    DLOG_RING_USED, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+      dlog_self = &dlog_ring[i];
+      break;
+    }
+  }
 
-/* ------------------------------------------------------------------------- *
- * framebuffer device
- * ------------------------------------------------------------------------- */
+cleanup:
+  return;
+}
 
-/** Convenience function for opening frame buffer device
+/** Release log ring of the current thread
  *
- * Similar to what we might or might not have available from hardware/fb.h
+ * The ring becomes available to other threads once the main loop
+ * has drained it.
  */
-static int
-mce_framebuffer_open(const struct hw_module_t* module,
-                     struct framebuffer_device_t** device)
+static void dlog_detach(void)
 {
-  return module->methods->open(module, GRALLOC_HARDWARE_FB0,
-                               (struct hw_device_t**)device);
+  if( dlog_self ) {
+    __atomic_store_n(&dlog_self->state, DLOG_RING_DETACHED, __ATOMIC_RELEASE);
+    dlog_self = 0;
+    dlog_kick();
+  }
 }
 
-/** Convenience function for closing frame buffer device
+/** Fetch integer argument of given size
  *
- * Similar to what we might or might not have available from hardware/fb.h
+ * @param va   argument list
+ * @param len  length modifier: 'H'=hh, 'h', 'l', 'q'=ll, 'z', 'j', 't', or 0
+ * @param sig  true for signed conversions
+ *
+ * @return value widened to 64 bits
  */
-static int
-mce_framebuffer_close(struct framebuffer_device_t* device)
-{
-  return device->common.close(&device->common);
-}
-
-/** Initialize libhybris frame buffer device object
+#define dlog_va_int(VA, LEN, SIG) \
+  ((LEN) == 'l' ? ((SIG) ? (int64_t)va_arg(VA, long)      : (int64_t)va_arg(VA, unsigned long)) : \
+   (LEN) == 'q' ? ((SIG) ? (int64_t)va_arg(VA, long long) : (int64_t)va_arg(VA, unsigned long long)) : \
+   (LEN) == 'z' ? (int64_t)va_arg(VA, size_t) : \
+   (LEN) == 'j' ? (int64_t)va_arg(VA, intmax_t) : \
+   (LEN) == 't' ? (int64_t)va_arg(VA, ptrdiff_t) : \
+   (LEN) == 'h' ? ((SIG) ? (int64_t)(short)va_arg(VA, int) : (int64_t)(unsigned short)va_arg(VA, int)) : \
+   (LEN) == 'H' ? ((SIG) ? (int64_t)(signed char)va_arg(VA, int) : (int64_t)(unsigned char)va_arg(VA, int)) : \
+   ((SIG) ? (int64_t)va_arg(VA, int) : (int64_t)va_arg(VA, unsigned)))
+
+/** Scan printf style conversion specification
  *
- * @return true on success, false on failure
+ * @param pos  position after the '%' character
+ * @param len  where to store length modifier, see dlog_va_int()
+ * @param star where to store number of '*' width/precision fields
+ *
+ * @return pointer to the conversion character
  */
-bool mce_hybris_framebuffer_init(void)
+static const char *dlog_scan_spec(const char *pos, int *len, int *star)
 {
-  static bool done = false;
-
-  if( !done ) {
-    done = true;
-
-    if( !mce_hybris_modfb_load() ) {
-      goto cleanup;
-    }
+  *len  = 0;
+  *star = 0;
 
-    mce_framebuffer_open(mod_fb, &dev_fb);
-    if( !dev_fb ) {
-      mce_log(LOG_ERR, "failed to open framebuffer device");
-    }
-    else {
-      mce_log(LOG_DEBUG, "dev_fb = %p", dev_fb);
-    }
+  pos += strspn(pos, "-+ #0'");
+  for( ; *pos == '*' || (*pos >= '0' && *pos <= '9') || *pos == '.'; ++pos ) {
+    if( *pos == '*' ) ++*star;
   }
 
-cleanup:
-  return dev_fb != 0;
-}
-
-/** Release libhybris frame buffer device object
- */
-void mce_hybris_framebuffer_quit(void)
-{
-  if( dev_fb ) {
-    mce_framebuffer_close(dev_fb), dev_fb = 0;
+  switch( *pos ) {
+  case 'h': *len = (pos[1] == 'h') ? (++pos, 'H') : 'h'; ++pos; break;
+  case 'l': *len = (pos[1] == 'l') ? (++pos, 'q') : 'l'; ++pos; break;
+  case 'q': case 'L': *len = 'q'; ++pos; break;
+  case 'z': case 'j': case 't': *len = *pos++; break;
+  default: break;
   }
+
+  return pos;
 }
 
-/** Set frame buffer power state via libhybris
+/** Store unformatted message to the log ring of the current thread
  *
- * @param state true to power on, false to power off
- *
- * @return true on success, false on failure
+ * Never blocks or allocates memory; if the ring is full, the
+ * message is dropped.
  */
-bool mce_hybris_framebuffer_set_power(bool state)
+static void dlog_push(int lev, const char *file, const char *func,
+                      const char *fmt, va_list va)
 {
-  bool ack = false;
+  dlog_ring_t *ring = dlog_self;
 
-  if( !mce_hybris_framebuffer_init() ) {
-    goto cleanup;
-  }
+  unsigned head = ring->head;
+  unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
 
-  if( dev_fb->enableScreen(dev_fb, state) < 0 ) {
+  if( head - tail >= DLOG_RING_SIZE ) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
     goto cleanup;
   }
 
-  ack = true;
+  dlog_rec_t *rec = &ring->rec[head & (DLOG_RING_SIZE - 1)];
 
-cleanup:
-  return ack;
-}
+  rec->lev     = lev;
+  rec->file    = file;
+  rec->func    = func;
+  rec->fmt     = fmt;
+  rec->err     = errno;
+  rec->argc    = 0;
+  rec->textlen = 0;
 
-/* ========================================================================= *
- * LIGHTS module
- * ========================================================================= */
+  for( const char *pos = fmt; (pos = strchr(pos, '%')); ++pos ) {
+    int len, star;
 
-/** Handle for libhybris lights plugin */
-static const struct hw_module_t *mod_lights    = 0;
+    if( *++pos == '%' || *pos == 'm' ) {
+      continue;
+    }
 
-/** Pointer to libhybris frame display backlight device object */
-static struct light_device_t    *dev_backlight = 0;
+    pos = dlog_scan_spec(pos, &len, &star);
 
-/** Pointer to libhybris frame keypad backlight device object */
-static struct light_device_t    *dev_keypad    = 0;
+    if( rec->argc + star + 1 > DLOG_ARGS_MAX ) {
+      rec->argc = -1;
+      break;
+    }
 
-/** Pointer to libhybris frame indicator led device object */
-static struct light_device_t    *dev_indicator = 0;
+    while( star-- > 0 ) {
+      rec->arg[rec->argc++].i = va_arg(va, int);
+    }
 
-/** Load libhybris lights plugin
- *
- * @return true on success, false on failure
- */
-static bool mce_hybris_modlights_load(void)
-{
-  static bool done = false;
+    dlog_arg_t *arg = &rec->arg[rec->argc++];
 
-  if( !done ) {
-    done = true;
-    hw_get_module(LIGHTS_HARDWARE_MODULE_ID, &mod_lights);
-    if( !mod_lights ) {
-      mce_log(LOG_WARNING, "failed to open lights module");
+    switch( *pos ) {
+    case 'd': case 'i':
+      arg->i = dlog_va_int(va, len, true);
+      break;
+
+    case 'u': case 'o': case 'x': case 'X': case 'c':
+      arg->i = dlog_va_int(va, len, false);
+      break;
+
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+      arg->d = (len == 'q') ? (double)va_arg(va, long double) :
+                              va_arg(va, double);
+      break;
+
+    case 'p':
+      arg->p = va_arg(va, void *);
+      break;
+
+    case 's':
+      {
+        const char *str = va_arg(va, const char *);
+        if( !str ) {
+          arg->i = -1;
+          break;
+        }
+        if( rec->textlen >= DLOG_TEXT_MAX ) {
+          /* Out of space; points to terminator of the last string */
+          arg->i = DLOG_TEXT_MAX - 1;
+          break;
+        }
+        /* Copy as much as fits; longer strings get truncated */
+        size_t avail = DLOG_TEXT_MAX - rec->textlen - 1;
+        size_t size  = strnlen(str, avail);
+        memcpy(rec->text + rec->textlen, str, size);
+        arg->i = rec->textlen;
+        rec->textlen += size;
+        rec->text[rec->textlen++] = 0;
+      }
+      break;
+
+    default:
+      /* Not supported; emit format string as is */
+      rec->argc = -1;
+      break;
     }
-    else {
-      mce_log(LOG_DEBUG, "mod_lights = %p", mod_lights);
+
+    if( rec->argc < 0 ) {
+      break;
     }
   }
 
-  return mod_lights != 0;
-}
-
-/** Unload libhybris lights plugin
- */
-static void mce_hybris_modlights_unload(void)
-{
-  /* cleanup dependencies */
-  mce_hybris_backlight_quit();
-  mce_hybris_keypad_quit();
-  mce_hybris_indicator_quit();
-
-  /* actually unload the module */
-  // FIXME: how to unload libhybris modules?
-}
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 
-/* ------------------------------------------------------------------------- *
- * display backlight device
- * ------------------------------------------------------------------------- */
+  dlog_kick();
 
-/** Convenience function for opening a light device
- *
- * Similar to what we might or might not have available from hardware/lights.h
- */
-static int
-mce_light_device_open(const struct hw_module_t* module, const char *id,
-                      struct light_device_t** device)
-{
-  return module->methods->open(module, id, (struct hw_device_t**)device);
+cleanup:
+  return;
 }
 
-/** Convenience function for closing a light device
+/** Format stored message
  *
- * Similar to what we might or might not have available from hardware/lights.h
+ * @param rec  unformatted message
+ * @param buff where to store the text
+ * @param size size of buff
  */
-static void
-mce_light_device_close(const struct light_device_t *device)
+static void dlog_format(const dlog_rec_t *rec, char *buff, size_t size)
 {
-    device->common.close((struct hw_device_t*) device);
-}
+  size_t used = 0;
+  int    argi = 0;
+
+#define DLOG_APPEND(FMT, ARGS...) do {\
+    if( used < size ) {\
+      int rc = snprintf(buff + used, size - used, FMT, ##ARGS);\
+      if( rc > 0 ) used += rc;\
+    }\
+  } while( 0 )
+
+  if( rec->argc < 0 ) {
+    DLOG_APPEND("%s", rec->fmt);
+    goto cleanup;
+  }
 
-/** Initialize libhybris display backlight device object
- *
- * @return true on success, false on failure
- */
-bool mce_hybris_backlight_init(void)
-{
-  static bool done = false;
+  for( const char *pos = rec->fmt; *pos; ) {
+    const char *beg = pos;
 
-  if( !done ) {
-    done = true;
+    if( *pos != '%' ) {
+      pos += strcspn(pos, "%");
+      DLOG_APPEND("%.*s", (int)(pos - beg), beg);
+      continue;
+    }
 
-    if( !mce_hybris_modlights_load() ) {
-      goto cleanup;
+    if( *++pos == '%' ) {
+      DLOG_APPEND("%%");
+      ++pos;
+      continue;
     }
 
-    mce_light_device_open(mod_lights, LIGHT_ID_BACKLIGHT, &dev_backlight);
+    if( *pos == 'm' ) {
+      DLOG_APPEND("%s", strerror(rec->err));
+      ++pos;
+      continue;
+    }
 
-    if( !dev_backlight ) {
-      mce_log(LOG_WARNING, "failed to open backlight device");
+    int len, star;
+    const char *end = dlog_scan_spec(pos, &len, &star);
+
+    /* Rebuild the conversion specification with '*' fields resolved
+     * and length modifier matching the stored 64 bit values */
+    char spec[48];
+    size_t n = 0;
+    spec[n++] = '%';
+    for( const char *tmp = pos; tmp < end && n < sizeof spec - 24; ++tmp ) {
+      if( *tmp == '*' ) {
+        n += snprintf(spec + n, sizeof spec - n, "%d",
+                      (int)rec->arg[argi++].i);
+      }
+      else if( !strchr("hlqLzjt", *tmp) ) {
+        spec[n++] = *tmp;
+      }
     }
-    else {
-      mce_log(LOG_DEBUG, "%s() -> %p", __FUNCTION__, dev_backlight);
+
+    const dlog_arg_t *arg = &rec->arg[argi++];
+    char conv = *end;
+
+    switch( conv ) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+      spec[n++] = 'l';
+      spec[n++] = 'l';
+      spec[n++] = conv;
+      spec[n] = 0;
+      if( conv == 'd' || conv == 'i' )
+        DLOG_APPEND(spec, (long long)arg->i);
+      else
+        DLOG_APPEND(spec, (unsigned long long)arg->i);
+      break;
+
+    case 'c':
+      spec[n++] = conv, spec[n] = 0;
+      DLOG_APPEND(spec, (int)arg->i);
+      break;
+
+    case 'p':
+      spec[n++] = conv, spec[n] = 0;
+      DLOG_APPEND(spec, arg->p);
+      break;
+
+    case 's':
+      spec[n++] = conv, spec[n] = 0;
+      DLOG_APPEND(spec, arg->i < 0 ? "(null)" : rec->text + arg->i);
+      break;
+
+    default:
+      spec[n++] = conv, spec[n] = 0;
+      DLOG_APPEND(spec, arg->d);
+      break;
     }
+
+    pos = end + 1;
   }
 
 cleanup:
-  return dev_backlight != 0;
-}
-
-/** Release libhybris display backlight device object
- */
-void mce_hybris_backlight_quit(void)
-{
-  if( dev_backlight ) {
-    mce_light_device_close(dev_backlight), dev_backlight = 0;
-  }
+#undef DLOG_APPEND
+  return;
 }
 
-/** Set display backlight brightness via libhybris
- *
- * @param level 0=off ... 255=maximum brightness
+/** Emit all messages currently in the log rings
  *
- * @return true on success, false on failure
+ * For use from the glib main loop only.
  */
-bool mce_hybris_backlight_set_brightness(int level)
+static void dlog_drain(void)
 {
-  bool     ack = false;
-  unsigned lev = (level < 0) ? 0 : (level > 255) ? 255 : level;
+  char text[512];
 
-  struct light_state_t lst;
+  __atomic_store_n(&dlog_wake, false, __ATOMIC_RELEASE);
 
-  if( !mce_hybris_backlight_init() ) {
-    goto cleanup;
-  }
+  for( int i = 0; i < DLOG_RING_COUNT; ++i ) {
+    dlog_ring_t *ring  = &dlog_ring[i];
+    int          state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
 
-  memset(&lst, 0, sizeof lst);
-  lst.color          = (0xff << 24) | (lev << 16) | (lev << 8) | (lev << 0);
-  lst.flashMode      = LIGHT_FLASH_NONE;
-  lst.flashOnMS      = 0;
-  lst.flashOffMS     = 0;
-  lst.brightnessMode = BRIGHTNESS_MODE_USER;
+    if( state == DLOG_RING_FREE ) {
+      continue;
+    }
 
-  if( dev_backlight->set_light(dev_backlight, &lst) < 0 ) {
-    goto cleanup;
-  }
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned tail = ring->tail;
 
-  ack = true;
+    for( ; tail != head; ++tail ) {
+      const dlog_rec_t *rec = &ring->rec[tail & (DLOG_RING_SIZE - 1)];
+      dlog_format(rec, text, sizeof text);
+      mce_hybris_log_emit(rec->lev, rec->file, rec->func, text);
+    }
 
-cleanup:
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 
-  mce_log(LOG_DEBUG, "%s(%d) -> %s", __FUNCTION__, level, ack ? "success" : "failure");
+    unsigned dropped = __atomic_exchange_n(&ring->dropped, 0,
+                                           __ATOMIC_RELAXED);
+    if( dropped ) {
+      snprintf(text, sizeof text, "log ring overflow; %u messages lost",
+               dropped);
+      mce_hybris_log_emit(LOG_WARNING, __FILE__, __FUNCTION__, text);
+    }
 
-  return ack;
+    if( state == DLOG_RING_DETACHED ) {
+      ring->head = ring->tail = 0;
+      __atomic_store_n(&ring->state, DLOG_RING_FREE, __ATOMIC_RELEASE);
+    }
+  }
 }
 
-/* ------------------------------------------------------------------------- *
- * keypad backlight device
- * ------------------------------------------------------------------------- */
-
-/** Initialize libhybris keypad backlight device object
- *
- * @return true on success, false on failure
+/** Glib source prepare callback for the log rings
  */
-bool mce_hybris_keypad_init(void)
+static gboolean dlog_prepare_cb(GSource *src, gint *timeout)
 {
-  static bool done = false;
-
-  if( !done ) {
-    done = true;
-
-    if( !mce_hybris_modlights_load() ) {
-      goto cleanup;
-    }
+  (void)src;
 
-    mce_light_device_open(mod_lights, LIGHT_ID_KEYBOARD, &dev_keypad);
+  *timeout = -1;
+  return __atomic_load_n(&dlog_wake, __ATOMIC_ACQUIRE);
+}
 
-    if( !dev_keypad ) {
-      mce_log(LOG_WARNING, "failed to open keypad backlight device");
-    }
-    else {
-      mce_log(LOG_DEBUG, "%s() -> %p", __FUNCTION__, dev_keypad);
-    }
-  }
+/** Glib source check callback for the log rings
+ */
+static gboolean dlog_check_cb(GSource *src)
+{
+  (void)src;
 
-cleanup:
-  return dev_keypad != 0;
+  return ((dlog_pfd.revents & G_IO_IN) ||
+          __atomic_load_n(&dlog_wake, __ATOMIC_ACQUIRE));
 }
 
-/** Release libhybris keypad backlight device object
+/** Glib source dispatch callback for the log rings
  */
-void mce_hybris_keypad_quit(void)
+static gboolean dlog_dispatch_cb(GSource *src, GSourceFunc cb, gpointer aptr)
 {
-  if( dev_keypad ) {
-    mce_light_device_close(dev_keypad), dev_keypad = 0;
+  (void)src; (void)cb; (void)aptr;
+
+  uint64_t cnt = 0;
+  if( read(dlog_fd, &cnt, sizeof cnt) == -1 ) {
+    /* EAGAIN = nothing to clear */
   }
+
+  dlog_drain();
+
+  return G_SOURCE_CONTINUE;
 }
 
-/** Set display keypad brightness via libhybris
- *
- * @param level 0=off ... 255=maximum brightness
+/** Glib source callbacks for the log rings */
+static GSourceFuncs dlog_funcs =
+{
+  .prepare  = dlog_prepare_cb,
+  .check    = dlog_check_cb,
+  .dispatch = dlog_dispatch_cb,
+};
+
+/** Set up deferred logging; called before starting worker threads
  *
- * @return true on success, false on failure
+ * For use from the glib main loop only.
  */
-bool mce_hybris_keypad_set_brightness(int level)
+static void dlog_init(void)
 {
-  bool     ack = false;
-  unsigned lev = (level < 0) ? 0 : (level > 255) ? 255 : level;
-
-  struct light_state_t lst;
+  if( dlog_fd != -1 ) {
+    goto cleanup;
+  }
 
-  if( !mce_hybris_keypad_init() ) {
+  if( (dlog_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 ) {
+    /* Worker threads will not be able to log */
     goto cleanup;
   }
 
-  memset(&lst, 0, sizeof lst);
-  lst.color          = (0xff << 24) | (lev << 16) | (lev << 8) | (lev << 0);
-  lst.flashMode      = LIGHT_FLASH_NONE;
-  lst.flashOnMS      = 0;
-  lst.flashOffMS     = 0;
-  lst.brightnessMode = BRIGHTNESS_MODE_USER;
+  dlog_src = g_source_new(&dlog_funcs, sizeof(GSource));
+  dlog_pfd.fd      = dlog_fd;
+  dlog_pfd.events  = G_IO_IN | G_IO_ERR;
+  dlog_pfd.revents = 0;
+  g_source_add_poll(dlog_src, &dlog_pfd);
+  g_source_attach(dlog_src, 0);
+
+cleanup:
+  return;
+}
 
-  if( dev_keypad->set_light(dev_keypad, &lst) < 0 ) {
+/** Flush and release deferred logging resources
+ *
+ * Must be called only after all worker threads have been stopped.
+ */
+static void dlog_quit(void)
+{
+  if( dlog_fd == -1 ) {
     goto cleanup;
   }
 
-  ack = true;
+  dlog_drain();
 
-cleanup:
+  if( dlog_src ) {
+    g_source_destroy(dlog_src);
+    g_source_unref(dlog_src), dlog_src = 0;
+  }
 
-  mce_log(LOG_DEBUG, "%s(%d) -> %s", __FUNCTION__, level, ack ? "success" : "failure");
+  close(dlog_fd), dlog_fd = -1;
 
-  return ack;
+cleanup:
+  return;
 }
 
 /* ------------------------------------------------------------------------- *
- * indicator led device
+ * logging api
  * ------------------------------------------------------------------------- */
 
-/** Read number from file */
-static int read_number(const char *path)
+/** Wrapper for diagnostic logging
+ *
+ * Messages from worker threads are passed to the main loop via
+ * the deferred logging rings.
+ *
+ * @param lev  syslog priority (=mce_log level) i.e. LOG_ERR etc
+ * @param file source code path
+ * @param func name of function within file
+ * @param fmt  printf compatible format string
+ * @param ...  parameters required by the format string
+ */
+static void mce_hybris_log(int lev, const char *file, const char *func,
+                           const char *fmt, ...)
 {
-  int res = -1;
-  int fd  = -1;
-  char tmp[64];
+  char *msg = 0;
+  va_list va;
 
-  if( (fd = open(path, O_RDONLY)) == -1 ) {
-    goto cleanup;
+  va_start(va, fmt);
+  if( dlog_self ) {
+    dlog_push(lev, file, func, fmt, va);
   }
-  int rc = read(fd, tmp, sizeof tmp - 1);
-  if( rc < 0 ) {
-    goto cleanup;
+  else if( !dlog_worker ) {
+    if( vasprintf(&msg, fmt, va) < 0 ) msg = 0;
   }
-  tmp[rc] = 0;
-  res = strtol(tmp, 0, 0);
-
-cleanup:
-  if( fd != -1 ) close(fd);
+  va_end(va);
 
-  return res;
+  if( msg ) {
+    mce_hybris_log_emit(lev, file, func, msg);
+    free(msg);
+  }
 }
 
-/** Sysfs control paths for a led */
-typedef struct
-{
-  const char *on;  // W
-  const char *off; // W
-  const char *val; // W
-  const char *max; // R
-} led_paths_t;
+/** Logging from hybris plugin mimics mce-log.h API */
+#define mce_log(LEV,FMT,ARGS...) do {\
+    if( mce_hybris_log_p(LEV) )\
+      mce_hybris_log(LEV, __FILE__, __FUNCTION__ ,FMT, ## ARGS);\
+  } while( 0 )
 
-/** Sysfs state for a led */
+/* ========================================================================= *
+ * THREAD helpers
+ * ========================================================================= */
+
+/** Thread start details; used for inserting custom thread setup code */
 typedef struct
 {
-  int fd_on;
-  int fd_off;
-  int fd_val;
-  int maxval;
-} led_state_t;
+  void  *data;
+  void (*func)(void *);
+} gate_t;
 
-/** Set LED brightness
- *
- * @param self led state
- * @param val  brightness in 0 ... 255 range
- */
-static void led_state_set_value(const led_state_t *self, int val)
+/** Mutex used for synchronous worker thread startup */
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Condition used for signaling worker thread startup */
+static pthread_cond_t  gate_cond  = PTHREAD_COND_INITIALIZER;
+
+/** Cleanup handler for worker threads
+ *
+ * Executed both on normal return and on cancellation, so that
+ * the log ring of the thread is not leaked.
+ *
+ * @param aptr unused
+ */
+static void gate_cleanup(void *aptr)
+{
+  (void)aptr;
+
+  dlog_detach();
+}
+
+/** Wrapper for starting new worker thread
+ *
+ * For use from mce_hybris_start_thread().
+ *
+ * Before the actual thread start routine is called, the
+ * new thread is put in to asynchronously cancellabe state
+ * and the starter is woken up via condition. Start routines
+ * that take locks must disable cancellation themselves.
+ *
+ * @param aptr wrapper data as void pointer
+ *
+ * @return 0 on thread exit - via pthread_join()
+ */
+static void *gate_start(void *aptr)
+{
+  gate_t *gate = aptr;
+
+  void  (*func)(void*);
+  void   *data;
+
+  /* Allow quick and dirty cancellation */
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+  /* Logging from this thread goes via main loop */
+  dlog_attach();
+
+  /* Tell thread gate we're up and running */
+  pthread_mutex_lock(&gate_mutex);
+  pthread_cond_broadcast(&gate_cond);
+  pthread_mutex_unlock(&gate_mutex);
+
+  /* Collect data we need, release rest */
+  func = gate->func;
+  data = gate->data;
+  free(gate), gate = 0;
+
+  /* Call the real thread start */
+  pthread_cleanup_push(gate_cleanup, 0);
+  func(data);
+  pthread_cleanup_pop(1);
+
+  return 0;
+}
+
+/** Helper for starting new worker thread
+ *
+ * @param start function to call from new thread
+ * @param arg   data to pass to start function
+ *
+ * @return thread id on success, or 0 on error
+ */
+static pthread_t mce_hybris_start_thread(void (*start)(void *),
+                                         void* arg)
+{
+  pthread_t  res = 0;
+  gate_t   *gate = 0;
+
+  if( !(gate = calloc(1, sizeof *gate)) ) {
+    goto EXIT;
+  }
+
+  gate->data = arg;
+  gate->func = start;
+
+  dlog_init();
+
+  pthread_mutex_lock(&gate_mutex);
+
+  if( pthread_create(&res, 0, gate_start, gate) != 0 ) {
+    mce_log(LOG_ERR, "could not start worker thread");
+
+    /* content of res is undefined on failure, force to zero */
+    res = 0;
+  }
+  else {
+    /* wait until thread has had time to start and set
+     * up the cancellation parameters */
+    mce_log(LOG_DEBUG, "waiting worker to start ...");
+    pthread_cond_wait(&gate_cond, &gate_mutex);
+    mce_log(LOG_DEBUG, "worker started");
+
+    /* the thread owns the gate now */
+    gate = 0;
+  }
+
+  pthread_mutex_unlock(&gate_mutex);
+
+EXIT:
+
+  free(gate);
+
+  return res;
+}
+
+/* ========================================================================= *
+ * TIME helpers
+ * ========================================================================= */
+
+/** Get current monotonic time stamp
+ *
+ * Uses the same time base as glib timers.
+ *
+ * @return milliseconds since unspecified reference point
+ */
+static int64_t mce_hybris_get_tick(void)
+{
+  struct timespec ts = { 0, 0 };
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (int64_t)1000 + ts.tv_nsec / 1000000;
+}
+
+/** Get current monotonic time stamp with microsecond resolution
+ *
+ * @return microseconds since unspecified reference point
+ */
+static int64_t mce_hybris_get_tick_us(void)
+{
+  struct timespec ts = { 0, 0 };
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (int64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+/* ========================================================================= *
+ * TRACE ring
+ * ========================================================================= */
+
+/** Number of records in the trace ring; must be a power of two */
+#define TRACE_RING_SIZE 1024
+
+/** Trace file header magic: "MHTR" */
+#define TRACE_FILE_MAGIC 0x5254484du
+
+/** Trace file format version */
+#define TRACE_FILE_VERSION 1
+
+/** Fixed memory ring of recent hal / sysfs operations
+ *
+ * Any thread can add records. A slot is claimed by incrementing the
+ * free running head index, and the seq field of the record is set
+ * to the index + 1 after the other fields have been written; readers
+ * use it to skip records that are incomplete or being overwritten.
+ */
+static struct
+{
+  mce_hybris_trace_t rec[TRACE_RING_SIZE];
+  uint32_t           head;
+} trace_ring;
+
+/** Get trace time stamp
+ *
+ * @return CLOCK_MONOTONIC time [us]
+ */
+static inline int64_t trace_now(void)
+{
+  return mce_hybris_get_tick_us();
+}
+
+/** Add record to the trace ring
+ *
+ * Can be called from any thread. Never blocks.
+ *
+ * @param op     MCE_HYBRIS_TRACE_xxx
+ * @param arg    operation specific argument, e.g. light id
+ * @param result operation result
+ * @param t0     trace_now() at the start of the operation
+ */
+static void trace_add(int op, int arg, int32_t result, int64_t t0)
+{
+  int64_t  t1  = trace_now();
+  uint32_t idx = __atomic_fetch_add(&trace_ring.head, 1, __ATOMIC_RELAXED);
+
+  mce_hybris_trace_t *rec = &trace_ring.rec[idx & (TRACE_RING_SIZE - 1)];
+
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  rec->op        = op;
+  rec->arg       = arg;
+  rec->result    = result;
+  rec->duration  = (t1 - t0 > UINT32_MAX) ? UINT32_MAX : (uint32_t)(t1 - t0);
+  rec->timestamp = t0;
+
+  __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/** Add sensor event record to the trace ring
+ *
+ * @param eve sensor event
+ */
+static void trace_add_event(const mce_hybris_sensor_event_t *eve)
+{
+  int32_t bits;
+  memcpy(&bits, &eve->value[0], sizeof bits);
+  trace_add(MCE_HYBRIS_TRACE_SENSOR_EVENT, eve->type, bits, trace_now());
+}
+
+/** Evaluate expression returning int and record it to the trace ring */
+#define TRACE_CALL(OP, ARG, EXPR) ({\
+    int64_t trace_t0_ = trace_now();\
+    int     trace_rc_ = (EXPR);\
+    trace_add((OP), (ARG), trace_rc_, trace_t0_);\
+    trace_rc_;\
+  })
+
+/** Copy recent trace records, oldest first
+ *
+ * Can be called from any thread.
+ *
+ * @param buf where to store records
+ * @param max number of records that fit in buf
+ *
+ * @return number of records copied
+ */
+int mce_hybris_trace_dump(mce_hybris_trace_t *buf, int max)
+{
+  uint32_t head = __atomic_load_n(&trace_ring.head, __ATOMIC_ACQUIRE);
+  uint32_t span = (head < TRACE_RING_SIZE) ? head : TRACE_RING_SIZE;
+
+  if( max < 0 ) {
+    max = 0;
+  }
+  if( span > (uint32_t)max ) {
+    span = max;
+  }
+
+  int cnt = 0;
+
+  for( uint32_t idx = head - span; idx != head; ++idx ) {
+    const mce_hybris_trace_t *rec = &trace_ring.rec[idx & (TRACE_RING_SIZE - 1)];
+
+    uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    buf[cnt] = *rec;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* Skip records that were incomplete or got overwritten */
+    if( seq != idx + 1 ||
+        __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq ) {
+      continue;
+    }
+    ++cnt;
+  }
+
+  return cnt;
+}
+
+/** Write recent trace records to a file
+ *
+ * The file consists of a header - magic, version, record size and
+ * record count as native 32 bit integers - followed by the records
+ * from mce_hybris_trace_dump().
+ *
+ * @param path file to write
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_trace_write(const char *path)
+{
+  static mce_hybris_trace_t buf[TRACE_RING_SIZE];
+
+  bool ack = false;
+  int  fd  = -1;
+  int  cnt = mce_hybris_trace_dump(buf, TRACE_RING_SIZE);
+
+  uint32_t hdr[4] =
+  {
+    TRACE_FILE_MAGIC, TRACE_FILE_VERSION, sizeof *buf, (uint32_t)cnt
+  };
+
+  if( (fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) == -1 ) {
+    mce_log(LOG_WARNING, "%s: open failed: %m", path);
+    goto cleanup;
+  }
+
+  ssize_t size = cnt * sizeof *buf;
+
+  if( write(fd, hdr, sizeof hdr) != sizeof hdr ||
+      write(fd, buf, size) != size ) {
+    mce_log(LOG_WARNING, "%s: write failed: %m", path);
+    goto cleanup;
+  }
+
+  ack = true;
+
+cleanup:
+  if( fd != -1 ) close(fd);
+
+  mce_log(LOG_DEBUG, "%s(%s) -> %d records, %s", __FUNCTION__, path, cnt,
+          ack ? "success" : "failure");
+
+  return ack;
+}
+
+/* ========================================================================= *
+ * RAMP helpers
+ * ========================================================================= */
+
+/** Evaluate intensity curve
+ *
+ * @param curve MCE_HYBRIS_CURVE_LINEAR etc
+ * @param t     position along the transition [0 ... 1]
+ *
+ * @return relative intensity [0 ... 1]
+ */
+static float ramp_curve_value(mce_hybris_curve_t curve, float t)
+{
+  const float m_pi   = (float)M_PI;
+  const float m_pi_2 = (float)M_PI_2;
+
+  if( t <= 0.0f ) return 0.0f;
+  if( t >= 1.0f ) return 1.0f;
+
+  switch( curve ) {
+  case MCE_HYBRIS_CURVE_EASE_OUT:
+    return sinf(t * m_pi_2);
+  case MCE_HYBRIS_CURVE_EASE_IN:
+    return 1.0f - cosf(t * m_pi_2);
+  case MCE_HYBRIS_CURVE_SMOOTH:
+    return (1.0f - cosf(t * m_pi)) * 0.5f;
+  case MCE_HYBRIS_CURVE_LINEAR:
+  default:
+    break;
+  }
+
+  return t;
+}
+
+/* ========================================================================= *
+ * PROBE cache
+ * ========================================================================= */
+
+/** Probe results that can be cached across boots */
+typedef enum
+{
+  PROBE_MOD_FB          = 1u << 0,
+  PROBE_MOD_LIGHTS      = 1u << 1,
+  PROBE_MOD_SENSORS     = 1u << 2,
+  PROBE_DEV_BACKLIGHT   = 1u << 3,
+  PROBE_DEV_KEYPAD      = 1u << 4,
+  PROBE_DEV_INDICATOR   = 1u << 5,
+  PROBE_DEV_POLL        = 1u << 6,
+  PROBE_SYSFS_BACKLIGHT = 1u << 7,
+  PROBE_SYSFS_LEDS      = 1u << 8,
+  PROBE_SENSOR_LIST     = 1u << 9,
+} probe_bit_t;
+
+/** Directories holding libhybris modules; used for cache validation */
+static const char * const probe_cache_hal_dirs[] =
+{
+  "/system/lib/hw",
+  "/system/lib64/hw",
+  "/vendor/lib/hw",
+  "/vendor/lib64/hw",
+  0
+};
+
+/** Other files affecting hal behavior; used for cache validation */
+static const char * const probe_cache_hal_files[] =
+{
+  "/system/build.prop",
+  0
+};
+
+/** File holding random id that changes on every boot */
+static const char probe_cache_boot_path[] = "/proc/sys/kernel/random/boot_id";
+
+/** Cached probe results */
+static struct
+{
+  uint32_t key;     // hash of hal libraries
+  uint32_t boot;    // hash of boot id
+  uint32_t known;   // probe_bit_t mask: results available
+  uint32_t present; // probe_bit_t mask: probing succeeded
+  uint32_t sensors; // mask of 1 << MCE_HYBRIS_SENSOR_TYPE_xxx
+} probe_cache;
+
+/** Path to cache file, or NULL when caching is not used */
+static char *probe_cache_path = 0;
+
+/** Flag for: probe things found missing again once per boot */
+static bool probe_cache_retry = false;
+
+/** Once control for loading the cache file */
+static pthread_once_t probe_cache_once = PTHREAD_ONCE_INIT;
+
+/** FNV-1a hash helper
+ *
+ * @param hash initial / previous hash value
+ * @param data data to hash
+ * @param size number of bytes to hash
+ *
+ * @return updated hash value
+ */
+static uint32_t probe_cache_hash(uint32_t hash, const void *data, size_t size)
+{
+  const uint8_t *pos = data;
+
+  while( size-- ) {
+    hash ^= *pos++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/** Hash file name, size and modification time
+ *
+ * @param hash initial / previous hash value
+ * @param path file to hash
+ *
+ * @return updated hash value
+ */
+static uint32_t probe_cache_hash_file(uint32_t hash, const char *path)
+{
+  struct stat st;
+
+  if( stat(path, &st) == 0 ) {
+    int64_t size  = st.st_size;
+    int64_t mtime = st.st_mtime;
+    hash = probe_cache_hash(hash, path, strlen(path));
+    hash = probe_cache_hash(hash, &size, sizeof size);
+    hash = probe_cache_hash(hash, &mtime, sizeof mtime);
+  }
+
+  return hash;
+}
+
+/** Compute cache key from the installed hal libraries
+ *
+ * Only file metadata is used; reading the libraries would
+ * cost more than probing does.
+ *
+ * @return cache key
+ */
+static uint32_t probe_cache_compute_key(void)
+{
+  uint32_t hash = 2166136261u;
+
+  for( int i = 0; probe_cache_hal_dirs[i]; ++i ) {
+    const char *dir = probe_cache_hal_dirs[i];
+
+    hash = probe_cache_hash_file(hash, dir);
+
+    struct dirent **names = 0;
+    int cnt = scandir(dir, &names, 0, alphasort);
+
+    for( int j = 0; j < cnt; ++j ) {
+      char path[PATH_MAX];
+      if( names[j]->d_name[0] != '.' &&
+          path_format(path, sizeof path, dir, names[j]->d_name) ) {
+        hash = probe_cache_hash_file(hash, path);
+      }
+      free(names[j]);
+    }
+    free(names);
+  }
+
+  for( int i = 0; probe_cache_hal_files[i]; ++i ) {
+    hash = probe_cache_hash_file(hash, probe_cache_hal_files[i]);
+  }
+
+  return hash;
+}
+
+/** Compute hash of the current boot id
+ *
+ * @return boot id hash, or zero if not available
+ */
+static uint32_t probe_cache_compute_boot(void)
+{
+  uint32_t hash = 0;
+  char     data[64];
+  int      fd   = open(probe_cache_boot_path, O_RDONLY);
+
+  if( fd == -1 ) {
+    goto cleanup;
+  }
+
+  ssize_t rc = read(fd, data, sizeof data);
+
+  if( rc > 0 ) {
+    hash = probe_cache_hash(2166136261u, data, rc);
+  }
+
+cleanup:
+  if( fd != -1 ) close(fd);
+
+  return hash;
+}
+
+/** Load cache file; via pthread_once()
+ *
+ * Nothing is logged as this can be executed from the prefetch thread.
+ */
+static void probe_cache_load_once(void)
+{
+  FILE *file = 0;
+
+  memset(&probe_cache, 0, sizeof probe_cache);
+
+  if( !probe_cache_path ) {
+    goto cleanup;
+  }
+
+  probe_cache.key  = probe_cache_compute_key();
+  probe_cache.boot = probe_cache_compute_boot();
+
+  if( !(file = fopen(probe_cache_path, "r")) ) {
+    goto cleanup;
+  }
+
+  unsigned key = 0, boot = 0, known = 0, present = 0, sensors = 0;
+
+  if( fscanf(file, "%x %x %x %x %x",
+             &key, &boot, &known, &present, &sensors) != 5 ) {
+    goto cleanup;
+  }
+
+  /* Results are valid only for the hal libraries they were made with */
+  if( key != probe_cache.key ) {
+    goto cleanup;
+  }
+
+  /* Optionally negative results are trusted only within the boot they
+   * were made in: things found missing are probed again once per boot
+   * - and the sensor list is read again - while positive results are
+   * kept. */
+  if( probe_cache_retry && (!probe_cache.boot || boot != probe_cache.boot) ) {
+    known &= present & ~PROBE_SENSOR_LIST;
+  }
+
+  probe_cache.known   = known;
+  probe_cache.present = present & known;
+  probe_cache.sensors = sensors;
+
+cleanup:
+  if( file ) fclose(file);
+}
+
+/** Make sure cache file has been loaded */
+static void probe_cache_load(void)
+{
+  pthread_once(&probe_cache_once, probe_cache_load_once);
+}
+
+/** Write cache file
+ */
+static void probe_cache_save(void)
+{
+  char  tmp[PATH_MAX];
+  FILE *file = 0;
+
+  if( !probe_cache_path ) {
+    goto cleanup;
+  }
+
+  int len = snprintf(tmp, sizeof tmp, "%s.tmp", probe_cache_path);
+
+  if( len < 0 || (size_t)len >= sizeof tmp ) {
+    mce_log(LOG_WARNING, "%s: path too long", probe_cache_path);
+    goto cleanup;
+  }
+
+  if( !(file = fopen(tmp, "w")) ) {
+    mce_log(LOG_WARNING, "%s: can't create: %m", tmp);
+    goto cleanup;
+  }
+
+  fprintf(file, "%08x %08x %08x %08x %08x\n",
+          probe_cache.key,
+          probe_cache.boot,
+          __atomic_load_n(&probe_cache.known, __ATOMIC_RELAXED),
+          __atomic_load_n(&probe_cache.present, __ATOMIC_RELAXED),
+          __atomic_load_n(&probe_cache.sensors, __ATOMIC_RELAXED));
+
+  if( fclose(file) == EOF ) {
+    mce_log(LOG_WARNING, "%s: write failed: %m", tmp);
+    unlink(tmp);
+  }
+  else if( rename(tmp, probe_cache_path) == -1 ) {
+    mce_log(LOG_WARNING, "%s: rename failed: %m", probe_cache_path);
+    unlink(tmp);
+  }
+
+cleanup:
+  return;
+}
+
+/** Check whether an earlier probe found something to be missing
+ *
+ * With probe retry enabled, only results made during the current
+ * boot are used.
+ *
+ * @param bit PROBE_MOD_FB etc
+ *
+ * @return true if probing is known to fail, false otherwise
+ */
+static bool probe_cache_is_missing(probe_bit_t bit)
+{
+  probe_cache_load();
+
+  uint32_t known   = __atomic_load_n(&probe_cache.known, __ATOMIC_RELAXED);
+  uint32_t present = __atomic_load_n(&probe_cache.present, __ATOMIC_RELAXED);
+
+  return (known & bit) && !(present & bit);
+}
+
+/** Check whether an earlier boot found something to be present
+ *
+ * @param bit PROBE_MOD_FB etc
+ *
+ * @return true if probing is known to succeed, false otherwise
+ */
+static bool probe_cache_is_present(probe_bit_t bit)
+{
+  probe_cache_load();
+
+  return (__atomic_load_n(&probe_cache.known, __ATOMIC_RELAXED) &
+          __atomic_load_n(&probe_cache.present, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/** Record probing result; cache file is updated on change
+ *
+ * For use from the main thread only.
+ *
+ * @param bit     PROBE_MOD_FB etc
+ * @param present true if probing succeeded, false otherwise
+ */
+static void probe_cache_update(probe_bit_t bit, bool present)
+{
+  probe_cache_load();
+
+  uint32_t known   = probe_cache.known | bit;
+  uint32_t mask    = present ? (probe_cache.present | bit) :
+                               (probe_cache.present & ~bit);
+
+  if( known != probe_cache.known || mask != probe_cache.present ) {
+    __atomic_store_n(&probe_cache.known, known, __ATOMIC_RELAXED);
+    __atomic_store_n(&probe_cache.present, mask, __ATOMIC_RELAXED);
+    probe_cache_save();
+  }
+}
+
+/** Record available sensor types; cache file is updated on change
+ *
+ * For use from the main thread only.
+ *
+ * @param sensors mask of 1 << MCE_HYBRIS_SENSOR_TYPE_xxx
+ */
+static void probe_cache_update_sensors(uint32_t sensors)
+{
+  probe_cache_load();
+
+  bool listed = probe_cache_is_present(PROBE_SENSOR_LIST);
+
+  if( listed && probe_cache.sensors == sensors ) {
+    goto cleanup;
+  }
+
+  __atomic_store_n(&probe_cache.sensors, sensors, __ATOMIC_RELAXED);
+
+  if( listed ) {
+    probe_cache_save();
+  }
+  else {
+    probe_cache_update(PROBE_SENSOR_LIST, true);
+  }
+
+cleanup:
+  return;
+}
+
+/** Check whether an earlier probe found a sensor type to be missing
+ *
+ * With probe retry enabled, only results made during the current
+ * boot are used.
+ *
+ * @param type MCE_HYBRIS_SENSOR_TYPE_xxx
+ *
+ * @return true if sensor is known to be missing, false otherwise
+ */
+static bool probe_cache_lacks_sensor(int type)
+{
+  if( type <= 0 || type >= MCE_HYBRIS_SENSOR_TYPE_COUNT ) {
+    return false;
+  }
+
+  if( !probe_cache_is_present(PROBE_SENSOR_LIST) ) {
+    return false;
+  }
+
+  return !(__atomic_load_n(&probe_cache.sensors, __ATOMIC_RELAXED) &
+           (1u << type));
+}
+
+/** Enable caching of probe results across boots
+ *
+ * Must be called before any other function in this plugin. Results
+ * recorded with different hal libraries are ignored. If the file
+ * is removed, everything is probed again.
+ *
+ * @param path cache file path, or NULL to disable caching
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_set_probe_cache(const char *path)
+{
+  free(probe_cache_path);
+  probe_cache_path = path ? strdup(path) : 0;
+
+  return !path || probe_cache_path;
+}
+
+/** Enable probing things known to be missing again once per boot
+ *
+ * By default results cached with the same hal libraries are trusted
+ * as is, and things found to be missing fail immediately. When retry
+ * is enabled, negative results from earlier boots are ignored, which
+ * helps if devices can be missing due to transient failures.
+ *
+ * Must be called before any other function in this plugin, except
+ * mce_hybris_set_probe_cache().
+ *
+ * @param enable true to enable retry, false to disable
+ */
+void mce_hybris_set_probe_retry(bool enable)
+{
+  probe_cache_retry = enable;
+}
+
+/* ========================================================================= *
+ * MODULE prefetch
+ * ========================================================================= */
+
+/** Libhybris modules that can be loaded in the background */
+typedef enum
+{
+  MOD_PREFETCH_FB,
+  MOD_PREFETCH_LIGHTS,
+  MOD_PREFETCH_SENSORS,
+
+  MOD_PREFETCH_COUNT
+} mod_prefetch_id_t;
+
+/** Background module load state
+ *
+ * The actual loading is done via pthread_once() so that it happens
+ * exactly once regardless of whether the prefetch thread or the first
+ * api call gets there first; the latter simply waits for the load
+ * already in progress to finish.
+ *
+ * Nothing is logged from the prefetch thread; results are reported
+ * when the module is taken in use.
+ */
+typedef struct
+{
+  pthread_once_t            once;
+  void                    (*fetch)(void);
+  const struct hw_module_t *mod;
+} mod_prefetch_t;
+
+/** Prefetch thread id, or 0 if not started */
+static pthread_t mod_prefetch_tid = 0;
+
+/** Sensor list obtained along with prefetched sensors module */
+static const struct sensor_t *mod_prefetch_sensor_lut = 0;
+
+/** Number of entries in mod_prefetch_sensor_lut */
+static int                    mod_prefetch_sensor_cnt = 0;
+
+static void mod_prefetch_fetch_fb(void);
+static void mod_prefetch_fetch_lights(void);
+static void mod_prefetch_fetch_sensors(void);
+
+/** Background module load state for all modules */
+static mod_prefetch_t mod_prefetch[MOD_PREFETCH_COUNT] =
+{
+  [MOD_PREFETCH_FB] = {
+    .once  = PTHREAD_ONCE_INIT,
+    .fetch = mod_prefetch_fetch_fb,
+  },
+  [MOD_PREFETCH_LIGHTS] = {
+    .once  = PTHREAD_ONCE_INIT,
+    .fetch = mod_prefetch_fetch_lights,
+  },
+  [MOD_PREFETCH_SENSORS] = {
+    .once  = PTHREAD_ONCE_INIT,
+    .fetch = mod_prefetch_fetch_sensors,
+  },
+};
+
+/** Mutex serializing module loading
+ *
+ * Prefetching overlaps module loading with other start up work, but
+ * loads are made one at a time: there is no guarantee that dlopen()
+ * of hal libraries via the libhybris android linker, or the module
+ * constructors, can be safely executed in parallel. The prefetch
+ * thread loads modules one after another, so an on-demand load from
+ * the main thread waits for at most one unrelated load.
+ */
+static pthread_mutex_t mod_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Load libhybris framebuffer module */
+static void mod_prefetch_fetch_fb(void)
+{
+  if( !probe_cache_is_missing(PROBE_MOD_FB) ) {
+    pthread_mutex_lock(&mod_prefetch_mutex);
+    hw_get_module(GRALLOC_HARDWARE_FB0, &mod_prefetch[MOD_PREFETCH_FB].mod);
+    pthread_mutex_unlock(&mod_prefetch_mutex);
+  }
+}
+
+/** Load libhybris lights module */
+static void mod_prefetch_fetch_lights(void)
+{
+  if( !probe_cache_is_missing(PROBE_MOD_LIGHTS) ) {
+    pthread_mutex_lock(&mod_prefetch_mutex);
+    hw_get_module(LIGHTS_HARDWARE_MODULE_ID,
+                  &mod_prefetch[MOD_PREFETCH_LIGHTS].mod);
+    pthread_mutex_unlock(&mod_prefetch_mutex);
+  }
+}
+
+/** Load libhybris sensors module and enumerate available sensors */
+static void mod_prefetch_fetch_sensors(void)
+{
+  const struct hw_module_t *mod = 0;
+
+  if( probe_cache_is_missing(PROBE_MOD_SENSORS) ) {
+    goto cleanup;
+  }
+
+  pthread_mutex_lock(&mod_prefetch_mutex);
+
+  hw_get_module(SENSORS_HARDWARE_MODULE_ID, &mod);
+
+  if( mod ) {
+    struct sensors_module_t *sen = (struct sensors_module_t *)mod;
+    mod_prefetch_sensor_cnt = sen->get_sensors_list(sen,
+                                                    &mod_prefetch_sensor_lut);
+  }
+
+  pthread_mutex_unlock(&mod_prefetch_mutex);
+
+cleanup:
+  mod_prefetch[MOD_PREFETCH_SENSORS].mod = mod;
+}
+
+/** Order in which modules are prefetched
+ *
+ * Lights first, as the display backlight is needed early in boot.
+ */
+static const struct
+{
+  mod_prefetch_id_t id;
+  probe_bit_t       bit;
+} mod_prefetch_order[MOD_PREFETCH_COUNT] =
+{
+  { MOD_PREFETCH_LIGHTS,  PROBE_MOD_LIGHTS  },
+  { MOD_PREFETCH_FB,      PROBE_MOD_FB      },
+  { MOD_PREFETCH_SENSORS, PROBE_MOD_SENSORS },
+};
+
+/** Prefetch thread entry point
+ *
+ * @param aptr (thread parameter, not used)
+ */
+static void mod_prefetch_thread(void *aptr)
+{
+  (void)aptr;
+
+  /* Loading must not be interrupted half way through */
+  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, 0);
+
+  for( int i = 0; i < MOD_PREFETCH_COUNT; ++i ) {
+    mod_prefetch_t *self = &mod_prefetch[mod_prefetch_order[i].id];
+
+    pthread_once(&self->once, self->fetch);
+  }
+}
+
+/** Get module, wait for / do the loading as needed
+ *
+ * @param id MOD_PREFETCH_FB etc
+ *
+ * @return module handle, or NULL if loading failed
+ */
+static const struct hw_module_t *mod_prefetch_get(mod_prefetch_id_t id)
+{
+  mod_prefetch_t *self = &mod_prefetch[id];
+
+  pthread_once(&self->once, self->fetch);
+
+  return self->mod;
+}
+
+/** Wait for the prefetch thread to exit
+ */
+static void mod_prefetch_join(void)
+{
+  if( mod_prefetch_tid ) {
+    pthread_join(mod_prefetch_tid, 0), mod_prefetch_tid = 0;
+  }
+}
+
+/** Start loading all libhybris modules in the background
+ *
+ * Optional; if used, this should be called as soon as the plugin
+ * has been loaded. A single background thread loads the modules in
+ * fixed order: lights, framebuffer, sensors. The *_init() functions
+ * will then only wait for the results of loads that are already in
+ * progress, or load the module themselves if the thread has not got
+ * that far yet.
+ *
+ * @return true if prefetch thread was started, false otherwise
+ */
+bool mce_hybris_prefetch_modules(void)
+{
+  bool ack = true;
+  bool any = false;
+
+  if( mod_prefetch_tid ) {
+    goto cleanup;
+  }
+
+  for( int i = 0; i < MOD_PREFETCH_COUNT; ++i ) {
+    if( !probe_cache_is_missing(mod_prefetch_order[i].bit) ) {
+      any = true;
+    }
+  }
+
+  if( !any ) {
+    /* No point in starting a thread just to fail */
+    goto cleanup;
+  }
+
+  mod_prefetch_tid = mce_hybris_start_thread(mod_prefetch_thread, 0);
+  ack = mod_prefetch_tid != 0;
+
+cleanup:
+  return ack;
+}
+
+/* ========================================================================= *
+ * FRAMEBUFFER module
+ * ========================================================================= */
+
+/** Handle for libhybris framebuffer plugin */
+static const struct hw_module_t    *mod_fb = 0;
+
+/** Pointer to libhybris frame buffer device object */
+static struct framebuffer_device_t *dev_fb = 0;
+
+/** Load libhybris framebuffer plugin
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_modfb_load(void)
+{
+  static bool done = false;
+
+  if( !done ) {
+    done = true;
+    mod_fb = mod_prefetch_get(MOD_PREFETCH_FB);
+    probe_cache_update(PROBE_MOD_FB, mod_fb != 0);
+    if( !mod_fb ) {
+      mce_log(LOG_WARNING, "failed to open frame buffer module");
+    }
+    else {
+      mce_log(LOG_DEBUG, "mod_fb = %p", mod_fb);
+    }
+  }
+
+  return mod_fb != 0;
+}
+
+/** Unload libhybris framebuffer plugin
+ */
+static void mce_hybris_modfb_unload(void)
+{
+
+  /* cleanup dependencies */
+  mce_hybris_framebuffer_quit();
+
+  /* actually unload the module */
+  // FIXME: how to unload libhybris modules?
+}
+
+/* ------------------------------------------------------------------------- *
+ * framebuffer device
+ * ------------------------------------------------------------------------- */
+
+/** Convenience function for opening frame buffer device
+ *
+ * Similar to what we might or might not have available from hardware/fb.h
+ */
+static int
+mce_framebuffer_open(const struct hw_module_t* module,
+                     struct framebuffer_device_t** device)
+{
+  return module->methods->open(module, GRALLOC_HARDWARE_FB0,
+                               (struct hw_device_t**)device);
+}
+
+/** Convenience function for closing frame buffer device
+ *
+ * Similar to what we might or might not have available from hardware/fb.h
+ */
+static int
+mce_framebuffer_close(struct framebuffer_device_t* device)
+{
+  return device->common.close(&device->common);
+}
+
+/** Initialize libhybris frame buffer device object
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_framebuffer_init(void)
+{
+  static bool done = false;
+
+  if( !done ) {
+    done = true;
+
+    if( !mce_hybris_modfb_load() ) {
+      goto cleanup;
+    }
+
+    mce_framebuffer_open(mod_fb, &dev_fb);
+    if( !dev_fb ) {
+      mce_log(LOG_ERR, "failed to open framebuffer device");
+    }
+    else {
+      mce_log(LOG_DEBUG, "dev_fb = %p", dev_fb);
+    }
+  }
+
+cleanup:
+  return dev_fb != 0;
+}
+
+/** Release libhybris frame buffer device object
+ */
+void mce_hybris_framebuffer_quit(void)
+{
+  fbw_stop();
+
+  if( dev_fb ) {
+    mce_framebuffer_close(dev_fb), dev_fb = 0;
+  }
+}
+
+/** Set frame buffer power state via libhybris
+ *
+ * @param state true to power on, false to power off
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_framebuffer_set_power(bool state)
+{
+  bool ack = false;
+
+  if( !mce_hybris_framebuffer_init() ) {
+    goto cleanup;
+  }
+
+  ack = fbw_enable_screen(state, true);
+
+cleanup:
+  return ack;
+}
+
+/* ------------------------------------------------------------------------- *
+ * asynchronous framebuffer power
+ * ------------------------------------------------------------------------- */
+
+/** Mutex protecting fb power worker state */
+static pthread_mutex_t fbw_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Condition for signaling fb power worker */
+static pthread_cond_t  fbw_cond  = PTHREAD_COND_INITIALIZER;
+
+/** Mutex serializing enableScreen() calls */
+static pthread_mutex_t fbw_call_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Fb power worker thread id, or 0 if not running */
+static pthread_t       fbw_tid   = 0;
+
+/** Flag for: fb power worker thread should exit */
+static bool            fbw_quit  = false;
+
+/** Requested power state: 1=on, 0=off, -1=nothing pending */
+static int             fbw_want  = -1;
+
+/** Power state last set successfully: 1=on, 0=off, -1=unknown */
+static int             fbw_have  = -1;
+
+/** Idle callback id for reporting completed transitions */
+static guint           fbw_done_id = 0;
+
+/** Latest completed transition, to be reported from main loop */
+static struct
+{
+  bool done;     // completion not reported yet
+  bool state;    // power state that was set
+  bool success;  // result of enableScreen()
+  int  duration; // time spent in enableScreen() [ms]
+} fbw_result;
+
+/** Callback for reporting completed transitions */
+static mce_hybris_fb_power_fn fbw_done_hook = 0;
+
+/** Call enableScreen(), skip if state is already in effect
+ *
+ * Can be called from fb power worker or main thread.
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param state    true for power on, false for power off
+ * @param force    true to make the call even if state is in effect
+ * @param duration where to store call duration [ms], or NULL
+ *
+ * @return true on success, false on failure
+ */
+static bool fbw_enable_screen_ex(bool state, bool force, int *duration)
+{
+  bool    ack = false;
+  int64_t t0  = 0;
+  int64_t t1  = 0;
+
+  pthread_mutex_lock(&fbw_call_mutex);
+
+  if( !force && fbw_have == state ) {
+    ack = true;
+  }
+  else {
+    t0  = mce_hybris_get_tick();
+    ack = TRACE_CALL(MCE_HYBRIS_TRACE_FB_POWER, state,
+                     dev_fb->enableScreen(dev_fb, state)) >= 0;
+    t1  = mce_hybris_get_tick();
+    fbw_have = ack ? state : -1;
+  }
+
+  pthread_mutex_unlock(&fbw_call_mutex);
+
+  if( duration ) {
+    *duration = (int)(t1 - t0);
+  }
+
+  return ack;
+}
+
+/** Call enableScreen() synchronously
+ *
+ * Drops pending asynchronous request, if any.
+ *
+ * @param state true for power on, false for power off
+ * @param force true to make the call even if state is in effect
+ *
+ * @return true on success, false on failure
+ */
+static bool fbw_enable_screen(bool state, bool force)
+{
+  pthread_mutex_lock(&fbw_mutex);
+  fbw_want = -1;
+  pthread_mutex_unlock(&fbw_mutex);
+
+  return fbw_enable_screen_ex(state, force, 0);
+}
+
+/** Idle callback for reporting completed transitions to mce
+ */
+static gboolean fbw_done_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  pthread_mutex_lock(&fbw_mutex);
+  fbw_done_id = 0;
+  bool done     = fbw_result.done;
+  bool state    = fbw_result.state;
+  bool success  = fbw_result.success;
+  int  duration = fbw_result.duration;
+  fbw_result.done = false;
+  pthread_mutex_unlock(&fbw_mutex);
+
+  if( done ) {
+    mce_log(LOG_DEBUG, "fb power %s: %s, %d ms", state ? "on" : "off",
+            success ? "success" : "failure", duration);
+
+    if( fbw_done_hook ) {
+      fbw_done_hook(state, success, duration);
+    }
+  }
+
+  return FALSE;
+}
+
+/** Fb power worker thread
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param aptr (thread parameter, not used)
+ */
+static void fbw_thread(void *aptr)
+{
+  (void)aptr;
+
+  pthread_mutex_lock(&fbw_mutex);
+
+  for( ;; ) {
+    if( fbw_want == -1 ) {
+      /* Pending request is handled before exiting */
+      if( fbw_quit ) {
+        break;
+      }
+      pthread_cond_wait(&fbw_cond, &fbw_mutex);
+      continue;
+    }
+
+    /* Requests made while enableScreen() is in progress replace each
+     * other, so that on-off-on sequences fold into the final state */
+    bool state = fbw_want;
+    fbw_want = -1;
+
+    pthread_mutex_unlock(&fbw_mutex);
+
+    int  duration = 0;
+    bool ok = fbw_enable_screen_ex(state, false, &duration);
+
+    pthread_mutex_lock(&fbw_mutex);
+
+    fbw_result.done     = true;
+    fbw_result.state    = state;
+    fbw_result.success  = ok;
+    fbw_result.duration = duration;
+
+    if( !fbw_done_id ) {
+      fbw_done_id = g_idle_add(fbw_done_cb, 0);
+    }
+  }
+
+  pthread_mutex_unlock(&fbw_mutex);
+}
+
+/** Start fb power worker thread
+ *
+ * @return true if the thread is running, false otherwise
+ */
+static bool fbw_start(void)
+{
+  if( !fbw_tid ) {
+    fbw_quit = false;
+    fbw_tid  = mce_hybris_start_thread(fbw_thread, 0);
+  }
+  return fbw_tid != 0;
+}
+
+/** Stop fb power worker thread
+ *
+ * Pending request is handled before the thread exits.
+ */
+static void fbw_stop(void)
+{
+  if( !fbw_tid ) {
+    goto cleanup;
+  }
+
+  pthread_mutex_lock(&fbw_mutex);
+  fbw_quit = true;
+  pthread_cond_broadcast(&fbw_cond);
+  pthread_mutex_unlock(&fbw_mutex);
+
+  pthread_join(fbw_tid, 0), fbw_tid = 0;
+
+  if( fbw_done_id ) {
+    g_source_remove(fbw_done_id), fbw_done_id = 0;
+  }
+
+  /* Report what the worker did not have a chance to */
+  fbw_done_cb(0);
+
+cleanup:
+  return;
+}
+
+/** Set frame buffer power state asynchronously
+ *
+ * The enableScreen() call is made from a worker thread and this
+ * function returns immediately. A new request replaces an older one
+ * that has not been started yet, and requests matching the state
+ * already in effect complete without calling the hal. Completion
+ * and time spent in the hal are reported via the callback set with
+ * mce_hybris_framebuffer_set_power_hook(), from the glib main loop.
+ *
+ * @param state true for power on, false for power off
+ *
+ * @return true if request was queued, false on failure
+ */
+bool mce_hybris_framebuffer_set_power_async(bool state)
+{
+  bool ack = false;
+
+  if( !mce_hybris_framebuffer_init() ) {
+    goto cleanup;
+  }
+
+  if( !fbw_start() ) {
+    goto cleanup;
+  }
+
+  pthread_mutex_lock(&fbw_mutex);
+  fbw_want = state;
+  pthread_cond_broadcast(&fbw_cond);
+  pthread_mutex_unlock(&fbw_mutex);
+
+  ack = true;
+
+cleanup:
+  mce_log(LOG_DEBUG, "%s(%s) -> %s", __FUNCTION__,
+          state ? "on" : "off", ack ? "queued" : "failure");
+
+  return ack;
+}
+
+/** Set callback function for reporting completed asynchronous transitions
+ *
+ * Note: the callback function will be called from the glib main loop.
+ */
+void mce_hybris_framebuffer_set_power_hook(mce_hybris_fb_power_fn cb)
+{
+  fbw_done_hook = cb;
+}
+
+/* ========================================================================= *
+ * LIGHTS module
+ * ========================================================================= */
+
+/** Handle for libhybris lights plugin */
+static const struct hw_module_t *mod_lights    = 0;
+
+/** Pointer to libhybris frame display backlight device object */
+static struct light_device_t    *dev_backlight = 0;
+
+/** Pointer to libhybris frame keypad backlight device object */
+static struct light_device_t    *dev_keypad    = 0;
+
+/** Pointer to libhybris frame indicator led device object */
+static struct light_device_t    *dev_indicator = 0;
+
+/** Load libhybris lights plugin
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_modlights_load(void)
+{
+  static bool done = false;
+
+  if( !done ) {
+    done = true;
+    mod_lights = mod_prefetch_get(MOD_PREFETCH_LIGHTS);
+    probe_cache_update(PROBE_MOD_LIGHTS, mod_lights != 0);
+    if( !mod_lights ) {
+      mce_log(LOG_WARNING, "failed to open lights module");
+    }
+    else {
+      mce_log(LOG_DEBUG, "mod_lights = %p", mod_lights);
+    }
+  }
+
+  return mod_lights != 0;
+}
+
+/** Unload libhybris lights plugin
+ */
+static void mce_hybris_modlights_unload(void)
+{
+  /* cleanup dependencies */
+  lw_stop();
+  mce_hybris_backlight_quit();
+  mce_hybris_keypad_quit();
+  mce_hybris_indicator_quit();
+
+  /* actually unload the module */
+  // FIXME: how to unload libhybris modules?
+}
+
+/* ------------------------------------------------------------------------- *
+ * light device
+ * ------------------------------------------------------------------------- */
+
+/** Convenience function for opening a light device
+ *
+ * Similar to what we might or might not have available from hardware/lights.h
+ */
+static int
+mce_light_device_open(const struct hw_module_t* module, const char *id,
+                      struct light_device_t** device)
+{
+  return module->methods->open(module, id, (struct hw_device_t**)device);
+}
+
+/** Open a light device unless it is known to be missing
+ *
+ * @param id     LIGHT_ID_BACKLIGHT etc
+ * @param bit    PROBE_DEV_BACKLIGHT etc
+ * @param device where to store the device pointer
+ */
+static void
+mce_light_device_probe(const char *id, probe_bit_t bit,
+                       struct light_device_t **device)
+{
+  if( probe_cache_is_missing(bit) ) {
+    mce_log(LOG_DEBUG, "%s: known to be missing", id);
+  }
+  else {
+    mce_light_device_open(mod_lights, id, device);
+    probe_cache_update(bit, *device != 0);
+  }
+}
+
+/** Convenience function for closing a light device
+ *
+ * Similar to what we might or might not have available from hardware/lights.h
+ */
+static void
+mce_light_device_close(const struct light_device_t *device)
+{
+    device->common.close((struct hw_device_t*) device);
+}
+
+/* ------------------------------------------------------------------------- *
+ * asynchronous light writer
+ * ------------------------------------------------------------------------- */
+
+/** One slot mailbox for pending light device write */
+typedef struct
+{
+  struct light_device_t *dev;     // device to write to
+  struct light_state_t   state;   // latest requested state
+  bool                   pending; // state has not been written yet
+  unsigned               seq;     // queueing order of pending state
+  bool                   done;    // completion not reported yet
+  bool                   success; // result of the latest write
+} lw_mailbox_t;
+
+/** Mailboxes for each light device */
+static lw_mailbox_t      lw_mailbox[MCE_HYBRIS_LIGHT_COUNT];
+
+/** Mutex protecting lw_mailbox and worker state */
+static pthread_mutex_t   lw_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Condition for signaling worker and waiters */
+static pthread_cond_t    lw_cond  = PTHREAD_COND_INITIALIZER;
+
+/** Light writer thread id, or 0 if not running */
+static pthread_t         lw_tid   = 0;
+
+/** Flag for: light writer thread should exit */
+static bool              lw_quit  = false;
+
+/** Light currently being written by the worker, or -1 if idle */
+static int               lw_busy  = -1;
+
+/** Counter for ordering pending writes */
+static unsigned          lw_seq   = 0;
+
+/** Flag for: batch of writes is being queued, defer worker wakeup */
+static bool              lw_batch = false;
+
+/** Idle callback id for reporting completed writes */
+static guint             lw_done_id = 0;
+
+/** Callback for reporting completed writes */
+static mce_hybris_light_done_fn lw_done_hook = 0;
+
+/** Running average of backlight set_light() duration */
+static int64_t backlight_cost  = 0; // [us]
+
+/** Idle callback for reporting completed writes to mce
+ */
+static gboolean lw_done_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  bool done[MCE_HYBRIS_LIGHT_COUNT];
+  bool success[MCE_HYBRIS_LIGHT_COUNT];
+
+  pthread_mutex_lock(&lw_mutex);
+  lw_done_id = 0;
+  for( int id = 0; id < MCE_HYBRIS_LIGHT_COUNT; ++id ) {
+    done[id]    = lw_mailbox[id].done;
+    success[id] = lw_mailbox[id].success;
+    lw_mailbox[id].done = false;
+  }
+  pthread_mutex_unlock(&lw_mutex);
+
+  for( int id = 0; id < MCE_HYBRIS_LIGHT_COUNT; ++id ) {
+    if( done[id] && lw_done_hook ) {
+      lw_done_hook(id, success[id]);
+    }
+  }
+
+  return FALSE;
+}
+
+/** Light writer thread
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param aptr (thread parameter, not used)
+ */
+static void lw_thread(void *aptr)
+{
+  (void)aptr;
+
+  pthread_mutex_lock(&lw_mutex);
+
+  for( ;; ) {
+    /* Write pending states in the order they were queued */
+    int id = -1;
+
+    for( int i = 0; i < MCE_HYBRIS_LIGHT_COUNT; ++i ) {
+      if( !lw_mailbox[i].pending ) {
+        continue;
+      }
+      if( id < 0 || (int)(lw_mailbox[i].seq - lw_mailbox[id].seq) < 0 ) {
+        id = i;
+      }
+    }
+
+    if( id < 0 ) {
+      /* Pending writes are flushed before exiting */
+      if( lw_quit ) {
+        break;
+      }
+      pthread_cond_wait(&lw_cond, &lw_mutex);
+      continue;
+    }
+
+    lw_mailbox_t          *mbox = &lw_mailbox[id];
+    struct light_device_t *dev  = mbox->dev;
+    struct light_state_t   lst  = mbox->state;
+
+    mbox->pending = false;
+    lw_busy = id;
+
+    pthread_mutex_unlock(&lw_mutex);
+
+    int64_t t0 = mce_hybris_get_tick_us();
+    bool    ok = TRACE_CALL(MCE_HYBRIS_TRACE_SET_LIGHT, id,
+                            dev->set_light(dev, &lst)) >= 0;
+    int64_t t1 = mce_hybris_get_tick_us();
+
+    if( id == MCE_HYBRIS_LIGHT_BACKLIGHT ) {
+      int64_t cost = __atomic_load_n(&backlight_cost, __ATOMIC_RELAXED);
+      __atomic_store_n(&backlight_cost, (cost * 7 + (t1 - t0)) / 8,
+                       __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&lw_mutex);
+
+    lw_busy = -1;
+    mbox->done    = true;
+    mbox->success = ok;
+
+    if( !lw_done_id ) {
+      lw_done_id = g_idle_add(lw_done_cb, 0);
+    }
+
+    /* Wake up possible lw_cancel() waiters */
+    pthread_cond_broadcast(&lw_cond);
+  }
+
+  pthread_mutex_unlock(&lw_mutex);
+}
+
+/** Check if asynchronous light writes are enabled
+ */
+static bool lw_is_enabled(void)
+{
+  return lw_tid != 0;
+}
+
+/** Drop pending write and wait for ongoing write to a light to finish
+ *
+ * Used before closing the light device.
+ *
+ * @param id MCE_HYBRIS_LIGHT_BACKLIGHT etc
+ */
+static void lw_cancel(mce_hybris_light_t id)
+{
+  if( !lw_is_enabled() ) {
+    goto cleanup;
+  }
+
+  pthread_mutex_lock(&lw_mutex);
+  lw_mailbox[id].pending = false;
+  while( lw_busy == (int)id ) {
+    pthread_cond_wait(&lw_cond, &lw_mutex);
+  }
+  pthread_mutex_unlock(&lw_mutex);
+
+cleanup:
+  return;
+}
+
+/** Write light device state, possibly asynchronously
+ *
+ * In asynchronous mode the state is placed in the mailbox of the
+ * light, replacing any older state that has not been written yet,
+ * and the function returns immediately.
+ *
+ * @param id  MCE_HYBRIS_LIGHT_BACKLIGHT etc
+ * @param dev light device
+ * @param lst state to write
+ *
+ * @return hal return value, or 0 if write was queued
+ */
+static int lw_set_light(mce_hybris_light_t id, struct light_device_t *dev,
+                        const struct light_state_t *lst)
+{
+  if( !lw_is_enabled() ) {
+    return TRACE_CALL(MCE_HYBRIS_TRACE_SET_LIGHT, id,
+                      dev->set_light(dev, lst));
+  }
+
+  pthread_mutex_lock(&lw_mutex);
+  lw_mailbox[id].dev     = dev;
+  lw_mailbox[id].state   = *lst;
+  lw_mailbox[id].pending = true;
+  lw_mailbox[id].seq     = lw_seq++;
+  if( !lw_batch ) {
+    pthread_cond_broadcast(&lw_cond);
+  }
+  pthread_mutex_unlock(&lw_mutex);
+
+  return 0;
+}
+
+/** Start queueing a batch of light writes
+ *
+ * The worker is woken up only once, from lw_batch_end().
+ */
+static void lw_batch_begin(void)
+{
+  pthread_mutex_lock(&lw_mutex);
+  lw_batch = true;
+  pthread_mutex_unlock(&lw_mutex);
+}
+
+/** Finish queueing a batch of light writes and wake up the worker
+ */
+static void lw_batch_end(void)
+{
+  pthread_mutex_lock(&lw_mutex);
+  lw_batch = false;
+  pthread_cond_broadcast(&lw_cond);
+  pthread_mutex_unlock(&lw_mutex);
+}
+
+/** Start light writer thread
+ *
+ * @return true if the thread is running, false otherwise
+ */
+static bool lw_start(void)
+{
+  if( !lw_tid ) {
+    lw_quit = false;
+    lw_tid  = mce_hybris_start_thread(lw_thread, 0);
+  }
+  return lw_tid != 0;
+}
+
+/** Stop light writer thread
+ *
+ * Pending writes are flushed before the thread exits.
+ */
+static void lw_stop(void)
+{
+  if( !lw_tid ) {
+    goto cleanup;
+  }
+
+  pthread_mutex_lock(&lw_mutex);
+  lw_quit = true;
+  pthread_cond_broadcast(&lw_cond);
+  pthread_mutex_unlock(&lw_mutex);
+
+  pthread_join(lw_tid, 0), lw_tid = 0;
+
+  if( lw_done_id ) {
+    g_source_remove(lw_done_id), lw_done_id = 0;
+  }
+
+  /* Report what the worker did not have a chance to */
+  lw_done_cb(0);
+
+cleanup:
+  return;
+}
+
+/** Enable / disable asynchronous light device writes
+ *
+ * When enabled, libhybris set_light() calls for display backlight,
+ * keypad backlight and indicator led are made from a worker thread.
+ * Each light has a one slot mailbox - a new request replaces any
+ * older one that has not been written yet - and the setter functions
+ * return immediately. Completion is reported via the callback set
+ * with mce_hybris_lights_set_done_hook(), from the glib main loop.
+ *
+ * Lights controlled directly via sysfs are not affected.
+ *
+ * @param enable true to enable async writes, false to disable
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_lights_set_async(bool enable)
+{
+  bool ack = false;
+
+  if( enable ) {
+    ack = lw_start();
+  }
+  else {
+    lw_stop();
+    ack = true;
+  }
+
+  mce_log(LOG_DEBUG, "%s(%s) -> %s", __FUNCTION__,
+          enable ? "true" : "false", ack ? "success" : "failure");
+
+  return ack;
+}
+
+/** Set callback function for reporting completed asynchronous writes
+ *
+ * Note: the callback function will be called from the glib main loop.
+ */
+void mce_hybris_lights_set_done_hook(mce_hybris_light_done_fn cb)
+{
+  lw_done_hook = cb;
+}
+
+/* ------------------------------------------------------------------------- *
+ * brightness calibration
+ * ------------------------------------------------------------------------- */
+
+/** Preformatted decimal number for sysfs writes */
+typedef struct
+{
+  uint8_t len;
+  char    txt[7];
+} led_number_t;
+
+/** Format a non-negative number without using stdio
+ *
+ * @param self where to store the text
+ * @param val  number to format
+ */
+static void led_number_set(led_number_t *self, int val)
+{
+  char tmp[16];
+  int  len = 0;
+
+  if( val < 0 ) val = 0;
+
+  do {
+    tmp[len++] = '0' + val % 10;
+    val /= 10;
+  } while( val && len < (int)sizeof self->txt );
+
+  for( int i = 0; i < len; ++i ) {
+    self->txt[i] = tmp[len - 1 - i];
+  }
+  self->len = len;
+}
+
+/** Write a number to a sysfs file
+ *
+ * @param fd  file descriptor
+ * @param num preformatted number
+ *
+ * @return true on success, false on failure
+ */
+static bool led_number_write(int fd, const led_number_t *num)
+{
+  return write(fd, num->txt, num->len) == num->len;
+}
+
+/** Lights that have brightness lookup tables */
+typedef enum
+{
+  LUT_BACKLIGHT,
+  LUT_KEYPAD,
+  LUT_LED_RED,   // indexed as LUT_LED_RED + mce_hybris_led_role_t
+  LUT_LED_GREEN,
+  LUT_LED_BLUE,
+  LUT_LED_WHITE,
+
+  LUT_COUNT
+} lut_id_t;
+
+/** Calibration file names for lut_id_t values */
+static const char * const lut_name[LUT_COUNT] =
+{
+  [LUT_BACKLIGHT] = "backlight",
+  [LUT_KEYPAD]    = "keypad",
+  [LUT_LED_RED]   = "led-red",
+  [LUT_LED_GREEN] = "led-green",
+  [LUT_LED_BLUE]  = "led-blue",
+  [LUT_LED_WHITE] = "led-white",
+};
+
+/** Brightness calibration for a light */
+typedef struct
+{
+  float gamma; // curve exponent, 1.0 = linear
+  int   min;   // minimum visible output level, in device units
+  int   max;   // maximum output level in device units, or 0 for device max
+} lut_calib_t;
+
+/** Default calibration: linear scaling to full device range */
+static const lut_calib_t lut_calib_def =
+{
+  .gamma = 1.0f,
+  .min   = 0,
+  .max   = 0,
+};
+
+/** Current calibration for each light */
+static lut_calib_t lut_calib[LUT_COUNT] =
+{
+  [0 ... LUT_COUNT - 1] = { .gamma = 1.0f, .min = 0, .max = 0 },
+};
+
+/** Lookup tables for lights written via libhybris, [0 ... 255] range */
+static uint8_t lut_hal[LUT_COUNT][256];
+
+/** Flag for: lut_hal tables are up to date */
+static bool    lut_hal_ready = false;
+
+/** Map brightness level through calibration curve
+ *
+ * Level zero is always mapped to zero i.e. off; other levels to
+ * [min ... max] range along the gamma curve.
+ *
+ * @param cal    calibration to use
+ * @param maxval device maximum output value
+ * @param lev    brightness level 0 ... 255
+ *
+ * @return output value in 0 ... maxval range
+ */
+static int lut_map(const lut_calib_t *cal, int maxval, int lev)
+{
+  if( lev <= 0 || maxval <= 0 ) {
+    return 0;
+  }
+
+  if( lev > 255 ) lev = 255;
+
+  int hi = (cal->max > 0 && cal->max < maxval) ? cal->max : maxval;
+  int lo = clamp_to_range(0, hi, cal->min);
+
+  /* Default calibration: plain linear scaling, rounding down */
+  if( cal->gamma == 1.0f && lo == 0 ) {
+    return lev * hi / 255;
+  }
+
+  float f = powf(lev / 255.0f, cal->gamma);
+  return clamp_to_range(lo, hi, lo + (int)(f * (hi - lo) + 0.5f));
+}
+
+/** Precompute calibrated output values for [0 ... 255] levels
+ *
+ * @param id     light to use calibration of
+ * @param maxval device maximum output value
+ * @param val    where to store output values, or NULL
+ * @param txt    where to store output values as text, or NULL
+ */
+static void lut_fill(lut_id_t id, int maxval, int *val, led_number_t *txt)
+{
+  for( int i = 0; i < 256; ++i ) {
+    int v = lut_map(&lut_calib[id], maxval, i);
+    if( val ) val[i] = v;
+    if( txt ) led_number_set(&txt[i], v);
+  }
+}
+
+/** Get lookup table for light written via libhybris
+ *
+ * @param id light to get table for
+ *
+ * @return table mapping [0 ... 255] levels to hal values
+ */
+static const uint8_t *lut_hal_table(lut_id_t id)
+{
+  if( !lut_hal_ready ) {
+    lut_hal_ready = true;
+    for( int k = 0; k < LUT_COUNT; ++k ) {
+      for( int i = 0; i < 256; ++i ) {
+        lut_hal[k][i] = lut_map(&lut_calib[k], 255, i);
+      }
+    }
+  }
+  return lut_hal[id];
+}
+
+/** Parse calibration file
+ *
+ * Each non-empty line that does not start with '#' has format
+ *
+ *   <name> <gamma> <min> <max>
+ *
+ * Where name is one of: backlight, keypad, led-red, led-green,
+ * led-blue, led-white, or led - which applies to all indicator leds.
+ *
+ * @param path calibration file
+ * @param cal  where to store calibration values
+ *
+ * @return true on success, false on failure
+ */
+static bool lut_calib_parse(const char *path, lut_calib_t *cal)
+{
+  bool  ack  = false;
+  FILE *file = 0;
+  char  line[256];
+  int   lnum = 0;
+
+  if( !(file = fopen(path, "r")) ) {
+    mce_log(LOG_WARNING, "%s: can't open: %m", path);
+    goto cleanup;
+  }
+
+  while( fgets(line, sizeof line, file) ) {
+    char  name[32];
+    float gamma = 0;
+    int   lo = 0, hi = 0;
+
+    ++lnum;
+
+    int n = sscanf(line, "%31s %f %d %d", name, &gamma, &lo, &hi);
+
+    if( n < 1 || *name == '#' ) {
+      continue;
+    }
+
+    if( n != 4 || !(gamma > 0.0f) || lo < 0 || hi < 0 ) {
+      mce_log(LOG_WARNING, "%s:%d: invalid calibration", path, lnum);
+      goto cleanup;
+    }
+
+    lut_calib_t tmp = { .gamma = gamma, .min = lo, .max = hi };
+    bool        hit = false;
+
+    for( int k = 0; k < LUT_COUNT; ++k ) {
+      if( !strcmp(name, lut_name[k]) ||
+          (!strcmp(name, "led") && k >= LUT_LED_RED) ) {
+        cal[k] = tmp, hit = true;
+      }
+    }
+
+    if( !hit ) {
+      mce_log(LOG_WARNING, "%s:%d: unknown light '%s'", path, lnum, name);
+    }
+  }
+
+  ack = true;
+
+cleanup:
+  if( file ) fclose(file);
+  return ack;
+}
+
+static void bl_sysfs_init_values(void);
+static void led_ctrl_init_values(void);
+
+/** Set brightness calibration for all lights
+ *
+ * Lookup tables are rebuilt for lights that have already been
+ * initialized; new values are used from the next brightness change.
+ *
+ * @param path calibration file, or NULL to use linear defaults
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_lights_set_calibration(const char *path)
+{
+  bool        ack = false;
+  lut_calib_t cal[LUT_COUNT];
+
+  for( int k = 0; k < LUT_COUNT; ++k ) {
+    cal[k] = lut_calib_def;
+  }
+
+  if( path && !lut_calib_parse(path, cal) ) {
+    goto cleanup;
+  }
+
+  memcpy(lut_calib, cal, sizeof lut_calib);
+
+  lut_hal_ready = false;
+  bl_sysfs_init_values();
+  led_ctrl_init_values();
+
+  for( int k = 0; k < LUT_COUNT; ++k ) {
+    mce_log(LOG_DEBUG, "%s: gamma=%g min=%d max=%d", lut_name[k],
+            lut_calib[k].gamma, lut_calib[k].min, lut_calib[k].max);
+  }
+
+  ack = true;
+
+cleanup:
+  mce_log(LOG_DEBUG, "%s(%s) -> %s", __FUNCTION__, path ?: "<null>",
+          ack ? "success" : "failure");
+
+  return ack;
+}
+
+/* ------------------------------------------------------------------------- *
+ * display backlight device
+ * ------------------------------------------------------------------------- */
+
+/** Last brightness level written to display backlight, or -1 if unknown */
+static int     backlight_level = -1;
+
+static void mce_hybris_backlight_fade_stop(void);
+static void als_auto_override(void);
+
+/** Sysfs state for display backlight */
+static struct
+{
+  int fd;     // brightness control file
+  int maxval; // value for maximum brightness
+  int curval; // last value written, or -1 if unknown
+
+  /* Calibrated values in [0 ... maxval], indexed by [0 ... 255] */
+  int          scaled[256];
+  led_number_t scaled_txt[256];
+} bl_sysfs =
+{
+  .fd     = -1,
+  .maxval = 255,
+  .curval = -1,
+};
+
+/** Flag for: display backlight is controlled via sysfs */
+static bool backlight_uses_sysfs = false;
+
+/** Precompute calibrated display backlight sysfs values
+ */
+static void bl_sysfs_init_values(void)
+{
+  lut_fill(LUT_BACKLIGHT, bl_sysfs.maxval, bl_sysfs.scaled,
+           bl_sysfs.scaled_txt);
+}
+
+/** Try to open display backlight sysfs controls in given directory
+ *
+ * @param dir directory with brightness and max_brightness files
+ *
+ * @return true if control files were available, false otherwise
+ */
+static bool bl_sysfs_open_dir(const char *dir)
+{
+  char path[PATH_MAX];
+
+  if( !path_format(path, sizeof path, dir, "max_brightness") ||
+      (bl_sysfs.maxval = read_number(path)) <= 0 ) {
+    goto fail;
+  }
+
+  if( !path_format(path, sizeof path, dir, "brightness") ||
+      (bl_sysfs.fd = open(path, O_WRONLY|O_APPEND)) == -1 ) {
+    goto fail;
+  }
+
+  bl_sysfs.curval = read_number(path);
+  bl_sysfs_init_values();
+
+  mce_log(LOG_DEBUG, "using %s, max_brightness=%d", dir, bl_sysfs.maxval);
+  return true;
+
+fail:
+  bl_sysfs.maxval = 255;
+  return false;
+}
+
+/** Probe sysfs controls for display backlight
+ *
+ * Tries the android style led class device first, then the first
+ * device found in the backlight class.
+ *
+ * @return true if control files were available, false otherwise
+ */
+static bool bl_sysfs_probe(void)
+{
+  static const char leds_dir[] = "/sys/class/leds/lcd-backlight";
+  static const char bl_class[] = "/sys/class/backlight";
+
+  bool res = false;
+  DIR *dir = 0;
+
+  if( bl_sysfs_open_dir(leds_dir) ) {
+    res = true;
+    goto cleanup;
+  }
+
+  if( !(dir = opendir(bl_class)) ) {
+    goto cleanup;
+  }
+
+  struct dirent *de;
+  while( !res && (de = readdir(dir)) ) {
+    if( de->d_name[0] == '.' ) {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    if( path_format(path, sizeof path, bl_class, de->d_name) ) {
+      res = bl_sysfs_open_dir(path);
+    }
+  }
+
+cleanup:
+  if( dir ) closedir(dir);
+
+  return res;
+}
+
+/** Close display backlight sysfs controls
+ */
+static void bl_sysfs_close(void)
+{
+  if( bl_sysfs.fd != -1 ) {
+    close(bl_sysfs.fd), bl_sysfs.fd = -1;
+  }
+  bl_sysfs.maxval = 255;
+  bl_sysfs.curval = -1;
+}
+
+/** Set display backlight brightness via sysfs
+ *
+ * Writes are skipped if the value would not change.
+ *
+ * @param lev 0=off ... 255=maximum brightness
+ *
+ * @return true on success, false on failure
+ */
+static bool bl_sysfs_set_value(unsigned lev)
+{
+  // lookup calibrated value in [0 ... maxval] range
+  if( lev > 255 ) lev = 255;
+
+  int val = bl_sysfs.scaled[lev];
+
+  if( val == bl_sysfs.curval ) {
+    return true;
+  }
+
+  int64_t t0 = trace_now();
+  bool    ok = led_number_write(bl_sysfs.fd, &bl_sysfs.scaled_txt[lev]);
+  trace_add(MCE_HYBRIS_TRACE_BACKLIGHT_SYSFS, 0, ok ? val : -errno, t0);
+
+  bl_sysfs.curval = ok ? val : -1;
+  return ok;
+}
+
+/** Initialize libhybris display backlight device object
+ *
+ * If display backlight can be controlled directly via sysfs, the
+ * libhybris device is not used at all.
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_backlight_init(void)
+{
+  static bool done = false;
+
+  if( !done ) {
+    done = true;
+
+    if( !probe_cache_is_missing(PROBE_SYSFS_BACKLIGHT) ) {
+      backlight_uses_sysfs = bl_sysfs_probe();
+      probe_cache_update(PROBE_SYSFS_BACKLIGHT, backlight_uses_sysfs);
+    }
+
+    if( backlight_uses_sysfs ) {
+      goto cleanup;
+    }
+
+    if( !mce_hybris_modlights_load() ) {
+      goto cleanup;
+    }
+
+    mce_light_device_probe(LIGHT_ID_BACKLIGHT, PROBE_DEV_BACKLIGHT,
+                           &dev_backlight);
+
+    if( !dev_backlight ) {
+      mce_log(LOG_WARNING, "failed to open backlight device");
+    }
+    else {
+      mce_log(LOG_DEBUG, "%s() -> %p", __FUNCTION__, dev_backlight);
+    }
+  }
+
+cleanup:
+  return backlight_uses_sysfs || dev_backlight != 0;
+}
+
+/** Release libhybris display backlight device object
+ */
+void mce_hybris_backlight_quit(void)
+{
+  mce_hybris_backlight_fade_stop();
+  backlight_level = -1;
+
+  if( backlight_uses_sysfs ) {
+    bl_sysfs_close();
+    backlight_uses_sysfs = false;
+  }
+
+  if( dev_backlight ) {
+    lw_cancel(MCE_HYBRIS_LIGHT_BACKLIGHT);
+    mce_light_device_close(dev_backlight), dev_backlight = 0;
+  }
+}
+
+/** Write display backlight brightness via sysfs or libhybris
+ *
+ * Note: No logging, for use from fade timer too.
+ *
+ * @param lev 0=off ... 255=maximum brightness
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_backlight_write(unsigned lev)
+{
+  bool ack = false;
+  int  rc  = -1;
+
+  /* Asynchronous writes: cost is tracked by the writer thread */
+  bool async = !backlight_uses_sysfs && lw_is_enabled();
+
+  int64_t t0 = mce_hybris_get_tick_us();
+
+  if( backlight_uses_sysfs ) {
+    rc = bl_sysfs_set_value(lev) ? 0 : -1;
+  }
+  else {
+    struct light_state_t lst;
+
+    unsigned val = lut_hal_table(LUT_BACKLIGHT)[lev & 255];
+
+    memset(&lst, 0, sizeof lst);
+    lst.color          = (0xff << 24) | (val << 16) | (val << 8) | (val << 0);
+    lst.flashMode      = LIGHT_FLASH_NONE;
+    lst.flashOnMS      = 0;
+    lst.flashOffMS     = 0;
+    lst.brightnessMode = BRIGHTNESS_MODE_USER;
+
+    rc = lw_set_light(MCE_HYBRIS_LIGHT_BACKLIGHT, dev_backlight, &lst);
+  }
+
+  if( !async ) {
+    int64_t t1 = mce_hybris_get_tick_us();
+
+    /* Track write cost for choosing fade step rate */
+    int64_t cost = __atomic_load_n(&backlight_cost, __ATOMIC_RELAXED);
+    __atomic_store_n(&backlight_cost, (cost * 7 + (t1 - t0)) / 8,
+                     __ATOMIC_RELAXED);
+  }
+
+  if( rc < 0 ) {
+    backlight_level = -1;
+    goto cleanup;
+  }
+
+  backlight_level = lev;
+  ack = true;
+
+cleanup:
+  return ack;
+}
+
+/** Set display backlight brightness via libhybris
+ *
+ * Also cancels ongoing brightness fade and suspends automatic
+ * brightness control, if active.
+ *
+ * Note: in asynchronous mode success means the request was queued.
+ *
+ * @param level 0=off ... 255=maximum brightness
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_backlight_set_brightness(int level)
+{
+  bool     ack = false;
+  unsigned lev = (level < 0) ? 0 : (level > 255) ? 255 : level;
+
+  als_auto_override();
+  mce_hybris_backlight_fade_stop();
+
+  if( !mce_hybris_backlight_init() ) {
+    goto cleanup;
+  }
+
+  if( !mce_hybris_backlight_write(lev) ) {
+    goto cleanup;
+  }
+
+  ack = true;
+
+cleanup:
+
+  mce_log(LOG_DEBUG, "%s(%d) -> %s", __FUNCTION__, level, ack ? "success" : "failure");
+
+  return ack;
+}
+
+/* ------------------------------------------------------------------------- *
+ * display backlight fading
+ * ------------------------------------------------------------------------- */
+
+/* Backlight fades share the intensity curves with led breathing via
+ * ramp_curve_value(), but not the led_ctrl_step_cb() timer nor the
+ * frame tables from led_ctrl_generate_ramp(), because:
+ *
+ * - led frame tables hold per channel rgb values, are cached per led
+ *   request and get mirrored to kernel pattern triggers; the step
+ *   timer plays the current table in a loop and writes via the led
+ *   sysfs channels - all of it is tied to led_ctrl_breathe state
+ * - a fade runs once, from whatever level the backlight has, and must
+ *   end exactly at the target level
+ * - each breathing step re-arms the timer for the frame duration, so
+ *   a busy main loop stretches the pattern; a fade must not overrun
+ *   its duration, so the step is picked from elapsed time and late
+ *   steps are skipped
+ * - the step rate follows the measured set_light() cost instead of
+ *   the fixed LED_CTRL_BREATHING_DELAY
+ */
+
+/** Minimum delay between fade steps */
+#define BL_FADE_MIN_DELAY 16 // [ms]
+
+/** Maximum number of fade steps */
+#define BL_FADE_MAX_STEPS 256
+
+/** Brightness curve for backlight fading */
+static struct {
+  size_t  step;
+  size_t  steps;
+  int     delay;
+  int64_t started;
+  uint8_t value[BL_FADE_MAX_STEPS];
+} bl_fade =
+{
+  .step    = 0,
+  .steps   = 0,
+  .delay   = 0,
+  .started = 0,
+};
+
+/** Timer id for backlight fade steps */
+static guint bl_fade_step_id = 0;
+
+/** Generate brightness curve for use from fade timer
+ *
+ * The delay between steps is chosen based on how long the hal
+ * takes to change the brightness, and the number of steps is
+ * limited by the number of distinct levels in between.
+ *
+ * @param from  start level [0 ... 255]
+ * @param to    target level [0 ... 255]
+ * @param ms    fade duration
+ * @param curve intensity curve
+ */
+static void bl_fade_generate_ramp(int from, int to, int ms,
+                                  mce_hybris_curve_t curve)
+{
+  int64_t cost = __atomic_load_n(&backlight_cost, __ATOMIC_RELAXED);
+  int     s    = (int)(cost * 2 / 1000);
+
+  if( s < BL_FADE_MIN_DELAY ) {
+    s = BL_FADE_MIN_DELAY;
+  }
+
+  int n = (ms + s - 1) / s;
+  int d = abs(to - from);
+
+  if( n > d ) n = d;
+  if( n > BL_FADE_MAX_STEPS ) n = BL_FADE_MAX_STEPS;
+  if( n < 1 ) n = 1;
+
+  /* Spread the steps over the whole duration */
+  s = ms / n;
+
+  for( int i = 0; i < n; ++i ) {
+    float v = ramp_curve_value(curve, (float)(i + 1) / n);
+    bl_fade.value[i] = (uint8_t)(from + (to - from) * v + 0.5f);
+  }
+
+  bl_fade.step    = 0;
+  bl_fade.steps   = n;
+  bl_fade.delay   = s;
+  bl_fade.started = mce_hybris_get_tick();
+
+  mce_log(LOG_DEBUG, "fade %d -> %d: delay=%d, steps=%d, cost=%d us",
+          from, to, s, n, (int)cost);
+}
+
+/** Timer callback for taking a backlight fade step
+ */
+static gboolean bl_fade_step_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  if( !bl_fade_step_id ) {
+    goto cleanup;
+  }
+
+  /* Position along the curve is based on elapsed time; if the main
+   * loop has been busy, steps are skipped instead of slowing down */
+  int64_t elapsed = mce_hybris_get_tick() - bl_fade.started;
+  int64_t due     = elapsed / (bl_fade.delay > 0 ? bl_fade.delay : 1);
+  size_t  step    = (due > 0) ? (size_t)(due - 1) : 0;
+
+  if( step < bl_fade.step ) {
+    step = bl_fade.step;
+  }
+  if( step >= bl_fade.steps ) {
+    step = bl_fade.steps - 1;
+  }
+  bl_fade.step = step + 1;
+
+  int lev = bl_fade.value[step];
+  if( lev != backlight_level ) {
+    mce_hybris_backlight_write(lev);
+  }
+
+  if( bl_fade.step >= bl_fade.steps ) {
+    bl_fade_step_id = 0;
+  }
+
+cleanup:
+  return bl_fade_step_id != 0;
+}
+
+/** Cancel ongoing backlight fade
+ */
+static void mce_hybris_backlight_fade_stop(void)
+{
+  if( bl_fade_step_id ) {
+    g_source_remove(bl_fade_step_id), bl_fade_step_id = 0;
+  }
+}
+
+/** Fade display backlight brightness to given level
+ *
+ * For use from both mce_hybris_backlight_fade() and automatic
+ * brightness control.
+ *
+ * @param level       target level, 0=off ... 255=maximum brightness
+ * @param duration_ms duration of the transition
+ * @param curve       intensity curve to use
+ *
+ * @return true on success, false on failure
+ */
+static bool bl_fade_start(int level, int duration_ms,
+                          mce_hybris_curve_t curve)
+{
+  bool ack = false;
+  int  lev = clamp_to_range(0, 255, level);
+
+  mce_hybris_backlight_fade_stop();
+
+  if( !mce_hybris_backlight_init() ) {
+    goto cleanup;
+  }
+
+  duration_ms = clamp_to_range(0, 60000, duration_ms);
+
+  if( backlight_level < 0 || duration_ms < BL_FADE_MIN_DELAY ||
+      lev == backlight_level ) {
+    /* Nothing to fade from / too short to fade */
+    ack = mce_hybris_backlight_write(lev);
+    goto cleanup;
+  }
+
+  bl_fade_generate_ramp(backlight_level, lev, duration_ms, curve);
+  bl_fade_step_id = g_timeout_add(bl_fade.delay, bl_fade_step_cb, 0);
+
+  ack = true;
+
+cleanup:
+  mce_log(LOG_DEBUG, "%s(%d, %d, %d) -> %s", __FUNCTION__, level,
+          duration_ms, curve, ack ? "success" : "failure");
+
+  return ack;
+}
+
+/** Fade display backlight brightness to given level
+ *
+ * The transition is executed within the plugin from glib timer
+ * callbacks. Calling mce_hybris_backlight_set_brightness() or
+ * starting a new fade cancels ongoing fade.
+ *
+ * Also suspends automatic brightness control, if active.
+ *
+ * @param level       target level, 0=off ... 255=maximum brightness
+ * @param duration_ms duration of the transition
+ * @param curve       intensity curve to use
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_backlight_fade(int level, int duration_ms,
+                               mce_hybris_curve_t curve)
+{
+  als_auto_override();
+  return bl_fade_start(level, duration_ms, curve);
+}
+
+/* ------------------------------------------------------------------------- *
+ * keypad backlight device
+ * ------------------------------------------------------------------------- */
+
+/** Last brightness level written to keypad backlight, or -1 if unknown */
+static int keypad_level = -1;
+
+/** Initialize libhybris keypad backlight device object
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_keypad_init(void)
+{
+  static bool done = false;
+
+  if( !done ) {
+    done = true;
+
+    if( !mce_hybris_modlights_load() ) {
+      goto cleanup;
+    }
+
+    mce_light_device_probe(LIGHT_ID_KEYBOARD, PROBE_DEV_KEYPAD, &dev_keypad);
+
+    if( !dev_keypad ) {
+      mce_log(LOG_WARNING, "failed to open keypad backlight device");
+    }
+    else {
+      mce_log(LOG_DEBUG, "%s() -> %p", __FUNCTION__, dev_keypad);
+    }
+  }
+
+cleanup:
+  return dev_keypad != 0;
+}
+
+/** Release libhybris keypad backlight device object
+ */
+void mce_hybris_keypad_quit(void)
+{
+  keypad_level = -1;
+
+  if( dev_keypad ) {
+    lw_cancel(MCE_HYBRIS_LIGHT_KEYPAD);
+    mce_light_device_close(dev_keypad), dev_keypad = 0;
+  }
+}
+
+/** Write keypad backlight brightness via libhybris
+ *
+ * Note: No logging, for use from light transactions too.
+ *
+ * @param lev 0=off ... 255=maximum brightness
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_keypad_write(unsigned lev)
+{
+  bool ack = false;
+
+  struct light_state_t lst;
+
+  unsigned val = lut_hal_table(LUT_KEYPAD)[lev & 255];
+
+  memset(&lst, 0, sizeof lst);
+  lst.color          = (0xff << 24) | (val << 16) | (val << 8) | (val << 0);
+  lst.flashMode      = LIGHT_FLASH_NONE;
+  lst.flashOnMS      = 0;
+  lst.flashOffMS     = 0;
+  lst.brightnessMode = BRIGHTNESS_MODE_USER;
+
+  if( lw_set_light(MCE_HYBRIS_LIGHT_KEYPAD, dev_keypad, &lst) < 0 ) {
+    keypad_level = -1;
+    goto cleanup;
+  }
+
+  keypad_level = lev;
+  ack = true;
+
+cleanup:
+  return ack;
+}
+
+/** Set display keypad brightness via libhybris
+ *
+ * Note: in asynchronous mode success means the request was queued.
+ *
+ * @param level 0=off ... 255=maximum brightness
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_keypad_set_brightness(int level)
+{
+  bool     ack = false;
+  unsigned lev = (level < 0) ? 0 : (level > 255) ? 255 : level;
+
+  if( !mce_hybris_keypad_init() ) {
+    goto cleanup;
+  }
+
+  if( !mce_hybris_keypad_write(lev) ) {
+    goto cleanup;
+  }
+
+  ack = true;
+
+cleanup:
+
+  mce_log(LOG_DEBUG, "%s(%d) -> %s", __FUNCTION__, level, ack ? "success" : "failure");
+
+  return ack;
+}
+
+/* ------------------------------------------------------------------------- *
+ * indicator led device
+ * ------------------------------------------------------------------------- */
+
+/** Read number from file */
+static int read_number(const char *path)
+{
+  int res = -1;
+  int fd  = -1;
+  char tmp[64];
+
+  if( (fd = open(path, O_RDONLY)) == -1 ) {
+    goto cleanup;
+  }
+  int rc = read(fd, tmp, sizeof tmp - 1);
+  if( rc < 0 ) {
+    goto cleanup;
+  }
+  tmp[rc] = 0;
+  res = strtol(tmp, 0, 0);
+
+cleanup:
+  if( fd != -1 ) close(fd);
+
+  return res;
+}
+
+/** Read text from file
+ *
+ * @param path file to read
+ * @param buff where to store zero terminated text
+ * @param size size of buff
+ *
+ * @return true on success, false on failure
+ */
+static bool read_text(const char *path, char *buff, size_t size)
+{
+  bool res = false;
+  int  fd  = -1;
+
+  if( (fd = open(path, O_RDONLY)) == -1 ) {
+    goto cleanup;
+  }
+  int rc = read(fd, buff, size - 1);
+  if( rc < 0 ) {
+    goto cleanup;
+  }
+  buff[rc] = 0;
+  res = true;
+
+cleanup:
+  if( fd != -1 ) close(fd);
+
+  return res;
+}
+
+/** Write text to file in one go
+ *
+ * @param path file to write
+ * @param text data to write
+ * @param size number of bytes to write
+ *
+ * @return true on success, false on failure
+ */
+static bool write_text(const char *path, const char *text, size_t size)
+{
+  bool res = false;
+  int  fd  = -1;
+
+  if( (fd = open(path, O_WRONLY)) == -1 ) {
+    goto cleanup;
+  }
+  if( write(fd, text, size) != (ssize_t)size ) {
+    goto cleanup;
+  }
+  res = true;
+
+cleanup:
+  if( fd != -1 ) close(fd);
+
+  return res;
+}
+
+/** Maximum length of led control file paths
+ *
+ * Enough for led class directory, NAME_MAX byte device name and
+ * the longest control file name.
+ */
+#define LED_PATH_MAX (32 + NAME_MAX + 32)
+
+/** Sysfs control paths for a led */
+typedef struct
+{
+  char on[LED_PATH_MAX];      // W
+  char off[LED_PATH_MAX];     // W
+  char val[LED_PATH_MAX];     // W
+  char max[LED_PATH_MAX];     // R
+  char trigger[LED_PATH_MAX]; // RW
+  char pattern[LED_PATH_MAX]; // W, exists while pattern trigger is active
+  char repeat[LED_PATH_MAX];  // W, exists while pattern trigger is active
+} led_paths_t;
+
+/** Fill in control file paths for a led class device
+ *
+ * @param self paths to fill in
+ * @param dir  led class device directory
+ *
+ * @return true on success, false if some path does not fit
+ */
+static bool led_paths_init(led_paths_t *self, const char *dir)
+{
+  return (path_format(self->on,      sizeof self->on,      dir, "blink_delay_on")  &&
+          path_format(self->off,     sizeof self->off,     dir, "blink_delay_off") &&
+          path_format(self->val,     sizeof self->val,     dir, "brightness")      &&
+          path_format(self->max,     sizeof self->max,     dir, "max_brightness")  &&
+          path_format(self->trigger, sizeof self->trigger, dir, "trigger")         &&
+          path_format(self->pattern, sizeof self->pattern, dir, "pattern")         &&
+          path_format(self->repeat,  sizeof self->repeat,  dir, "repeat"));
+}
+
+/** Sysfs state for a led */
+typedef struct
+{
+  int fd_on;
+  int fd_off;
+  int fd_val;
+  int maxval;
+
+  /* Values last written, or -1 if unknown */
+  int cur_on;
+  int cur_off;
+  int cur_val;
+
+  /* Calibrated values in [0 ... maxval], indexed by [0 ... 255] */
+  int          scaled[256];
+  led_number_t scaled_txt[256];
+
+  /* Which color component drives this led */
+  mce_hybris_led_role_t role;
+
+  /* Index in led_states[], for tracing */
+  int chn;
+
+  /* Kernel pattern trigger support */
+  led_paths_t paths;
+  bool        has_pattern;
+  bool        in_pattern;
+} led_state_t;
+
+/** Set LED brightness
+ *
+ * The value is written only if it differs from what was last written.
+ *
+ * @param self led state
+ * @param val  brightness in 0 ... 255 range
+ */
+static void led_state_set_value(led_state_t *self, int val)
+{
+  // clamp to [0 ... 255], lookup the value in [0 ... maxval] range
+  if( val > 255 ) val = 255;
+  if( val < 0 ) val = 0;
+
+  if( self->cur_val == self->scaled[val] ) {
+    return;
+  }
+
+  int64_t t0 = trace_now();
+
+  if( led_number_write(self->fd_val, &self->scaled_txt[val]) ) {
+    self->cur_val = self->scaled[val];
+  }
+  else {
+    self->cur_val = -1;
+  }
+
+  trace_add(MCE_HYBRIS_TRACE_LED_VALUE, self->chn, self->cur_val, t0);
+}
+
+/** Set LED blinking period
+ *
+ * If both on and off are greater than zero, then the PWM generator
+ * is used to full intensity blinking. Otherwise it is used for
+ * adjusting the LED brightness.
+ *
+ * @param self led state
+ * @param on   milliseconds on
+ * @param off  milliseconds off
+ */
+static void led_state_set_blink(led_state_t *self, int on, int off)
+{
+  led_number_t num;
+
+  if( self->fd_on == -1 || self->fd_off == -1 ) {
+    /* Blinking is not supported */
+    return;
+  }
+
+  if( self->cur_on != on ) {
+    int64_t t0 = trace_now();
+    led_number_set(&num, on);
+    self->cur_on = led_number_write(self->fd_on, &num) ? on : -1;
+    trace_add(MCE_HYBRIS_TRACE_LED_BLINK_ON, self->chn, self->cur_on, t0);
+  }
+
+  if( self->cur_off != off ) {
+    int64_t t0 = trace_now();
+    led_number_set(&num, off);
+    self->cur_off = led_number_write(self->fd_off, &num) ? off : -1;
+    trace_add(MCE_HYBRIS_TRACE_LED_BLINK_OFF, self->chn, self->cur_off, t0);
+  }
+
+  /* Blinking changes the brightness on kernel side; the next
+   * brightness value must be written unconditionally */
+  self->cur_val = -1;
+}
+
+/** Precompute calibrated brightness values
+ *
+ * @param self led state
+ */
+static void led_state_init_values(led_state_t *self)
+{
+  lut_fill(LUT_LED_RED + self->role, self->maxval,
+           self->scaled, self->scaled_txt);
+}
+
+/** Probe for kernel side pattern trigger support
+ *
+ * @param self led state
+ *
+ * @return true if ledtrig-pattern is available, false otherwise
+ */
+static bool led_state_probe_pattern(const led_state_t *self)
+{
+  bool res = false;
+  char tmp[512];
+
+  if( !read_text(self->paths.trigger, tmp, sizeof tmp) ) {
+    goto cleanup;
+  }
+
+  /* Available triggers are listed as space separated words,
+   * with the active one enclosed in brackets */
+  for( char *pos = tmp, *tok; (tok = strsep(&pos, " \t\n")); ) {
+    if( *tok == '[' ) {
+      ++tok;
+      tok[strcspn(tok, "]")] = 0;
+    }
+    if( !strcmp(tok, "pattern") ) {
+      res = true;
+      break;
+    }
+  }
+
+cleanup:
+  return res;
+}
+
+/** Start kernel side brightness pattern
+ *
+ * @param self led state
+ * @param text pattern in "brightness duration ..." format
+ * @param size length of text
+ *
+ * @return true on success, false on failure
+ */
+static bool led_state_start_pattern(led_state_t *self, const char *text,
+                                    size_t size)
+{
+  bool res = false;
+
+  if( !self->has_pattern ) {
+    goto cleanup;
+  }
+
+  if( !self->in_pattern ) {
+    if( !write_text(self->paths.trigger, "pattern", 7) ) {
+      goto cleanup;
+    }
+    self->in_pattern = true;
+  }
+
+  int64_t t0 = trace_now();
+  bool    ok = write_text(self->paths.pattern, text, size);
+  trace_add(MCE_HYBRIS_TRACE_LED_PATTERN, self->chn, ok ? (int)size : -1, t0);
+
+  if( !ok ) {
+    goto cleanup;
+  }
+
+  /* Negative repeat count = repeat until stopped */
+  if( !write_text(self->paths.repeat, "-1", 2) ) {
+    goto cleanup;
+  }
+
+  res = true;
+
+cleanup:
+  /* Kernel owns the brightness now */
+  self->cur_val = -1;
+
+  return res;
+}
+
+/** Stop kernel side brightness pattern
+ *
+ * @param self led state
+ */
+static void led_state_stop_pattern(led_state_t *self)
+{
+  if( self->in_pattern ) {
+    /* Removing the trigger also turns the led off */
+    write_text(self->paths.trigger, "none", 4);
+    self->in_pattern = false;
+    self->cur_val = -1;
+  }
+}
+
+/** Clean up led state
+ *
+ * @param self led state
+ */
+static void led_state_quit(led_state_t *self)
+{
+  led_state_stop_pattern(self);
+
+  if( self->fd_on  != -1 ) close(self->fd_on),  self->fd_on  = -1;
+  if( self->fd_off != -1 ) close(self->fd_off), self->fd_off = -1;
+  if( self->fd_val != -1 ) close(self->fd_val), self->fd_val = -1;
+  self->maxval  = 255;
+  self->cur_on  = -1;
+  self->cur_off = -1;
+  self->cur_val = -1;
+  self->has_pattern = false;
+  self->in_pattern  = false;
+}
+
+/** Initialize led state
+ *
+ * Blink delay controls are optional; without them blinking
+ * patterns are shown as static color.
+ *
+ * @param self led state
+ * @param dir  led class device directory
+ * @param role color component that drives the led
+ *
+ * @return true if required control files were available, false otherwise
+ */
+static bool led_state_init(led_state_t *self, const char *dir,
+                           mce_hybris_led_role_t role)
+{
+  bool success = false;
+
+  self->role   = role;
+  self->fd_on  = -1;
+  self->fd_off = -1;
+  self->fd_val = -1;
+  self->in_pattern = false;
+
+  if( !led_paths_init(&self->paths, dir) ) {
+    mce_log(LOG_WARNING, "%s: path too long; ignored", dir);
+    goto cleanup;
+  }
+
+  if( (self->maxval = read_number(self->paths.max)) <= 0 )
+  {
+    goto cleanup;
+  }
+  if( (self->fd_val = open(self->paths.val, O_WRONLY|O_APPEND)) == -1 )
+  {
+    goto cleanup;
+  }
+  self->fd_on  = open(self->paths.on,  O_WRONLY|O_APPEND);
+  self->fd_off = open(self->paths.off, O_WRONLY|O_APPEND);
+
+  self->cur_on  = -1;
+  self->cur_off = -1;
+  self->cur_val = -1;
+  led_state_init_values(self);
+
+  self->has_pattern = led_state_probe_pattern(self);
+
+  success = true;
+
+cleanup:
+  if( !success )
+  {
+    led_state_quit(self);
+  }
+
+  return success;
+}
+
+/** Led class device directory */
+#define LED_CLASS_DIR "/sys/class/leds"
+
+/** Maximum number of led class devices driven via sysfs */
+#define LED_CTRL_MAX_CHANNELS 8
+
+/** Led class device name patterns for each role, or NULL if not used */
+static char *led_role_pattern[MCE_HYBRIS_LED_ROLE_COUNT] = { 0 };
+
+/** Default led class device name patterns
+ *
+ * The color must be the whole name, or a separate word in names like
+ * "lp5523:red" or "rgb_red:status" - so that e.g. "infrared" does not
+ * get used as the red led.
+ */
+static const char * const led_role_pattern_def[MCE_HYBRIS_LED_ROLE_COUNT] =
+{
+  [MCE_HYBRIS_LED_ROLE_RED]   = "red|red:*|*[-_:]red|*[-_:]red:*",
+  [MCE_HYBRIS_LED_ROLE_GREEN] = "green|green:*|*[-_:]green|*[-_:]green:*",
+  [MCE_HYBRIS_LED_ROLE_BLUE]  = "blue|blue:*|*[-_:]blue|*[-_:]blue:*",
+  [MCE_HYBRIS_LED_ROLE_WHITE] = 0,
+};
+
+/** Flag for: led name patterns have been changed from defaults */
+static bool led_role_pattern_set = false;
+
+/** Sysfs state data for indicator leds */
+static led_state_t led_states[LED_CTRL_MAX_CHANNELS];
+
+/** Number of used led_states[] entries */
+static int         led_states_cnt = 0;
+
+/** Precompute calibrated brightness values for all indicator leds
+ */
+static void led_ctrl_init_values(void)
+{
+  for( int i = 0; i < led_states_cnt; ++i ) {
+    led_state_init_values(led_states + i);
+  }
+}
+
+/** Questimate of the duration of the kernel delayed work */
+#define LED_CTRL_KERNEL_DELAY 10 // [ms]
+
+/** Minimum delay between breathing steps */
+#define LED_CTRL_BREATHING_DELAY 20 // [ms]
+
+/** Maximum number of breathing steps; rise and fall time combined */
+#define LED_CTRL_MAX_STEPS 256
+
+/** Minimum number of breathing steps on rise/fall time */
+#define LED_CTRL_MIN_STEPS 7
+
+/** Led request parameters */
+typedef struct
+{
+  int  r,g,b;    // color
+  int  on,off;   // blink timing
+  int  level;    // brightness [0 ... 255]
+  bool breathe;  // breathe instead of blinking
+} led_request_t;
+
+/** Test for led request blink/breathing timing equality
+ */
+static bool led_request_has_equal_timing(const led_request_t *self,
+                                         const led_request_t *that)
+{
+    return (self->on  == that->on &&
+            self->off == that->off);
+}
+
+/** Test for led request equality
+ */
+static bool led_request_is_equal(const led_request_t *self,
+                                 const led_request_t *that)
+{
+    return (self->r       == that->r  &&
+            self->g       == that->g  &&
+            self->b       == that->b  &&
+            self->on      == that->on &&
+            self->off     == that->off &&
+            self->level   == that->level &&
+            self->breathe == that->breathe);
+}
+
+/** Test for active led request
+ */
+static bool led_request_has_color(const led_request_t *self)
+{
+    return self->r > 0 || self->g > 0 || self->b > 0;
+}
+
+/** Normalize/sanity check requested values
+ */
+static void led_request_sanitize(led_request_t *self)
+{
+  int min_period = LED_CTRL_BREATHING_DELAY * LED_CTRL_MIN_STEPS;
+
+  if( !led_request_has_color(self) ) {
+    /* blinking/breathing black and black makes no sense */
+    self->on  = 0;
+    self->off = 0;
+    self->breathe = false;
+  }
+  else if( self->on <= 0 || self->off <= 0) {
+    /* both on and off periods must be > 0 for blinking/breathing */
+    self->on  = 0;
+    self->off = 0;
+    self->breathe = false;
+  }
+  else if( self->on < min_period || self->off < min_period ) {
+    /* Whether a pattern should breathe or not is decided at mce side.
+     * But, since there are limitations on how often the led intensity
+     * can be changed, we must check that the rise/fall times are long
+     * enough to allow a reasonable amount of adjustments to be made. */
+    self->breathe = false;
+  }
+}
+
+/** Different styles of led patterns */
+typedef enum {
+  STYLE_OFF,     // led is off
+  STYLE_STATIC,  // led has constant color
+  STYLE_BLINK,   // led is blinking with on/off periods
+  STYLE_BREATH,  // led is breathing with rise/fall times
+} led_style_t;
+
+/** Evaluate request style
+ */
+static led_style_t led_request_get_style(const led_request_t *self)
+{
+  if( !led_request_has_color(self) ) {
+    return STYLE_OFF;
+  }
+
+  if( self->on <= 0 || self->off <= 0 ) {
+    return STYLE_STATIC;
+  }
+
+  if( self->breathe ) {
+    return STYLE_BREATH;
+  }
+
+  return STYLE_BLINK;
+}
+
+/** Number of breathing frame tables to keep cached */
+#define LED_CTRL_RAMP_CACHE 4
+
+/** Final RGB channel values for one breathing segment */
+typedef struct
+{
+  uint8_t  r, g, b;
+  uint32_t duration; // milliseconds to hold the values
+} led_frame_t;
+
+/** Precomputed breathing frame table
+ *
+ * Ready to write channel values for one (color, level, on, off)
+ * combination.
+ */
+typedef struct
+{
+  int         r, g, b;   // color
+  int         on, off;   // rise/fall time
+  int         level;     // brightness
+  unsigned    used;      // lru stamp; 0 = entry not in use
+  int         delay;     // milliseconds between curve steps
+  size_t      steps;     // number of merged segments
+  led_frame_t frame[LED_CTRL_MAX_STEPS];
+} led_ramp_t;
+
+/** Cache of recently used breathing frame tables */
+static led_ramp_t led_ctrl_ramp_cache[LED_CTRL_RAMP_CACHE];
+
+/** Intensity curve for sw breathing */
+static struct {
+  size_t            step;
+  int64_t           tick; // time when the current cycle started [ms]
+  const led_ramp_t *ramp; // frame table, or NULL when not breathing
+} led_ctrl_breathe =
+{
+  .step  = 0,
+  .tick  = 0,
+  .ramp  = 0,
+};
+
+/** Flag for: controls for RGB leds exist in sysfs */
+static bool led_ctrl_uses_sysfs = false;
+
+/** Monotonic time of the last led sysfs change [ms], or 0 for none */
+static int64_t led_ctrl_write_tick = 0;
+
+/** Mark that kernel side might have delayed work pending */
+static void led_ctrl_mark_write(void)
+{
+  led_ctrl_write_tick = mce_hybris_get_tick();
+}
+
+/** Get time left for kernel side to finish with the last change
+ *
+ * @return milliseconds to wait, or 0 if nothing can be pending
+ */
+static int led_ctrl_settle_delay(void)
+{
+  if( !led_ctrl_write_tick ) {
+    return 0;
+  }
+
+  int64_t left = led_ctrl_write_tick + LED_CTRL_KERNEL_DELAY -
+                 mce_hybris_get_tick();
+
+  return clamp_to_range(0, LED_CTRL_KERNEL_DELAY, left);
+}
+
+/** Currently active RGB led state; initialize to invalid color */
+static led_request_t led_ctrl_curr =
+{
+  /* force 1st change to take effect by initializing to invalid color */
+  .r       = -1,
+  .g       = -1,
+  .b       = -1,
+
+  /* not blinking or breathing */
+  .on      = 0,
+  .off     = 0,
+  .breathe = false,
+
+  /* full brightness */
+  .level   = 255,
+};
+
+/** Close all LED sysfs files */
+static void led_ctrl_close_sysfs_files(void)
+{
+  for( int i = 0; i < led_states_cnt; ++i )
+  {
+    led_state_quit(led_states + i);
+  }
+  led_states_cnt = 0;
+}
+
+/** Get led class device name pattern for a role
+ *
+ * @param role led role
+ *
+ * @return glob pattern, or NULL if role is not used
+ */
+static const char *led_ctrl_get_role_pattern(mce_hybris_led_role_t role)
+{
+  return led_role_pattern_set ? led_role_pattern[role] : led_role_pattern_def[role];
+}
+
+/** Match led class device name against role pattern
+ *
+ * @param pat  '|' separated list of fnmatch() style globs
+ * @param name led class device name
+ *
+ * @return true if any of the globs matches, false otherwise
+ */
+static bool led_ctrl_match_pattern(const char *pat, const char *name)
+{
+  char glob[256];
+
+  while( *pat ) {
+    size_t len = strcspn(pat, "|");
+
+    if( len < sizeof glob ) {
+      memcpy(glob, pat, len), glob[len] = 0;
+      if( !fnmatch(glob, name, 0) ) {
+        return true;
+      }
+    }
+
+    pat += len;
+    if( *pat ) ++pat;
+  }
+
+  return false;
+}
+
+/** Find role for led class device name
+ *
+ * @param name led class device name
+ *
+ * @return role, or MCE_HYBRIS_LED_ROLE_COUNT if name does not match any
+ */
+static mce_hybris_led_role_t led_ctrl_match_role(const char *name)
+{
+  int role = 0;
+
+  for( ; role < MCE_HYBRIS_LED_ROLE_COUNT; ++role ) {
+    const char *pat = led_ctrl_get_role_pattern(role);
+    if( pat && led_ctrl_match_pattern(pat, name) ) {
+      break;
+    }
+  }
+
+  return role;
+}
+
+/** Scan led class devices and open sysfs control files for matching leds
+ *
+ * @return true if at least one led was available, false otherwise
+ */
+static bool led_ctrl_probe_sysfs_files(void)
+{
+  struct dirent **names = 0;
+
+  int cnt = scandir(LED_CLASS_DIR, &names, 0, alphasort);
+
+  for( int i = 0; i < cnt; ++i ) {
+    const char *name = names[i]->d_name;
+
+    if( *name == '.' ) {
+      continue;
+    }
+
+    mce_hybris_led_role_t role = led_ctrl_match_role(name);
+
+    if( role == MCE_HYBRIS_LED_ROLE_COUNT ) {
+      continue;
+    }
+
+    if( led_states_cnt >= LED_CTRL_MAX_CHANNELS ) {
+      mce_log(LOG_WARNING, "%s: too many leds; ignored", name);
+      continue;
+    }
+
+    char dir[LED_PATH_MAX];
+    if( !path_format(dir, sizeof dir, LED_CLASS_DIR, name) ) {
+      mce_log(LOG_WARNING, "%s: name too long; ignored", name);
+      continue;
+    }
+
+    led_state_t *led = led_states + led_states_cnt;
+
+    if( !led_state_init(led, dir, role) ) {
+      continue;
+    }
+
+    led->chn = led_states_cnt;
+
+    mce_log(LOG_DEBUG, "%s: role=%d, max_brightness=%d%s%s", name, role,
+            led->maxval, led->fd_on == -1 ? ", no blink" : "",
+            led->has_pattern ? ", pattern trigger" : "");
+    ++led_states_cnt;
+  }
+
+  for( int i = 0; i < cnt; ++i ) {
+    free(names[i]);
+  }
+  free(names);
+
+  return led_states_cnt > 0;
+}
+
+/** Helper for scaling values in 0-255 range
+ *
+ * @param value input value in [0...255] range
+ * @param scale scaling factor [0...255]
+ *
+ * @return scaled value [0...255]
+ */
+static inline int led_ctrl_scale_value(int value, int scale)
+{
+  /* round up */
+  return (value * scale + 255 - 1) / 255;
+}
+
+/** Pick the color component that drives a LED channel
+ *
+ * @param chn led channel index
+ * @param r   red intensity [0...255]
+ * @param g   green intensity [0...255]
+ * @param b   blue intensity [0...255]
+ *
+ * @return channel intensity [0...255]
+ */
+static int led_ctrl_get_channel_value(int chn, int r, int g, int b)
+{
+  switch( led_states[chn].role ) {
+  case MCE_HYBRIS_LED_ROLE_RED:   return r;
+  case MCE_HYBRIS_LED_ROLE_GREEN: return g;
+  case MCE_HYBRIS_LED_ROLE_BLUE:  return b;
+  default: break;
+  }
+
+  /* Single color leds follow the brightest component */
+  int v = r;
+  if( v < g ) v = g;
+  if( v < b ) v = b;
+  return v;
+}
+
+/** Change blinking attributes of a LED channel */
+static void led_ctrl_set_channel_blink(int chn, int on, int off)
+{
+  led_state_set_blink(led_states + chn, on, off);
+}
+
+/** Change intensity attribute of a LED channel */
+static void led_ctrl_set_channel_value(int chn, int val)
+{
+  led_state_set_value(led_states + chn, val);
+}
+
+/** Change blinking attributes of all LED channels */
+static void led_ctrl_set_rgb_blink(int on, int off)
+{
+  for( int i = 0; i < led_states_cnt; ++i ) {
+    led_ctrl_set_channel_blink(i, on, off);
+  }
+  led_ctrl_mark_write();
+}
+
+/** Change intensity attributes of all LED channels */
+static void led_ctrl_set_rgb_value(int r, int g, int b)
+{
+  for( int i = 0; i < led_states_cnt; ++i ) {
+    led_ctrl_set_channel_value(i, led_ctrl_get_channel_value(i, r, g, b));
+  }
+  led_ctrl_mark_write();
+}
+
+/** Generate breathing frame table for use from breathing timer
+ *
+ * @param ramp frame table to fill in
+ * @param req  led request with color, brightness and timing
+ */
+static void led_ctrl_generate_ramp(led_ramp_t *ramp, const led_request_t *req)
+{
+  int ms_on  = req->on;
+  int ms_off = req->off;
+
+  int t = ms_on + ms_off;
+  int s = (t + LED_CTRL_MAX_STEPS - 1) / LED_CTRL_MAX_STEPS;
+
+  if( s < LED_CTRL_BREATHING_DELAY ) {
+    s = LED_CTRL_BREATHING_DELAY;
+  }
+  int n = (t + s - 1) / s;
+
+  int steps_on  = (n * ms_on + t / 2) / t;
+  int steps_off = n - steps_on;
+
+  // adjust color by brightness level
+  int l = req->level;
+  int r = led_ctrl_scale_value(req->r, l);
+  int g = led_ctrl_scale_value(req->g, l);
+  int b = led_ctrl_scale_value(req->b, l);
+
+  int k = 0;
+
+  /* Quarter sine rise, followed by mirrored fall */
+  for( int i = 0; i < n; ++i ) {
+    float t = (i < steps_on ?
+               (float)i / steps_on :
+               1.0f - (float)(i - steps_on) / steps_off);
+    float f = ramp_curve_value(MCE_HYBRIS_CURVE_EASE_OUT, t);
+    int   v = (uint8_t)(f * 255.0f);
+
+    // adjust by curve position
+    led_frame_t frame = {
+      .r = led_ctrl_scale_value(r, v),
+      .g = led_ctrl_scale_value(g, v),
+      .b = led_ctrl_scale_value(b, v),
+      .duration = s,
+    };
+
+    /* Values repeat near the top and bottom of the curve after
+     * quantization; extend the previous segment instead of
+     * waking up just to write the same values again */
+    if( k > 0 &&
+        ramp->frame[k-1].r == frame.r &&
+        ramp->frame[k-1].g == frame.g &&
+        ramp->frame[k-1].b == frame.b ) {
+      ramp->frame[k-1].duration += s;
+      continue;
+    }
+
+    ramp->frame[k++] = frame;
+  }
+
+  ramp->r     = req->r;
+  ramp->g     = req->g;
+  ramp->b     = req->b;
+  ramp->on    = req->on;
+  ramp->off   = req->off;
+  ramp->level = req->level;
+  ramp->delay = s;
+  ramp->steps = k;
+
+  mce_log(LOG_DEBUG, "delay=%d, steps_on=%d, steps_off=%d, segments=%d",
+          ramp->delay, steps_on, steps_off, k);
+}
+
+/** Lookup breathing frame table, generate it if not cached
+ *
+ * @param req led request with color, brightness and timing
+ *
+ * @return frame table
+ */
+static const led_ramp_t *led_ctrl_get_ramp(const led_request_t *req)
+{
+  static unsigned stamp = 0;
+
+  led_ramp_t *ramp = 0;
+
+  for( int i = 0; i < LED_CTRL_RAMP_CACHE; ++i ) {
+    led_ramp_t *cand = &led_ctrl_ramp_cache[i];
+
+    if( cand->used &&
+        cand->r     == req->r  && cand->g   == req->g   &&
+        cand->b     == req->b  && cand->on  == req->on  &&
+        cand->off   == req->off && cand->level == req->level ) {
+      ramp = cand;
+      break;
+    }
+  }
+
+  if( !ramp ) {
+    /* Replace the least recently used entry */
+    ramp = &led_ctrl_ramp_cache[0];
+    for( int i = 1; i < LED_CTRL_RAMP_CACHE; ++i ) {
+      if( ramp->used > led_ctrl_ramp_cache[i].used ) {
+        ramp = &led_ctrl_ramp_cache[i];
+      }
+    }
+    led_ctrl_generate_ramp(ramp, req);
+  }
+
+  ramp->used = ++stamp;
+
+  return ramp;
+}
+
+/** Maximum size of pattern trigger text; sysfs writes are limited to a page */
+#define LED_CTRL_PATTERN_MAX 4096
+
+/** Flag for: breathing is driven by kernel pattern trigger */
+static bool led_ctrl_in_pattern = false;
+
+/** Format breathing frame table as pattern trigger text
+ *
+ * The kernel interpolates linearly from one pattern entry to the
+ * next, so the merged segments can be passed through as is.
+ *
+ * @param chn  led channel index
+ * @param ramp frame table
+ * @param buff where to store the text
+ * @param size size of buff
+ *
+ * @return length of text, or zero if it does not fit in buff
+ */
+static size_t led_ctrl_format_pattern(int chn, const led_ramp_t *ramp,
+                                      char *buff, size_t size)
+{
+  const led_state_t *led = led_states + chn;
+
+  size_t len = 0;
+
+  for( size_t i = 0; i < ramp->steps; ++i ) {
+    const led_frame_t *frame = &ramp->frame[i];
+
+    int val = led_ctrl_get_channel_value(chn, frame->r, frame->g, frame->b);
+
+    const led_number_t *num = &led->scaled_txt[val];
+    led_number_t        dur;
+    led_number_set(&dur, frame->duration);
+
+    if( len + num->len + dur.len + 2 > size ) {
+      return 0;
+    }
+
+    memcpy(buff + len, num->txt, num->len), len += num->len;
+    buff[len++] = ' ';
+    memcpy(buff + len, dur.txt, dur.len), len += dur.len;
+    buff[len++] = ' ';
+  }
+
+  return len;
+}
+
+/** Stop kernel side breathing on all RGB channels */
+static void led_ctrl_stop_pattern(void)
+{
+  if( !led_ctrl_in_pattern ) {
+    goto cleanup;
+  }
+
+  for( int i = 0; i < led_states_cnt; ++i ) {
+    led_state_stop_pattern(led_states + i);
+  }
+  led_ctrl_in_pattern = false;
+  led_ctrl_mark_write();
+
+cleanup:
+  return;
+}
+
+/** Program breathing frame table to kernel pattern trigger
+ *
+ * @param ramp frame table
+ *
+ * @return true if kernel is now running the pattern, false otherwise
+ */
+static bool led_ctrl_start_pattern(const led_ramp_t *ramp)
+{
+  static char buff[LED_CTRL_PATTERN_MAX];
+
+  bool res = false;
+
+  for( int i = 0; i < led_states_cnt; ++i ) {
+    if( !led_states[i].has_pattern ) {
+      goto cleanup;
+    }
+  }
+
+  for( int i = 0; i < led_states_cnt; ++i ) {
+    size_t len = led_ctrl_format_pattern(i, ramp, buff, sizeof buff);
+
+    if( !len || !led_state_start_pattern(led_states + i, buff, len) ) {
+      mce_log(LOG_WARNING, "failed to program led pattern trigger");
+      goto cleanup;
+    }
+  }
+
+  led_ctrl_in_pattern = true;
+  res = true;
+
+cleanup:
+  if( !res ) {
+    /* Clean up partially programmed channels too */
+    led_ctrl_in_pattern = true;
+    led_ctrl_stop_pattern();
+  }
+
+  return res;
+}
+
+/** Timer id for stopping led */
+static guint led_ctrl_stop_id = 0;
+
+/** Timer id for breathing/setting led */
+static guint led_ctrl_step_id = 0;
+
+/** Set static or blinking led state
+ */
+static void led_ctrl_set_static(void)
+{
+  // get configured color
+  int r = led_ctrl_curr.r;
+  int g = led_ctrl_curr.g;
+  int b = led_ctrl_curr.b;
+
+  // adjust by brightness level
+  int l = led_ctrl_curr.level;
+
+  r = led_ctrl_scale_value(r, l);
+  g = led_ctrl_scale_value(g, l);
+  b = led_ctrl_scale_value(b, l);
+
+  // set led blinking and color
+  led_ctrl_set_rgb_blink(led_ctrl_curr.on, led_ctrl_curr.off);
+  led_ctrl_set_rgb_value(r, g, b);
+}
+
+/** Timer callback for setting led
+ */
+static gboolean led_ctrl_static_cb(gpointer aptr)
+{
+  (void) aptr;
+
+  if( !led_ctrl_step_id ) {
+    goto cleanup;
+  }
+
+  led_ctrl_step_id = 0;
+
+  led_ctrl_set_static();
+
+cleanup:
+  return FALSE;
+}
+
+/** Timer callback for taking a led breathing step
+ */
+static gboolean led_ctrl_step_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  if( !led_ctrl_step_id ) {
+    goto cleanup;
+  }
+
+  const led_ramp_t *ramp = led_ctrl_breathe.ramp;
+
+  if( led_ctrl_breathe.step >= ramp->steps ) {
+    led_ctrl_breathe.step = 0;
+  }
+
+  if( led_ctrl_breathe.step == 0 ) {
+    led_ctrl_breathe.tick = mce_hybris_get_tick();
+  }
+
+  // set led color from frame table
+  const led_frame_t *frame = &ramp->frame[led_ctrl_breathe.step++];
+  led_ctrl_set_rgb_value(frame->r, frame->g, frame->b);
+
+  // hold the values for the duration of the segment
+  led_ctrl_step_id = g_timeout_add(frame->duration, led_ctrl_step_cb, 0);
+
+cleanup:
+  return FALSE;
+}
+
+/** Start breathing using current frame table
+ *
+ * Kernel pattern trigger is used when available, breathing
+ * timer is used as fallback.
+ */
+static void led_ctrl_start_breathing(void)
+{
+  if( led_ctrl_start_pattern(led_ctrl_breathe.ramp) ) {
+    goto cleanup;
+  }
+
+  if( !led_ctrl_step_id ) {
+    led_ctrl_step_id = g_timeout_add(led_ctrl_breathe.ramp->delay,
+                                     led_ctrl_step_cb, 0);
+  }
+
+cleanup:
+  return;
+}
+
+/** Continue timer based breathing using a new frame table
+ *
+ * Frame tables with equal timing cover equally long cycles, but
+ * the number and length of merged segments depend on color and
+ * brightness. Instead of reusing the step index, the position
+ * within the current cycle is mapped to the matching segment of
+ * the new table and the timer is rescheduled for what is left of
+ * that segment - so that the breathing phase is retained.
+ */
+static void led_ctrl_seek_breathing(void)
+{
+  const led_ramp_t *ramp = led_ctrl_breathe.ramp;
+
+  /* Nothing to do unless a cycle is already in progress */
+  if( !led_ctrl_step_id || !led_ctrl_breathe.step ) {
+    goto cleanup;
+  }
+
+  int64_t period = 0;
+  for( size_t i = 0; i < ramp->steps; ++i ) {
+    period += ramp->frame[i].duration;
+  }
+
+  if( period <= 0 ) {
+    goto cleanup;
+  }
+
+  int64_t now = mce_hybris_get_tick();
+  int64_t pos = (now - led_ctrl_breathe.tick) % period;
+
+  led_ctrl_breathe.tick = now - pos;
+
+  size_t step = 0;
+  while( step + 1 < ramp->steps && pos >= ramp->frame[step].duration ) {
+    pos -= ramp->frame[step++].duration;
+  }
+
+  // set led color from matching segment
+  const led_frame_t *frame = &ramp->frame[step];
+  led_ctrl_set_rgb_value(frame->r, frame->g, frame->b);
+  led_ctrl_breathe.step = step + 1;
+
+  // hold the values for the rest of the segment
+  g_source_remove(led_ctrl_step_id);
+  led_ctrl_step_id = g_timeout_add(frame->duration - pos ?: 1,
+                                   led_ctrl_step_cb, 0);
+
+cleanup:
+  return;
+}
+
+static bool reset_blinking = true;
+
+/** Stop current led state and start the next one
+ *
+ * Settle delays are used only when there are recent changes
+ * the kernel side might still be processing.
+ */
+static void led_ctrl_restart(void)
+{
+  bool wrote = reset_blinking;
+
+  // kernel side breathing off
+  led_ctrl_stop_pattern();
+
+  if( reset_blinking ) {
+    // blinking off - must be followed by rgb set to have an effect
+    led_ctrl_set_rgb_blink(0, 0);
+
+    // set rgb to black
+    led_ctrl_set_rgb_value(0, 0, 0);
+    reset_blinking = false;
+  }
+
+  if( !led_request_has_color(&led_ctrl_curr) ) {
+    // set rgb to black before returning
+    if( !wrote ) {
+      led_ctrl_set_rgb_value(0, 0, 0);
+    }
+  }
+  else if( led_ctrl_breathe.ramp ) {
+    // start breathing
+    led_ctrl_start_breathing();
+  }
+  else if( wrote ) {
+    // set rgb to target after blink reset has been processed
+    led_ctrl_step_id = g_timeout_add(led_ctrl_settle_delay() ?: 1,
+                                     led_ctrl_static_cb, 0);
+  }
+  else {
+    // nothing to wait for
+    led_ctrl_set_static();
+  }
+}
+
+/** Timer callback from stopping/restarting led
+ */
+static gboolean led_ctrl_stop_cb(gpointer aptr)
+{
+  (void) aptr;
+
+  if( !led_ctrl_stop_id ) {
+    goto cleanup;
+  }
+  led_ctrl_stop_id = 0;
+
+  led_ctrl_restart();
+
+cleanup:
+
+  return FALSE;
+}
+
+/** Start static/blinking/breathing led
+ */
+static void
+led_ctrl_start(const led_request_t *next)
+{
+  led_request_t work = *next;
+
+  led_request_sanitize(&work);
+
+  if( led_request_is_equal(&led_ctrl_curr, &work) ) {
+    goto cleanup;
+  }
+
+  /* Assumption: Before changing the led state, we need to wait a bit
+   * for kernel side to finish with last change we made and then possibly
+   * reset the blinking status and wait a bit more */
+  bool restart = true;
+
+  led_style_t old_style = led_request_get_style(&led_ctrl_curr);
+  led_style_t new_style = led_request_get_style(&work);
+
+  /* Exception: When we are already breathing and continue to
+   * breathe, the blinking is not in use and the breathing timer
+   * is keeping the updates far enough from each other */
+  if( old_style == STYLE_BREATH && new_style == STYLE_BREATH &&
+      led_request_has_equal_timing(&led_ctrl_curr, &work) ) {
+    restart = false;
+  }
+
+  led_ctrl_curr = work;
+
+  if( !restart ) {
+    // same timing, possibly different color/brightness: swap frame table
+    led_ctrl_breathe.ramp = led_ctrl_get_ramp(&work);
+
+    if( led_ctrl_stop_id ) {
+      // breathing is (re)started after pending restart
+    }
+    else if( led_ctrl_in_pattern ) {
+      // kernel side pattern needs to be reprogrammed
+      led_ctrl_start_breathing();
+    }
+    else {
+      // timer side breathing continues from the same phase
+      led_ctrl_seek_breathing();
+    }
+  }
+  else {
+    // stop existing breathing timer
+    if( led_ctrl_step_id ) {
+      g_source_remove(led_ctrl_step_id), led_ctrl_step_id = 0;
+    }
+
+    // re-evaluate breathing constants
+    led_ctrl_breathe.ramp = 0;
+    led_ctrl_breathe.step = 0;
+    if( new_style == STYLE_BREATH ) {
+      led_ctrl_breathe.ramp = led_ctrl_get_ramp(&work);
+    }
+
+    /* Schedule led off after kernel settle timeout; once that
+     * is done, new led color/blink/breathing will be started */
+    if( !led_ctrl_stop_id ) {
+      reset_blinking = (old_style == STYLE_BLINK ||
+                        new_style == STYLE_BLINK);
+
+      int delay = led_ctrl_settle_delay();
+      if( delay > 0 ) {
+        led_ctrl_stop_id = g_timeout_add(delay, led_ctrl_stop_cb, 0);
+      }
+      else {
+        led_ctrl_restart();
+      }
+    }
+  }
+
+cleanup:
+
+  return;
+}
+
+/** Nanosleep helper
+ *
+ * Waits only for as long as kernel side might still be busy.
+ */
+static void led_ctrl_wait_kernel(void)
+{
+  int ms = led_ctrl_settle_delay();
+
+  if( ms > 0 ) {
+    struct timespec ts = { 0, ms * 1000000l };
+    TEMP_FAILURE_RETRY(nanosleep(&ts, &ts));
+  }
+}
+
+/** Set led class device name pattern used for an indicator led role
+ *
+ * Must be called before mce_hybris_indicator_init(). Once any pattern
+ * has been set, roles that have not been configured are not used.
+ *
+ * @param role    led role
+ * @param pattern fnmatch() style glob for /sys/class/leds entries,
+ *                or several globs separated with '|',
+ *                or NULL to leave the role unused
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_indicator_set_led_pattern(mce_hybris_led_role_t role,
+                                          const char *pattern)
+{
+  bool ack = false;
+
+  if( role < 0 || role >= MCE_HYBRIS_LED_ROLE_COUNT ) {
+    goto cleanup;
+  }
+
+  led_role_pattern_set = true;
+
+  free(led_role_pattern[role]);
+  led_role_pattern[role] = pattern ? strdup(pattern) : 0;
+
+  ack = true;
+
+cleanup:
+  return ack;
+}
+
+/** Last state written to libhybris indicator led */
+static struct light_state_t indicator_lst;
+
+/** Flag for: indicator_lst holds current libhybris indicator led state */
+static bool indicator_lst_valid = false;
+
+/** Initialize libhybris indicator led device object
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_indicator_init(void)
+{
+  static bool done = false;
+  static bool ack  = false;
+
+  if( done ) {
+    goto cleanup;
+  }
+
+  done = true;
+
+  if( !probe_cache_is_missing(PROBE_SYSFS_LEDS) ) {
+    led_ctrl_uses_sysfs = led_ctrl_probe_sysfs_files();
+    probe_cache_update(PROBE_SYSFS_LEDS, led_ctrl_uses_sysfs);
+  }
+
+  if( led_ctrl_uses_sysfs ) {
+    /* Use raw sysfs controls */
+
+    /* adjust current state to: color=black */
+    led_request_t req = led_ctrl_curr;
+    req.r = 0;
+    req.g = 0;
+    req.b = 0;
+    led_ctrl_start(&req);
+  }
+  else {
+    /* Fall back to libhybris */
+
+    if( !mce_hybris_modlights_load() ) {
+      goto cleanup;
+    }
+
+    mce_light_device_probe(LIGHT_ID_NOTIFICATIONS, PROBE_DEV_INDICATOR,
+                           &dev_indicator);
+
+    if( !dev_indicator ) {
+      mce_log(LOG_WARNING, "failed to open indicator led device");
+      goto cleanup;
+    }
+  }
+
+  ack = true;
+
+cleanup:
+  return ack;
+}
+
+/** Timer id for finishing asynchronous indicator teardown */
+static guint led_ctrl_quit_id = 0;
+
+/** Callback to notify when asynchronous indicator teardown is done */
+static mce_hybris_indicator_done_fn led_ctrl_quit_done = 0;
+
+/** Start indicator teardown
+ *
+ * Stops timers and kernel side breathing; sysfs files are left
+ * open for led_ctrl_quit_finish().
+ */
+static void led_ctrl_quit_start(void)
+{
+  /* Release libhybris controls */
+
+  if( dev_indicator ) {
+    lw_cancel(MCE_HYBRIS_LIGHT_INDICATOR);
+    mce_light_device_close(dev_indicator), dev_indicator = 0;
+  }
+  indicator_lst_valid = false;
+
+  /* Stop sysfs control activity */
+
+  if( led_ctrl_uses_sysfs ) {
+    // cancel timers
+    if( led_ctrl_step_id ) {
+      g_source_remove(led_ctrl_step_id), led_ctrl_step_id = 0;
+    }
+    if( led_ctrl_stop_id ) {
+      g_source_remove(led_ctrl_stop_id), led_ctrl_stop_id = 0;
+    }
+
+    // kernel side breathing off
+    led_ctrl_stop_pattern();
+  }
+}
+
+/** Finish indicator teardown and notify pending completion callback
+ */
+static void led_ctrl_quit_finish(void)
+{
+  if( led_ctrl_quit_id ) {
+    g_source_remove(led_ctrl_quit_id), led_ctrl_quit_id = 0;
+  }
+
+  /* Release sysfs controls */
+
+  if( led_ctrl_uses_sysfs ) {
+    // blink off
+    led_ctrl_set_rgb_blink(0, 0);
+
+    // zero brightness
+    led_ctrl_set_rgb_value(0, 0, 0);
+
+    // close sysfs files
+    led_ctrl_close_sysfs_files();
+    led_ctrl_uses_sysfs = false;
+  }
+
+  mce_hybris_indicator_done_fn done = led_ctrl_quit_done;
+  led_ctrl_quit_done = 0;
+
+  if( done ) {
+    done();
+  }
+}
+
+/** Timer callback for finishing asynchronous indicator teardown
+ */
+static gboolean led_ctrl_quit_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  if( led_ctrl_quit_id ) {
+    led_ctrl_quit_id = 0;
+    led_ctrl_quit_finish();
+  }
+
+  return FALSE;
+}
+
+/** Release libhybris indicator led device object
+ *
+ * Blocks only if the kernel side might still be processing
+ * the most recent led change.
+ */
+void mce_hybris_indicator_quit(void)
+{
+  led_ctrl_quit_start();
+
+  // allow kernel side to settle down
+  led_ctrl_wait_kernel();
+
+  led_ctrl_quit_finish();
+}
+
+/** Release indicator led controls without blocking
+ *
+ * If the kernel side might still be processing the most recent led
+ * change, the final writes are made from a timer. Calling
+ * mce_hybris_indicator_quit() finishes pending teardown immediately.
+ *
+ * @param cb function to call when teardown is done, or NULL
+ *
+ * @return true if teardown was finished, false if it is pending
+ */
+bool mce_hybris_indicator_quit_async(mce_hybris_indicator_done_fn cb)
+{
+  led_ctrl_quit_done = cb;
+
+  if( led_ctrl_quit_id ) {
+    goto cleanup;
+  }
+
+  led_ctrl_quit_start();
+
+  int delay = led_ctrl_uses_sysfs ? led_ctrl_settle_delay() : 0;
+
+  if( delay > 0 ) {
+    led_ctrl_quit_id = g_timeout_add(delay, led_ctrl_quit_cb, 0);
+  }
+  else {
+    led_ctrl_quit_finish();
+  }
+
+cleanup:
+  return led_ctrl_quit_id == 0;
+}
+
+/** Normalize indicator led pattern parameters
+ *
+ * @param r     red intensity, clamped to 0 ... 255
+ * @param g     green intensity, clamped to 0 ... 255
+ * @param b     blue intensity, clamped to 0 ... 255
+ * @param ms_on  on period, clamped to [0, 60] seconds or 0 for no flashing
+ * @param ms_off off period, clamped to [0, 60] seconds or 0 for no flashing
+ */
+static void mce_hybris_indicator_sanitize(int *r, int *g, int *b,
+                                          int *ms_on, int *ms_off)
+{
+  /* Clamp time periods to [0, 60] second range.
+   *
+   * While periods longer than few seconds might not count as "blinking",
+   * we need to leave some slack to allow beacon style patterns with
+   * relatively long off periods */
+  *ms_on  = clamp_to_range(0, 60000, *ms_on);
+  *ms_off = clamp_to_range(0, 60000, *ms_off);
+
+  /* Both on and off periods need to be non-zero for the blinking
+   * to happen in the first place. And if the periods are too
+   * short it starts to look like led failure more than indication
+   * of something. */
+  if( *ms_on < 50 || *ms_off < 50 ) {
+    *ms_on = *ms_off = 0;
+  }
+
+  /* Clamp rgb values to [0, 255] range */
+  *r = clamp_to_range(0, 255, *r);
+  *g = clamp_to_range(0, 255, *g);
+  *b = clamp_to_range(0, 255, *b);
+}
+
+/** Fill in sysfs led request for sanitized indicator pattern
+ *
+ * @param req     led request to fill in
+ * @param breathe breathing state, or -1 to keep current one
+ */
+static void mce_hybris_indicator_fill_request(led_request_t *req,
+                                              int r, int g, int b,
+                                              int ms_on, int ms_off,
+                                              int breathe)
+{
+  /* adjust current state to: color & timing as requested */
+  *req = led_ctrl_curr;
+  req->r   = r;
+  req->g   = g;
+  req->b   = b;
+  req->on  = ms_on;
+  req->off = ms_off;
+
+  if( breathe >= 0 ) {
+    req->breathe = breathe;
+  }
+}
+
+/** Fill in libhybris light state for sanitized indicator pattern
+ *
+ * @param lst light state to fill in
+ */
+static void mce_hybris_indicator_fill_state(struct light_state_t *lst,
+                                            int r, int g, int b,
+                                            int ms_on, int ms_off)
+{
+  r = lut_hal_table(LUT_LED_RED)[r];
+  g = lut_hal_table(LUT_LED_GREEN)[g];
+  b = lut_hal_table(LUT_LED_BLUE)[b];
+
+  memset(lst, 0, sizeof *lst);
+
+  lst->color          = (0xff << 24) | (r << 16) | (g << 8) | (b << 0);
+  lst->brightnessMode = BRIGHTNESS_MODE_USER;
+
+  if( ms_on > 0 && ms_off > 0 ) {
+    lst->flashMode    = LIGHT_FLASH_HARDWARE;
+    lst->flashOnMS    = ms_on;
+    lst->flashOffMS   = ms_off;
+  }
+  else {
+    lst->flashMode    = LIGHT_FLASH_NONE;
+    lst->flashOnMS    = 0;
+    lst->flashOffMS   = 0;
+  }
+}
+
+/** Check if indicator led already has sanitized pattern
+ *
+ * @param breathe breathing state, or -1 to keep current one
+ *
+ * @return true if writing the pattern would have no effect
+ */
+static bool mce_hybris_indicator_is_current(int r, int g, int b,
+                                            int ms_on, int ms_off,
+                                            int breathe)
+{
+  if( led_ctrl_uses_sysfs ) {
+    led_request_t req;
+    mce_hybris_indicator_fill_request(&req, r, g, b, ms_on, ms_off, breathe);
+    led_request_sanitize(&req);
+    return led_request_is_equal(&led_ctrl_curr, &req);
+  }
+
+  if( !indicator_lst_valid ) {
+    return false;
+  }
+
+  struct light_state_t lst;
+  mce_hybris_indicator_fill_state(&lst, r, g, b, ms_on, ms_off);
+
+  return (lst.color          == indicator_lst.color          &&
+          lst.flashMode      == indicator_lst.flashMode      &&
+          lst.flashOnMS      == indicator_lst.flashOnMS      &&
+          lst.flashOffMS     == indicator_lst.flashOffMS     &&
+          lst.brightnessMode == indicator_lst.brightnessMode);
+}
+
+/** Write sanitized indicator led pattern via sysfs or libhybris
+ *
+ * Note: No logging, for use from light transactions too.
+ *
+ * @param breathe breathing state, or -1 to keep current one;
+ *                not available via libhybris
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_indicator_write(int r, int g, int b,
+                                       int ms_on, int ms_off, int breathe)
+{
+  bool ack = false;
+
+  /* Use raw sysfs controls if possible */
+
+  if( led_ctrl_uses_sysfs ) {
+    led_request_t req;
+    mce_hybris_indicator_fill_request(&req, r, g, b, ms_on, ms_off, breathe);
+    led_ctrl_start(&req);
+
+    ack = true;
+    goto cleanup;
+  }
+
+  /* Fall back to libhybris API */
+
+  struct light_state_t lst;
+
+  mce_hybris_indicator_fill_state(&lst, r, g, b, ms_on, ms_off);
+
+  if( lw_set_light(MCE_HYBRIS_LIGHT_INDICATOR, dev_indicator, &lst) < 0 ) {
+    indicator_lst_valid = false;
+    goto cleanup;
+  }
+
+  indicator_lst       = lst;
+  indicator_lst_valid = true;
+  ack = true;
+
+cleanup:
+  return ack;
+}
+
+/** Set indicator led pattern via libhybris
+ *
+ * @param r     red intensity 0 ... 255
+ * @param g     green intensity 0 ... 255
+ * @param b     blue intensity 0 ... 255
+ * @param ms_on milliseconds to keep the led on, or 0 for no flashing
+ * @param ms_on milliseconds to keep the led off, or 0 for no flashing
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_indicator_set_pattern(int r, int g, int b,
+                                      int ms_on, int ms_off)
+{
+  bool     ack = false;
+
+  mce_hybris_indicator_sanitize(&r, &g, &b, &ms_on, &ms_off);
+
+  if( !led_ctrl_uses_sysfs && !mce_hybris_indicator_init() ) {
+    goto cleanup;
+  }
+
+  if( !mce_hybris_indicator_write(r, g, b, ms_on, ms_off, -1) ) {
+    goto cleanup;
+  }
+
+  ack = true;
+
+cleanup:
+
+  mce_log(LOG_DEBUG, "%s(%d,%d,%d,%d,%d) -> %s", __FUNCTION__,
+         r,g,b, ms_on, ms_off , ack ? "success" : "failure");
+
+  return ack;
+}
+
+/** Enable/disable sw breathing
+ *
+ * @param enable true to enable sw breathing, false to disable
+ */
+void mce_hybris_indicator_enable_breathing(bool enable)
+{
+  if( !led_ctrl_uses_sysfs ) {
+    // no breathing control via hybris api
+    goto cleanup;
+  }
+
+  /* adjust current state to: breathing as requested */
+  led_request_t work = led_ctrl_curr;
+  work.breathe = enable;
+  led_ctrl_start(&work);
+
+cleanup:
+  return;
+}
+
+/** Set indicator led brightness
+ *
+ * @param level 1=minimum, 255=maximum
+ *
+ * @return true on success, or false on failure
+ */
+bool mce_hybris_indicator_set_brightness(int level)
+{
+  if( !led_ctrl_uses_sysfs ) {
+    // no breathing control via hybris api
+    goto cleanup;
+  }
+
+  /* Clamp brightness values to [1, 255] range */
+  level = clamp_to_range(1, 255, level);
+
+  /* adjust current state to: brightness as requested */
+  led_request_t work = led_ctrl_curr;
+  work.level = level;
+  led_ctrl_start(&work);
+
+cleanup:
+  /* Note: failure means this function is not available - which is
+   * handled at mce side stub. From this plugin we always return true */
+  return true;
+}
+
+/* ------------------------------------------------------------------------- *
+ * light transactions
+ * ------------------------------------------------------------------------- */
+
+/** Write one light from sanitized transaction state
+ *
+ * Note: No logging, the whole transaction is logged by the caller.
+ *
+ * @param id    MCE_HYBRIS_LIGHT_BACKLIGHT etc
+ * @param state sanitized light states
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_lights_write(mce_hybris_light_t id,
+                                    const mce_hybris_lights_state_t *state)
+{
+  switch( id ) {
+  case MCE_HYBRIS_LIGHT_BACKLIGHT:
+    return mce_hybris_backlight_write(state->backlight);
+
+  case MCE_HYBRIS_LIGHT_KEYPAD:
+    return mce_hybris_keypad_write(state->keypad);
+
+  case MCE_HYBRIS_LIGHT_INDICATOR:
+    return mce_hybris_indicator_write(state->led_r, state->led_g,
+                                      state->led_b, state->led_on_ms,
+                                      state->led_off_ms,
+                                      state->led_breathe);
+  default:
+    break;
+  }
+  return false;
+}
+
+/** Set the state of several lights in one pass
+ *
+ * Only the lights selected in state->mask are changed, and lights that
+ * already are in the requested state are skipped. The remaining writes
+ * are ordered so that lights getting dimmer are handled first - from
+ * indicator led to display backlight - followed by lights getting
+ * brighter in the opposite order. This way e.g. the keypad is not left
+ * lit while the display goes dark, and the indicator led does not flash
+ * in the middle of turning the display on.
+ *
+ * In asynchronous mode all writes are queued before the light writer
+ * thread is woken up, and the thread makes them in the same order.
+ *
+ * As with mce_hybris_backlight_set_brightness(), changing the display
+ * backlight cancels ongoing fade and suspends automatic brightness.
+ *
+ * Note: in asynchronous mode success means the requests were queued.
+ *
+ * @param state requested light states
+ *
+ * @return true if all selected lights were set, false otherwise
+ */
+bool mce_hybris_lights_apply(const mce_hybris_lights_state_t *state)
+{
+  mce_hybris_lights_state_t work;
+
+  unsigned skipped = 0;
+  unsigned failed  = 0;
+  bool     up[MCE_HYBRIS_LIGHT_COUNT] = { false, };
+
+  if( !state ) {
+    memset(&work, 0, sizeof work);
+    goto cleanup;
+  }
+
+  work = *state;
+
+  /* Normalize and drop changes that would have no effect */
+
+  if( work.mask & MCE_HYBRIS_LIGHTS_MASK(MCE_HYBRIS_LIGHT_BACKLIGHT) ) {
+    const unsigned bit = MCE_HYBRIS_LIGHTS_MASK(MCE_HYBRIS_LIGHT_BACKLIGHT);
+
+    work.backlight = clamp_to_range(0, 255, work.backlight);
+
+    als_auto_override();
+    mce_hybris_backlight_fade_stop();
+
+    if( !mce_hybris_backlight_init() )
+      failed |= bit;
+    else if( work.backlight == backlight_level )
+      skipped |= bit;
+    else
+      up[MCE_HYBRIS_LIGHT_BACKLIGHT] = work.backlight > backlight_level;
+  }
+
+  if( work.mask & MCE_HYBRIS_LIGHTS_MASK(MCE_HYBRIS_LIGHT_KEYPAD) ) {
+    const unsigned bit = MCE_HYBRIS_LIGHTS_MASK(MCE_HYBRIS_LIGHT_KEYPAD);
+
+    work.keypad = clamp_to_range(0, 255, work.keypad);
+
+    if( !mce_hybris_keypad_init() )
+      failed |= bit;
+    else if( work.keypad == keypad_level )
+      skipped |= bit;
+    else
+      up[MCE_HYBRIS_LIGHT_KEYPAD] = work.keypad > keypad_level;
+  }
+
+  if( work.mask & MCE_HYBRIS_LIGHTS_MASK(MCE_HYBRIS_LIGHT_INDICATOR) ) {
+    const unsigned bit = MCE_HYBRIS_LIGHTS_MASK(MCE_HYBRIS_LIGHT_INDICATOR);
+
+    mce_hybris_indicator_sanitize(&work.led_r, &work.led_g, &work.led_b,
+                                  &work.led_on_ms, &work.led_off_ms);
+
+    if( !led_ctrl_uses_sysfs && !mce_hybris_indicator_init() )
+      failed |= bit;
+    else if( mce_hybris_indicator_is_current(work.led_r, work.led_g,
+                                             work.led_b, work.led_on_ms,
+                                             work.led_off_ms,
+                                             work.led_breathe) )
+      skipped |= bit;
+    else
+      up[MCE_HYBRIS_LIGHT_INDICATOR] = (work.led_r > 0 || work.led_g > 0 ||
+                                        work.led_b > 0);
+  }
+
+  unsigned todo = work.mask & ~(skipped | failed);
+
+  if( !todo ) {
+    goto cleanup;
+  }
+
+  /* Apply changes in one pass */
+
+  bool batch = lw_is_enabled();
+
+  if( batch ) {
+    lw_batch_begin();
+  }
+
+  for( int id = MCE_HYBRIS_LIGHT_COUNT - 1; id >= 0; --id ) {
+    if( (todo & MCE_HYBRIS_LIGHTS_MASK(id)) && !up[id] &&
+        !mce_hybris_lights_write(id, &work) ) {
+      failed |= MCE_HYBRIS_LIGHTS_MASK(id);
+    }
+  }
+
+  for( int id = 0; id < MCE_HYBRIS_LIGHT_COUNT; ++id ) {
+    if( (todo & MCE_HYBRIS_LIGHTS_MASK(id)) && up[id] &&
+        !mce_hybris_lights_write(id, &work) ) {
+      failed |= MCE_HYBRIS_LIGHTS_MASK(id);
+    }
+  }
+
+  if( batch ) {
+    lw_batch_end();
+  }
+
+cleanup:
+
+  mce_log(LOG_DEBUG, "%s(mask=%x, bl=%d, kp=%d, led=%d,%d,%d,%d,%d,%d)"
+          " skipped=%x -> %s", __FUNCTION__, work.mask,
+          work.backlight, work.keypad, work.led_r, work.led_g, work.led_b,
+          work.led_on_ms, work.led_off_ms, work.led_breathe,
+          skipped, (state && !failed) ? "success" : "failure");
+
+  return state && !failed;
+}
+
+/* ========================================================================= *
+ * SENSORS module
+ * ========================================================================= */
+
+/** Convenience function for opening sensors device
+ *
+ * Similar to what we might or might not have available from hardware/sensors.h
+ */
+static int
+mce_sensors_open(const struct hw_module_t* module,
+                 struct sensors_poll_device_t** device)
+{
+  return module->methods->open(module, SENSORS_HARDWARE_POLL,
+                               (struct hw_device_t**)device);
+}
+
+/** Convenience function for closing sensors device
+ *
+ * Similar to what we might or might not have available from hardware/sensors.h
+ */
+static int
+mce_sensors_close(struct sensors_poll_device_t* device)
+{
+  return device->common.close(&device->common);
+}
+
+/** Handle for libhybris sensors plugin */
+static struct sensors_module_t       *mod_sensors = 0;
+
+/** Pointer to libhybris sensor poll device object */
+static struct sensors_poll_device_t  *dev_poll = 0;
+
+/** Device API version of dev_poll, SENSORS_DEVICE_API_VERSION_xxx */
+static uint32_t                       dev_poll_version = 0;
+
+/** Array of sensors available via mod_sensors */
+static const struct sensor_t         *sensor_lut = 0;
+
+/** Number of sensors available via mod_sensors */
+static int                            sensor_cnt = 0;
+
+/** Sensor sampling and batching parameters */
+typedef struct
+{
+  int64_t period;   // sampling period [ns], or 0 for hal default
+  int64_t latency;  // maximum report latency [ns], or 0 for no batching
+} sensor_rate_t;
+
+/** Per sensor type dispatch data */
+typedef struct
+{
+  const struct sensor_t *sensor; // sensor object, or NULL if not available
+  mce_hybris_sensor_fn   hook;   // generic event callback
+  sensor_rate_t          rate;   // requested sampling rate
+  bool                   active; // sensor enabled state
+} sensor_slot_t;
+
+/** Dispatch data indexed by sensor type */
+static sensor_slot_t   sensor_slots[MCE_HYBRIS_SENSOR_TYPE_COUNT];
+
+/** Maximum span of sensor handles covered by sensor_handle_lut */
+#define MCE_HYBRIS_SENSOR_HANDLE_SPAN 1024
+
+/** Dispatch data indexed by sensor handle - sensor_handle_min */
+static sensor_slot_t **sensor_handle_lut = 0;
+
+/** Smallest sensor handle in sensor_handle_lut */
+static int             sensor_handle_min = 0;
+
+/** Number of entries in sensor_handle_lut */
+static int             sensor_handle_cnt = 0;
+
+/** Pointer to libhybris proximity sensor object */
+static const struct sensor_t *ps_sensor = 0;
+
+/** Callback for forwarding proximity sensor events */
+static mce_hybris_ps_fn       ps_hook   = 0;
+
+/** Pointer to libhybris ambient light sensor object */
+static const struct sensor_t *als_sensor = 0;
+
+/** Callback for forwarding ambient light sensor events */
+static mce_hybris_als_fn      als_hook   = 0;
+
+/** Callback for forwarding sensor event batches */
+static mce_hybris_batch_fn    batch_hook = 0;
+
+/** Helper for locating sensor dispatch data by type
+ *
+ * @param type SENSOR_TYPE_LIGHT etc
+ *
+ * @return dispatch data pointer, or NULL if type is not supported
+ */
+static sensor_slot_t *mce_hybris_modsensors_get_slot(int type)
+{
+  if( type <= 0 || type >= MCE_HYBRIS_SENSOR_TYPE_COUNT ) {
+    return 0;
+  }
+  return &sensor_slots[type];
+}
+
+/** Helper for locating sensor dispatch data by sensor handle
+ *
+ * @param handle sensor handle, as in sensors_event_t.sensor
+ * @param type   sensor type, used if handle table is not available
+ *
+ * @return dispatch data pointer, or NULL if sensor is not used
+ */
+static sensor_slot_t *mce_hybris_modsensors_get_slot_by_handle(int handle,
+                                                               int type)
+{
+  if( !sensor_handle_lut ) {
+    return mce_hybris_modsensors_get_slot(type);
+  }
+
+  unsigned i = (unsigned)(handle - sensor_handle_min);
+
+  return (i < (unsigned)sensor_handle_cnt) ? sensor_handle_lut[i] : 0;
+}
+
+/** Helper for locating sensor objects by type
+ *
+ * @param type SENSOR_TYPE_LIGHT etc
+ *
+ * @return sensor pointer, or NULL if not available
+ */
+static const struct sensor_t *mce_hybris_modsensors_get_sensor(int type)
+{
+  sensor_slot_t *slot = mce_hybris_modsensors_get_slot(type);
+  return slot ? slot->sensor : 0;
+}
+
+/** Build type and handle indexed sensor dispatch tables
+ *
+ * If there are several sensors of the same type, the first one
+ * reported by the hal is used.
+ */
+static void mce_hybris_modsensors_build_lut(void)
+{
+  int lo = 0, hi = -1;
+
+  for( int i = 0; i < sensor_cnt; ++i ) {
+    const struct sensor_t *sensor = &sensor_lut[i];
+    sensor_slot_t         *slot   = mce_hybris_modsensors_get_slot(sensor->type);
+
+    if( slot && !slot->sensor ) {
+      slot->sensor = sensor;
+
+      if( hi < lo ) {
+        lo = hi = sensor->handle;
+      }
+      else {
+        if( lo > sensor->handle ) lo = sensor->handle;
+        if( hi < sensor->handle ) hi = sensor->handle;
+      }
+    }
+  }
+
+  if( hi < lo ) {
+    goto cleanup;
+  }
+
+  if( (int64_t)hi - lo >= MCE_HYBRIS_SENSOR_HANDLE_SPAN ) {
+    /* Handles are too sparse; events are dispatched by type */
+    mce_log(LOG_DEBUG, "sensor handles %d..%d; dispatching by type", lo, hi);
+    goto cleanup;
+  }
+
+  sensor_handle_min = lo;
+  sensor_handle_cnt = hi - lo + 1;
+  sensor_handle_lut = calloc(sensor_handle_cnt, sizeof *sensor_handle_lut);
+
+  if( !sensor_handle_lut ) {
+    sensor_handle_cnt = 0;
+    goto cleanup;
+  }
+
+  for( int type = 0; type < MCE_HYBRIS_SENSOR_TYPE_COUNT; ++type ) {
+    sensor_slot_t *slot = &sensor_slots[type];
+    if( slot->sensor ) {
+      sensor_handle_lut[slot->sensor->handle - lo] = slot;
+    }
+  }
+
+cleanup:
+  return;
+}
+
+/** Load libhybris sensors plugin
+ *
+ * Also initializes look up tables for supported sensors.
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_modsensors_load(void)
+{
+  static bool done = false;
+
+  if( done ) goto cleanup;
+
+  done = true;
+
+  mod_sensors = (struct sensors_module_t *)mod_prefetch_get(MOD_PREFETCH_SENSORS);
+  probe_cache_update(PROBE_MOD_SENSORS, mod_sensors != 0);
+
+  if( !mod_sensors ) {
+    mce_log(LOG_WARNING, "failed top open sensors module");
+  }
+  else {
+    mce_log(LOG_DEBUG, "mod_sensors = %p", mod_sensors);
+  }
+
+  if( !mod_sensors ) {
+    goto cleanup;
+  }
+
+  sensor_cnt = mod_prefetch_sensor_cnt;
+  sensor_lut = mod_prefetch_sensor_lut;
+
+  mce_hybris_modsensors_build_lut();
+
+  {
+    uint32_t types = 0;
+    for( int i = 0; i < sensor_cnt; ++i ) {
+      if( sensor_lut[i].type > 0 &&
+          sensor_lut[i].type < MCE_HYBRIS_SENSOR_TYPE_COUNT ) {
+        types |= 1u << sensor_lut[i].type;
+      }
+    }
+    probe_cache_update_sensors(types);
+  }
+
+  als_sensor = mce_hybris_modsensors_get_sensor(SENSOR_TYPE_LIGHT);
+  ps_sensor  = mce_hybris_modsensors_get_sensor(SENSOR_TYPE_PROXIMITY);
+
+cleanup:
+
+  return mod_sensors != 0;
+}
+
+/** Unload libhybris sensors plugin
+ */
+static void mce_hybris_modsensors_unload(void)
+{
+  /* cleanup dependencies */
+  mce_hybris_sensors_quit();
+
+  free(sensor_handle_lut), sensor_handle_lut = 0;
+  sensor_handle_cnt = 0;
+
+  /* actually unload the module */
+  // FIXME: how to unload libhybris modules?
+}
+
+/* ------------------------------------------------------------------------- *
+ * sensor statistics
+ * ------------------------------------------------------------------------- */
+
+/* Per thread sensor statistics
+ *
+ * Each block is written only by the thread that owns it, so no locking
+ * or atomic read-modify-write operations are needed on update. Readers
+ * sum up the blocks using relaxed loads.
+ */
+
+/** Statistics updated by the sensor worker thread */
+static mce_hybris_sensor_stats_t sensor_stats_worker;
+
+/** Statistics updated by the proximity fast lane thread */
+static mce_hybris_sensor_stats_t sensor_stats_fast;
+
+/** Statistics updated by the sensor replay thread */
+static mce_hybris_sensor_stats_t sensor_stats_replay;
+
+/** Statistics updated by the glib main loop / other threads */
+static mce_hybris_sensor_stats_t sensor_stats_other;
+
+/** Statistics block used by the current thread */
+static __thread mce_hybris_sensor_stats_t *sensor_stats_self = 0;
+
+/** Get statistics block owned by the current thread
+ */
+static mce_hybris_sensor_stats_t *mce_hybris_sensor_stats_self(void)
+{
+  return sensor_stats_self ? sensor_stats_self : &sensor_stats_other;
+}
+
+/** Increment counter owned by the current thread
+ */
+static inline void sensor_stats_inc(uint64_t *counter, uint64_t amount)
+{
+  __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+/** Read counter owned by some thread
+ */
+static inline uint64_t sensor_stats_get(const uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/** Get CLOCK_BOOTTIME time stamp, i.e. sensor event time base
+ *
+ * @return nanoseconds since boot
+ */
+static int64_t mce_hybris_sensor_stats_now(void)
+{
+  struct timespec ts = { 0, 0 };
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec * (int64_t)1000000000 + ts.tv_nsec;
+}
+
+/** Update poll cycle statistics
+ *
+ * For use from the sensor worker thread.
+ *
+ * @param cnt number of events returned by dev_poll->poll()
+ */
+static void mce_hybris_sensor_stats_poll(int cnt)
+{
+  mce_hybris_sensor_stats_t *data = mce_hybris_sensor_stats_self();
+
+  int slot = clamp_to_range(0, MCE_HYBRIS_STATS_BATCH_SLOTS - 1, cnt);
+
+  sensor_stats_inc(&data->polls, 1);
+  sensor_stats_inc(&data->batch[slot], 1);
+}
+
+/** Update event delivery statistics
+ *
+ * @param eve array of sensor events about to be delivered
+ * @param cnt number of sensor events
+ */
+static void mce_hybris_sensor_stats_deliver(const mce_hybris_sensor_event_t *eve,
+                                            int cnt)
+{
+  mce_hybris_sensor_stats_t *data = mce_hybris_sensor_stats_self();
+
+  int64_t now = mce_hybris_sensor_stats_now();
+
+  for( int i = 0; i < cnt; ++i ) {
+    mce_hybris_sensor_type_stats_t *type = &data->type[eve[i].type];
+
+    int64_t  t = (now - eve[i].timestamp) / 1000;
+    uint64_t us = (t > 0) ? (uint64_t)t : 0;
+
+    int slot = 0;
+    while( slot < MCE_HYBRIS_STATS_LATENCY_SLOTS - 1 && (us >> (slot + 1)) ) {
+      ++slot;
+    }
+
+    sensor_stats_inc(&type->events, 1);
+    sensor_stats_inc(&type->latency_sum, us);
+    sensor_stats_inc(&type->latency[slot], 1);
+    if( type->latency_max < us ) {
+      __atomic_store_n(&type->latency_max, us, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/** Get sensor event statistics
+ *
+ * Counters are cumulative since the plugin was loaded. Reading them
+ * does not stop or block the threads updating them, so the snapshot
+ * is not necessarily fully consistent.
+ *
+ * @param stats where to store the statistics
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_get_sensor_stats(mce_hybris_sensor_stats_t *stats)
+{
+  if( !stats ) {
+    return false;
+  }
+
+  memset(stats, 0, sizeof *stats);
+
+  const mce_hybris_sensor_stats_t *blocks[] = {
+    &sensor_stats_worker,
+    &sensor_stats_fast,
+    &sensor_stats_replay,
+    &sensor_stats_other,
+  };
+
+  for( size_t b = 0; b < numof(blocks); ++b ) {
+    const mce_hybris_sensor_stats_t *data = blocks[b];
+
+    stats->polls += sensor_stats_get(&data->polls);
+    for( int i = 0; i < MCE_HYBRIS_STATS_BATCH_SLOTS; ++i ) {
+      stats->batch[i] += sensor_stats_get(&data->batch[i]);
+    }
+
+    for( int t = 0; t < MCE_HYBRIS_SENSOR_TYPE_COUNT; ++t ) {
+      const mce_hybris_sensor_type_stats_t *src = &data->type[t];
+      mce_hybris_sensor_type_stats_t       *dst = &stats->type[t];
+
+      dst->events      += sensor_stats_get(&src->events);
+      dst->latency_sum += sensor_stats_get(&src->latency_sum);
+
+      uint64_t max = sensor_stats_get(&src->latency_max);
+      if( dst->latency_max < max ) {
+        dst->latency_max = max;
+      }
+
+      for( int i = 0; i < MCE_HYBRIS_STATS_LATENCY_SLOTS; ++i ) {
+        dst->latency[i] += sensor_stats_get(&src->latency[i]);
+      }
+    }
+  }
+
+  return true;
+}
+
+/* ------------------------------------------------------------------------- *
+ * sensor event forwarding
+ * ------------------------------------------------------------------------- */
+
+/** Maximum number of events to read / forward in one go */
+#define MCE_HYBRIS_SENSORS_BATCH_MAX 32
+
+/** Forward individual events via per sensor callbacks
+ *
+ * Also acts as a compatibility shim for the legacy ALS and PS callbacks.
+ *
+ * @param eve array of sensor events
+ * @param cnt number of sensor events
+ */
+static void mce_hybris_sensors_forward_each(const mce_hybris_sensor_event_t *eve,
+                                            int cnt)
+{
+  for( int i = 0; i < cnt; ++i ) {
+    const mce_hybris_sensor_event_t *e = &eve[i];
+
+    switch( e->type ) {
+    case MCE_HYBRIS_SENSOR_TYPE_LIGHT:
+      if( als_hook ) {
+        als_hook(e->timestamp, e->value[0]);
+      }
+      break;
+    case MCE_HYBRIS_SENSOR_TYPE_PROXIMITY:
+      if( ps_hook ) {
+        ps_hook(e->timestamp, e->value[0]);
+      }
+      break;
+    default:
+      break;
+    }
+
+    /* Events are validated before they are forwarded, the type
+     * is known to be within the dispatch table range */
+    mce_hybris_sensor_fn hook = sensor_slots[e->type].hook;
+    if( hook ) {
+      hook(e);
+    }
+  }
+}
+
+/** Forward a batch of sensor events to mce
+ *
+ * The batch callback gets the whole array with one call, the generic
+ * and legacy per sensor callbacks are invoked once per event.
+ *
+ * @param eve array of sensor events
+ * @param cnt number of sensor events
+ */
+static void mce_hybris_sensors_forward(const mce_hybris_sensor_event_t *eve,
+                                       int cnt)
+{
+  if( cnt <= 0 ) {
+    goto cleanup;
+  }
+
+  mce_hybris_sensor_stats_deliver(eve, cnt);
+
+  if( batch_hook ) {
+    batch_hook(eve, cnt);
+  }
+
+  mce_hybris_sensors_forward_each(eve, cnt);
+
+cleanup:
+  return;
+}
+
+/** Forward a batch of sensor events, leaving some for the fast lane
+ *
+ * The batch callback gets the whole array, but per sensor callbacks
+ * are skipped for the leading events handed over to the fast lane.
+ *
+ * @param eve  array of sensor events
+ * @param cnt  number of sensor events
+ * @param fast number of leading events delivered via fast lane
+ */
+static void mce_hybris_sensors_forward_rest(const mce_hybris_sensor_event_t *eve,
+                                            int cnt, int fast)
+{
+  if( cnt <= 0 ) {
+    goto cleanup;
+  }
+
+  mce_hybris_sensor_stats_deliver(eve + fast, cnt - fast);
+
+  if( batch_hook ) {
+    batch_hook(eve, cnt);
+  }
+
+  mce_hybris_sensors_forward_each(eve + fast, cnt - fast);
+
+cleanup:
+  return;
+}
+
+/** Forward proximity events from the fast lane
+ *
+ * Only per sensor callbacks are called; the batch callback gets the
+ * events from the thread that read them, see
+ * mce_hybris_sensors_forward_rest().
+ *
+ * @param eve array of sensor events
+ * @param cnt number of sensor events
+ */
+static void mce_hybris_sensors_forward_fast(const mce_hybris_sensor_event_t *eve,
+                                            int cnt)
+{
+  if( cnt <= 0 ) {
+    goto cleanup;
+  }
+
+  mce_hybris_sensor_stats_deliver(eve, cnt);
+  mce_hybris_sensors_forward_each(eve, cnt);
+
+cleanup:
+  return;
+}
+
+/* ------------------------------------------------------------------------- *
+ * sensor event ring
+ * ------------------------------------------------------------------------- */
+
+/** Number of events the ring can hold; must be a power of two */
+#define MCE_HYBRIS_SENSORS_RING_SIZE 256
+
+/** Single producer / single consumer ring for passing sensor events
+ *
+ * Writers of head are serialized via sensors_feed_mutex - normally
+ * the worker thread is the only one. The consumer is the glib main
+ * loop in main loop delivery mode, and after switching back to thread
+ * mode the worker thread, which delivers whatever was left over
+ * before forwarding newer events. Both indices run freely and are
+ * masked when the event array is accessed.
+ */
+static struct
+{
+  mce_hybris_sensor_event_t eve[MCE_HYBRIS_SENSORS_RING_SIZE];
+  unsigned                  head;    // next slot to write
+  unsigned                  tail;    // next slot to read
+  unsigned                  dropped; // events lost due to full ring
+} sensors_ring;
+
+/** Currently used sensor event delivery mode */
+static mce_hybris_delivery_t sensors_delivery = MCE_HYBRIS_DELIVERY_THREAD;
+
+/** Mutex serializing event delivery from the worker and replay threads
+ *
+ * Also held while switching to main loop delivery mode, so that the
+ * main loop does not start consuming events while the worker thread
+ * is still delivering ones left over from the previous main loop
+ * delivery period.
+ */
+static pthread_mutex_t sensors_feed_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Eventfd for waking up the main loop, or -1 if not created */
+static int      sensors_ring_fd  = -1;
+
+/** Glib source for draining the event ring, or NULL if not attached */
+static GSource *sensors_ring_src = 0;
+
+/** Poll record for sensors_ring_fd */
+static GPollFD  sensors_ring_pfd;
+
+/** Get currently used sensor event delivery mode
+ *
+ * Can be called from any thread.
+ */
+static mce_hybris_delivery_t mce_hybris_sensors_get_delivery(void)
+{
+  return __atomic_load_n(&sensors_delivery, __ATOMIC_ACQUIRE);
+}
+
+/** Check if there are undelivered events in the ring
+ *
+ * For use from the current consumer only, see sensors_ring.
+ */
+static bool mce_hybris_sensors_ring_pending(void)
+{
+  unsigned head = __atomic_load_n(&sensors_ring.head, __ATOMIC_ACQUIRE);
+  return head != sensors_ring.tail;
+}
+
+/** Push events to the ring and wake up the main loop
+ *
+ * For use from the sensor worker thread only. Never blocks; if the
+ * ring is full, the events that do not fit are dropped.
+ *
+ * @param eve array of sensor events
+ * @param cnt number of sensor events
+ */
+static void mce_hybris_sensors_ring_push(const mce_hybris_sensor_event_t *eve,
+                                         int cnt)
+{
+  unsigned head = sensors_ring.head;
+  unsigned tail = __atomic_load_n(&sensors_ring.tail, __ATOMIC_ACQUIRE);
+
+  if( cnt <= 0 ) {
+    goto cleanup;
+  }
+
+  for( int i = 0; i < cnt; ++i ) {
+    if( head - tail >= MCE_HYBRIS_SENSORS_RING_SIZE ) {
+      __atomic_add_fetch(&sensors_ring.dropped, cnt - i, __ATOMIC_RELAXED);
+      break;
+    }
+    sensors_ring.eve[head & (MCE_HYBRIS_SENSORS_RING_SIZE - 1)] = eve[i];
+    ++head;
+  }
+
+  __atomic_store_n(&sensors_ring.head, head, __ATOMIC_RELEASE);
+
+  /* One wakeup per poll cycle is enough */
+  uint64_t one = 1;
+  if( write(sensors_ring_fd, &one, sizeof one) == -1 ) {
+    /* EAGAIN = counter saturated, main loop is going to wake up anyway */
+  }
+
+cleanup:
+  return;
+}
+
+/** Forward all events currently in the ring
+ *
+ * For use from the current consumer only, see sensors_ring. Stops
+ * as soon as the delivery mode changes from the given one - e.g.
+ * when a callback switches main loop delivery off - so that the
+ * consumer role is never shared.
+ *
+ * @param mode delivery mode the caller is consuming for
+ */
+static void mce_hybris_sensors_ring_drain(mce_hybris_delivery_t mode)
+{
+  mce_hybris_sensor_event_t out[MCE_HYBRIS_SENSORS_BATCH_MAX];
+
+  while( mce_hybris_sensors_get_delivery() == mode ) {
+    unsigned head = __atomic_load_n(&sensors_ring.head, __ATOMIC_ACQUIRE);
+    unsigned tail = sensors_ring.tail;
+    int      cnt  = 0;
+
+    while( tail != head && cnt < MCE_HYBRIS_SENSORS_BATCH_MAX ) {
+      out[cnt++] = sensors_ring.eve[tail & (MCE_HYBRIS_SENSORS_RING_SIZE - 1)];
+      ++tail;
+    }
+
+    if( cnt == 0 ) {
+      break;
+    }
+
+    /* Release the slots before calling out, so that the producer
+     * can refill them while mce is processing the events */
+    __atomic_store_n(&sensors_ring.tail, tail, __ATOMIC_RELEASE);
+
+    mce_hybris_sensors_forward(out, cnt);
+  }
+
+  unsigned dropped = __atomic_exchange_n(&sensors_ring.dropped, 0,
+                                         __ATOMIC_RELAXED);
+  if( dropped ) {
+    mce_log(LOG_WARNING, "sensor event ring overflow; %u events lost",
+            dropped);
+  }
+}
+
+/** Glib source prepare callback for the sensor event ring
+ */
+static gboolean mce_hybris_sensors_ring_prepare_cb(GSource *src, gint *timeout)
+{
+  (void)src;
+
+  *timeout = -1;
+  return mce_hybris_sensors_ring_pending();
+}
+
+/** Glib source check callback for the sensor event ring
+ */
+static gboolean mce_hybris_sensors_ring_check_cb(GSource *src)
+{
+  (void)src;
+
+  return ((sensors_ring_pfd.revents & G_IO_IN) ||
+          mce_hybris_sensors_ring_pending());
+}
+
+/** Glib source dispatch callback for the sensor event ring
+ */
+static gboolean mce_hybris_sensors_ring_dispatch_cb(GSource *src,
+                                                    GSourceFunc cb,
+                                                    gpointer aptr)
+{
+  (void)src; (void)cb; (void)aptr;
+
+  /* Clear the eventfd counter before draining the ring; events
+   * pushed after this will cause a new wakeup */
+  uint64_t cnt = 0;
+  if( read(sensors_ring_fd, &cnt, sizeof cnt) == -1 ) {
+    /* EAGAIN = nothing to clear */
+  }
+
+  mce_hybris_sensors_ring_drain(MCE_HYBRIS_DELIVERY_MAINLOOP);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/** Glib source callbacks for the sensor event ring */
+static GSourceFuncs mce_hybris_sensors_ring_funcs =
+{
+  .prepare  = mce_hybris_sensors_ring_prepare_cb,
+  .check    = mce_hybris_sensors_ring_check_cb,
+  .dispatch = mce_hybris_sensors_ring_dispatch_cb,
+};
+
+/** Attach sensor event ring to the default glib main context
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_sensors_ring_attach(void)
+{
+  if( sensors_ring_src ) {
+    goto cleanup;
+  }
+
+  if( sensors_ring_fd == -1 ) {
+    sensors_ring_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if( sensors_ring_fd == -1 ) {
+      mce_log(LOG_ERR, "failed to create eventfd: %m");
+      goto cleanup;
+    }
+  }
+
+  sensors_ring_src = g_source_new(&mce_hybris_sensors_ring_funcs,
+                                  sizeof(GSource));
+  sensors_ring_pfd.fd      = sensors_ring_fd;
+  sensors_ring_pfd.events  = G_IO_IN | G_IO_ERR;
+  sensors_ring_pfd.revents = 0;
+  g_source_add_poll(sensors_ring_src, &sensors_ring_pfd);
+  g_source_attach(sensors_ring_src, 0);
+
+cleanup:
+  return sensors_ring_src != 0;
+}
+
+/** Detach sensor event ring from glib main loop
+ *
+ * Note: The eventfd is left open, the worker thread might still be
+ *       using it. It is closed from mce_hybris_sensors_ring_quit().
+ */
+static void mce_hybris_sensors_ring_detach(void)
+{
+  if( sensors_ring_src ) {
+    g_source_destroy(sensors_ring_src);
+    g_source_unref(sensors_ring_src), sensors_ring_src = 0;
+  }
+}
+
+/** Release all sensor event ring resources
+ *
+ * Must be called only after the sensor worker thread has been stopped.
+ */
+static void mce_hybris_sensors_ring_quit(void)
+{
+  __atomic_store_n(&sensors_delivery, MCE_HYBRIS_DELIVERY_THREAD,
+                   __ATOMIC_RELEASE);
+
+  mce_hybris_sensors_ring_detach();
+
+  if( sensors_ring_fd != -1 ) {
+    close(sensors_ring_fd), sensors_ring_fd = -1;
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * ambient light sensor filter
+ * ------------------------------------------------------------------------- */
+
+/** State data for in-plugin ALS event decimation
+ *
+ * Accessed from both the sensor worker thread and the glib main
+ * loop, so all members must be accessed while holding
+ * als_filter_mutex.
+ */
+static struct
+{
+  /* Configuration, zero values = feature disabled */
+  float    delta_abs;     // minimum change [lux]
+  float    delta_rel;     // minimum change relative to last value
+  int      interval;      // minimum delay between deliveries [ms]
+  int      quiet;         // deliver held value after quiet period [ms]
+
+  /* Last event that was delivered */
+  bool     have_last;
+  float    last_value;
+  int64_t  last_tick;
+
+  /* Latest event that was held back */
+  bool     have_pend;
+  mce_hybris_sensor_event_t pend;
+  int64_t  pend_tick;
+
+  /* Held back event that is due, waiting for the worker thread */
+  bool     have_due;
+  mce_hybris_sensor_event_t due;
+
+  /* Timer for delivering held back event */
+  guint    timer_id;
+} als_filter;
+
+/** Mutex protecting als_filter */
+static pthread_mutex_t als_filter_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Check if ALS filtering is enabled
+ *
+ * Note: caller must hold als_filter_mutex.
+ */
+static bool mce_hybris_als_filter_is_enabled(void)
+{
+  return (als_filter.delta_abs > 0 ||
+          als_filter.delta_rel > 0 ||
+          als_filter.interval  > 0);
+}
+
+/** Check if ALS value differs enough from the last delivered one
+ *
+ * The required change is the larger of the absolute and relative limits.
+ *
+ * Note: caller must hold als_filter_mutex.
+ */
+static bool mce_hybris_als_filter_is_significant(float value)
+{
+  if( !als_filter.have_last ) {
+    return true;
+  }
+
+  float limit = fabsf(als_filter.last_value) * als_filter.delta_rel;
+  if( limit < als_filter.delta_abs ) {
+    limit = als_filter.delta_abs;
+  }
+
+  float delta = fabsf(value - als_filter.last_value);
+
+  return limit > 0 ? delta >= limit : delta > 0;
+}
+
+/** Mark ALS value as delivered
+ *
+ * Note: caller must hold als_filter_mutex.
+ */
+static void mce_hybris_als_filter_delivered(float value, int64_t now)
+{
+  als_filter.have_last  = true;
+  als_filter.last_value = value;
+  als_filter.last_tick  = now;
+  als_filter.have_pend  = false;
+}
+
+/** Evaluate when the held back ALS event should be delivered
+ *
+ * Note: caller must hold als_filter_mutex.
+ *
+ * @return tick at which to deliver, or -1 if the event should be dropped
+ */
+static int64_t mce_hybris_als_filter_due(void)
+{
+  if( !als_filter.have_pend ) {
+    return -1;
+  }
+
+  if( mce_hybris_als_filter_is_significant(als_filter.pend.value[0]) ) {
+    /* Significant change, delivery is delayed only by rate limit */
+    return als_filter.last_tick + als_filter.interval;
+  }
+
+  if( als_filter.quiet > 0 &&
+      als_filter.pend.value[0] != als_filter.last_value ) {
+    /* Small change, deliver once the sensor has stayed quiet */
+    int64_t due = als_filter.pend_tick + als_filter.quiet;
+    int64_t min = als_filter.last_tick + als_filter.interval;
+    return due > min ? due : min;
+  }
+
+  return -1;
+}
+
+static gboolean mce_hybris_als_filter_timer_cb(gpointer aptr);
+
+/** Make sure held back ALS event gets delivered on time
+ *
+ * Note: caller must hold als_filter_mutex.
+ */
+static void mce_hybris_als_filter_schedule(int64_t now)
+{
+  int64_t due = mce_hybris_als_filter_due();
+
+  if( due < 0 ) {
+    als_filter.have_pend = false;
+  }
+  else if( !als_filter.timer_id ) {
+    /* If due time gets pushed further while the timer is active,
+     * the timer callback will reschedule itself */
+    int64_t delay = due - now;
+    if( delay < 0 ) delay = 0;
+    als_filter.timer_id = g_timeout_add((guint)delay,
+                                        mce_hybris_als_filter_timer_cb, 0);
+  }
+}
+
+static void mce_hybris_sensors_wakeup_worker(void);
+
+/** Timer callback for delivering held back ALS events
+ *
+ * In main loop delivery mode the event is queued to the event ring.
+ * Otherwise it is handed over to the worker thread, so that mce
+ * callbacks are not invoked from the main thread.
+ */
+static gboolean mce_hybris_als_filter_timer_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  bool deliver = false;
+  bool mainloop = false;
+
+  mce_hybris_sensor_event_t eve;
+
+  /* Serialize with event delivery from the worker thread, so that
+   * newer data can't be queued before the held back event */
+  pthread_mutex_lock(&sensors_feed_mutex);
+  pthread_mutex_lock(&als_filter_mutex);
+
+  if( !als_filter.timer_id ) {
+    goto cleanup;
+  }
+
+  als_filter.timer_id = 0;
+
+  int64_t now = mce_hybris_get_tick();
+  int64_t due = mce_hybris_als_filter_due();
+
+  if( due < 0 ) {
+    als_filter.have_pend = false;
+  }
+  else if( due > now ) {
+    mce_hybris_als_filter_schedule(now);
+  }
+  else {
+    eve = als_filter.pend;
+    mce_hybris_als_filter_delivered(eve.value[0], now);
+    deliver = true;
+
+    mainloop = (mce_hybris_sensors_get_delivery() ==
+                MCE_HYBRIS_DELIVERY_MAINLOOP);
+    if( !mainloop ) {
+      /* Worker delivers this before the next hal poll */
+      als_filter.have_due = true;
+      als_filter.due      = eve;
+    }
+  }
+
+cleanup:
+  pthread_mutex_unlock(&als_filter_mutex);
+
+  if( deliver && mainloop ) {
+    /* Queue behind older events, so that the worker is not blocked
+     * while mce is processing them */
+    mce_hybris_sensors_ring_push(&eve, 1);
+  }
+
+  pthread_mutex_unlock(&sensors_feed_mutex);
+
+  if( deliver && !mainloop ) {
+    /* Make the worker leave dev_poll->poll() */
+    mce_hybris_sensors_wakeup_worker();
+  }
+
+  return FALSE;
+}
+
+/** Check if held back ALS event is waiting for the worker thread
+ */
+static bool mce_hybris_als_filter_has_due(void)
+{
+  pthread_mutex_lock(&als_filter_mutex);
+  bool due = als_filter.have_due;
+  pthread_mutex_unlock(&als_filter_mutex);
+
+  return due;
+}
+
+/** Take held back ALS event that is waiting for the worker thread
+ *
+ * @param eve where to store the event
+ *
+ * @return true if an event was taken, false otherwise
+ */
+static bool mce_hybris_als_filter_take_due(mce_hybris_sensor_event_t *eve)
+{
+  pthread_mutex_lock(&als_filter_mutex);
+  bool due = als_filter.have_due;
+  if( due ) {
+    *eve = als_filter.due;
+    als_filter.have_due = false;
+  }
+  pthread_mutex_unlock(&als_filter_mutex);
+
+  return due;
+}
+
+/** Drop ALS events that do not carry meaningful changes
+ *
+ * For use from the sensor worker thread.
+ *
+ * @param eve array of sensor events, modified in place
+ * @param cnt number of sensor events
+ *
+ * @return number of events left in the array
+ */
+static int mce_hybris_als_filter_apply(mce_hybris_sensor_event_t *eve, int cnt)
+{
+  int  res    = 0;
+  bool locked = false;
+
+  for( int i = 0; i < cnt; ++i ) {
+    if( eve[i].type != MCE_HYBRIS_SENSOR_TYPE_LIGHT ) {
+      eve[res++] = eve[i];
+      continue;
+    }
+
+    if( !locked ) {
+      pthread_mutex_lock(&als_filter_mutex), locked = true;
+    }
+
+    if( !mce_hybris_als_filter_is_enabled() ) {
+      eve[res++] = eve[i];
+      continue;
+    }
+
+    int64_t now = mce_hybris_get_tick();
+
+    if( mce_hybris_als_filter_is_significant(eve[i].value[0]) &&
+        now >= als_filter.last_tick + als_filter.interval ) {
+      mce_hybris_als_filter_delivered(eve[i].value[0], now);
+      eve[res++] = eve[i];
+    }
+    else {
+      /* Hold back; newer events replace older ones */
+      als_filter.have_pend = true;
+      als_filter.pend      = eve[i];
+      als_filter.pend_tick = now;
+      mce_hybris_als_filter_schedule(now);
+    }
+  }
+
+  if( locked ) {
+    pthread_mutex_unlock(&als_filter_mutex);
+  }
+
+  return res;
+}
+
+/** Forget ALS filter history
+ *
+ * Used when sensor is enabled so that the first event always
+ * gets delivered.
+ */
+static void mce_hybris_als_filter_reset(void)
+{
+  pthread_mutex_lock(&als_filter_mutex);
+
+  als_filter.have_last = false;
+  als_filter.have_pend = false;
+  als_filter.have_due  = false;
+
+  if( als_filter.timer_id ) {
+    g_source_remove(als_filter.timer_id), als_filter.timer_id = 0;
+  }
+
+  pthread_mutex_unlock(&als_filter_mutex);
+}
+
+/* ------------------------------------------------------------------------- *
+ * ambient light sensor auto brightness
+ * ------------------------------------------------------------------------- */
+
+/** Maximum number of points in lux to backlight level mapping */
+#define ALS_AUTO_MAX_POINTS 32
+
+/** Default parameters for automatic brightness control */
+#define ALS_AUTO_DEFAULT_SMOOTHING  1000 // [ms]
+#define ALS_AUTO_DEFAULT_HYSTERESIS 0.1f
+#define ALS_AUTO_DEFAULT_FADE       500  // [ms]
+#define ALS_AUTO_DEFAULT_NOTIFY     2000 // [ms]
+
+/** Callback for reporting automatically chosen backlight levels */
+static mce_hybris_als_level_fn als_level_hook = 0;
+
+/** State data for in-plugin automatic brightness control
+ *
+ * The control loop is fed from the sensor worker thread and the
+ * backlight is driven from the glib main loop. Members marked as
+ * main loop only can be accessed without locking, the rest must be
+ * accessed while holding als_auto_mutex.
+ */
+static struct
+{
+  /* Configuration, cnt = 0 -> not configured */
+  mce_hybris_als_point_t lut[ALS_AUTO_MAX_POINTS];
+  int      cnt;
+  int      smoothing;     // smoothing time constant [ms]
+  float    hysteresis;    // relative lux change needed for new level
+  int      fade;          // brightness transition duration [ms]
+  int      notify;        // minimum delay between notifications [ms]
+  bool     active;        // control loop drives the backlight
+
+  /* Input filter state */
+  bool     have_lux;
+  float    lux;           // smoothed ambient light level [lux]
+  int64_t  lux_time;      // time stamp of the latest sample [ns]
+  float    eval_lux;      // smoothed level used for choosing level
+
+  /* Chosen level and handoff to main loop */
+  int      level;         // chosen backlight level, or -1
+  bool     apply;         // chosen level has not been applied yet
+  guint    apply_id;      // idle callback for applying the level
+
+  /* Notifications; main loop only */
+  guint    notify_id;     // timer for notifying mce
+  int64_t  notify_tick;   // time of the previous notification [ms]
+  int      notify_level;  // level last reported to mce, or -1
+} als_auto =
+{
+  .cnt          = 0,
+  .level        = -1,
+  .notify_level = -1,
+};
+
+/** Mutex protecting als_auto */
+static pthread_mutex_t als_auto_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Map ambient light level to backlight level
+ *
+ * Linear interpolation between the configured points, levels outside
+ * the configured range map to the first / last point.
+ *
+ * Note: caller must hold als_auto_mutex.
+ */
+static int als_auto_map(float lux)
+{
+  const mce_hybris_als_point_t *lut = als_auto.lut;
+  int                           cnt = als_auto.cnt;
+
+  if( lux <= lut[0].lux ) {
+    return lut[0].level;
+  }
+
+  for( int i = 1; i < cnt; ++i ) {
+    if( lux < lut[i].lux ) {
+      float t = (lux - lut[i-1].lux) / (lut[i].lux - lut[i-1].lux);
+      return (int)(lut[i-1].level + (lut[i].level - lut[i-1].level) * t +
+                   0.5f);
+    }
+  }
+
+  return lut[cnt-1].level;
+}
+
+static gboolean als_auto_apply_cb(gpointer aptr);
+
+/** Choose backlight level based on smoothed ambient light level
+ *
+ * A new level is chosen only if the light level has changed more
+ * than the hysteresis allows since the previous evaluation, or if
+ * forced. The level is applied from the glib main loop.
+ *
+ * Note: caller must hold als_auto_mutex.
+ *
+ * @param force true to evaluate regardless of the hysteresis
+ */
+static void als_auto_evaluate(bool force)
+{
+  if( !als_auto.active || !als_auto.have_lux ) {
+    goto cleanup;
+  }
+
+  if( !force && als_auto.level >= 0 ) {
+    float delta = fabsf(als_auto.lux - als_auto.eval_lux);
+    if( delta <= als_auto.eval_lux * als_auto.hysteresis ) {
+      goto cleanup;
+    }
+  }
+
+  als_auto.eval_lux = als_auto.lux;
+
+  int level = als_auto_map(als_auto.lux);
+  if( level == als_auto.level && !force ) {
+    goto cleanup;
+  }
+
+  als_auto.level = level;
+  als_auto.apply = true;
+
+  if( !als_auto.apply_id ) {
+    als_auto.apply_id = g_idle_add(als_auto_apply_cb, 0);
+  }
+
+cleanup:
+  return;
+}
+
+/** Feed ambient light events to automatic brightness control
+ *
+ * For use from the sensor worker thread, before ALS filtering.
+ *
+ * The samples are smoothed with exponential moving average using
+ * the configured time constant and event time stamps.
+ *
+ * @param eve array of sensor events
+ * @param cnt number of sensor events
+ */
+static void als_auto_feed(const mce_hybris_sensor_event_t *eve, int cnt)
+{
+  bool locked = false;
+
+  for( int i = 0; i < cnt; ++i ) {
+    if( eve[i].type != MCE_HYBRIS_SENSOR_TYPE_LIGHT ) {
+      continue;
+    }
+
+    if( !locked ) {
+      pthread_mutex_lock(&als_auto_mutex), locked = true;
+    }
+
+    if( !als_auto.active ) {
+      break;
+    }
+
+    float   lux = eve[i].value[0];
+    int64_t ts  = eve[i].timestamp;
+
+    if( !als_auto.have_lux ) {
+      als_auto.have_lux = true;
+      als_auto.lux      = lux;
+    }
+    else if( als_auto.smoothing > 0 && ts > als_auto.lux_time ) {
+      float dt = (ts - als_auto.lux_time) / 1e6f;
+      als_auto.lux += (lux - als_auto.lux) *
+        (1.0f - expf(-dt / als_auto.smoothing));
+    }
+    else if( als_auto.smoothing <= 0 ) {
+      als_auto.lux = lux;
+    }
+    als_auto.lux_time = ts;
+
+    als_auto_evaluate(false);
+  }
+
+  if( locked ) {
+    pthread_mutex_unlock(&als_auto_mutex);
+  }
+}
+
+/** Timer callback for notifying mce about chosen backlight level
+ */
+static gboolean als_auto_notify_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  if( !als_auto.notify_id ) {
+    goto cleanup;
+  }
+
+  als_auto.notify_id = 0;
+
+  pthread_mutex_lock(&als_auto_mutex);
+  int   level = als_auto.level;
+  float lux   = als_auto.eval_lux;
+  pthread_mutex_unlock(&als_auto_mutex);
+
+  if( level < 0 || level == als_auto.notify_level ) {
+    goto cleanup;
+  }
+
+  als_auto.notify_level = level;
+  als_auto.notify_tick  = mce_hybris_get_tick();
+
+  if( als_level_hook ) {
+    als_level_hook(lux, level);
+  }
+
+cleanup:
+  return FALSE;
+}
+
+/** Schedule rate limited notification about chosen backlight level
+ *
+ * Note: for use from the glib main loop only.
+ */
+static void als_auto_notify_schedule(void)
+{
+  if( als_auto.notify_id || !als_level_hook ) {
+    goto cleanup;
+  }
+
+  int64_t delay = als_auto.notify_tick + als_auto.notify -
+    mce_hybris_get_tick();
+  if( delay < 0 ) delay = 0;
+
+  als_auto.notify_id = g_timeout_add((guint)delay, als_auto_notify_cb, 0);
+
+cleanup:
+  return;
+}
+
+/** Idle callback for applying chosen backlight level
+ */
+static gboolean als_auto_apply_cb(gpointer aptr)
+{
+  (void)aptr;
+
+  pthread_mutex_lock(&als_auto_mutex);
+
+  bool apply = als_auto.apply && als_auto.active && als_auto.apply_id;
+  int  level = als_auto.level;
+  int  fade  = als_auto.fade;
+
+  als_auto.apply_id = 0;
+  als_auto.apply    = false;
+
+  pthread_mutex_unlock(&als_auto_mutex);
+
+  if( apply ) {
+    bl_fade_start(level, fade, MCE_HYBRIS_CURVE_SMOOTH);
+    als_auto_notify_schedule();
+  }
+
+  return FALSE;
+}
+
+/** Stop automatic brightness control due to explicit brightness change
+ *
+ * Note: for use from the glib main loop only.
+ */
+static void als_auto_override(void)
+{
+  pthread_mutex_lock(&als_auto_mutex);
+
+  if( als_auto.active ) {
+    mce_log(LOG_DEBUG, "explicit brightness change; auto brightness off");
+    als_auto.active = false;
+    als_auto.apply  = false;
+  }
+
+  if( als_auto.apply_id ) {
+    g_source_remove(als_auto.apply_id), als_auto.apply_id = 0;
+  }
+
+  pthread_mutex_unlock(&als_auto_mutex);
+}
+
+/** Forget automatic brightness filter history
+ *
+ * Used when sensor is enabled so that the first event gets
+ * evaluated without smoothing.
+ */
+static void als_auto_reset(void)
+{
+  pthread_mutex_lock(&als_auto_mutex);
+
+  als_auto.have_lux = false;
+  als_auto.level    = -1;
+
+  pthread_mutex_unlock(&als_auto_mutex);
+}
+
+/** Release timers used by automatic brightness control
+ */
+static void als_auto_quit(void)
+{
+  pthread_mutex_lock(&als_auto_mutex);
+
+  als_auto.active = false;
+
+  if( als_auto.apply_id ) {
+    g_source_remove(als_auto.apply_id), als_auto.apply_id = 0;
+  }
+
+  pthread_mutex_unlock(&als_auto_mutex);
+
+  if( als_auto.notify_id ) {
+    g_source_remove(als_auto.notify_id), als_auto.notify_id = 0;
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * proximity fast lane
+ * ------------------------------------------------------------------------- */
+
+/** Number of proximity events the fast lane queue can hold */
+#define PS_FAST_QUEUE_SIZE 16
+
+/** Niceness used when real time scheduling is not requested / allowed */
+#define PS_FAST_NICE (-10)
+
+/** Mutex for protecting fast lane queue and thread state */
+static pthread_mutex_t ps_fast_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Condition for waking up the fast lane thread */
+static pthread_cond_t  ps_fast_cond  = PTHREAD_COND_INITIALIZER;
+
+/** Fast lane state; protected by ps_fast_mutex */
+static struct
+{
+  pthread_t                 tid;      // dispatch thread, or 0
+  bool                      quit;     // thread should exit
+  int                       priority; // >0: SCHED_FIFO, else niceness
+  mce_hybris_sensor_event_t eve[PS_FAST_QUEUE_SIZE];
+  int                       cnt;      // number of queued events
+  unsigned                  dropped;  // events lost due to full queue
+} ps_fast;
+
+/** Move proximity events to the front of a batch
+ *
+ * Relative order of events within both partitions is retained.
+ *
+ * @param eve array of sensor events
+ * @param cnt number of sensor events
+ *
+ * @return number of proximity events at the start of the array
+ */
+static int ps_fast_partition(mce_hybris_sensor_event_t *eve, int cnt)
+{
+  mce_hybris_sensor_event_t tmp[MCE_HYBRIS_SENSORS_BATCH_MAX];
+  int ps = 0, other = 0;
+
+  for( int i = 0; i < cnt; ++i ) {
+    if( eve[i].type == MCE_HYBRIS_SENSOR_TYPE_PROXIMITY ) {
+      if( ps != i ) {
+        eve[ps] = eve[i];
+      }
+      ++ps;
+    }
+    else {
+      tmp[other++] = eve[i];
+    }
+  }
+
+  if( ps && other ) {
+    memcpy(eve + ps, tmp, other * sizeof *tmp);
+  }
+
+  return ps;
+}
+
+/** Hand proximity events over to the fast lane thread
+ *
+ * If the queue is full, the oldest events are discarded; only the
+ * latest proximity state is relevant for mce.
+ *
+ * @param eve array of proximity events
+ * @param cnt number of proximity events
+ *
+ * @return true if events were queued, false if the fast lane is not
+ *         running and the caller should deliver the events itself
+ */
+static bool ps_fast_push(const mce_hybris_sensor_event_t *eve, int cnt)
 {
-  // transform and clamp from [0 ... 255] to [0 ... maxval]
-  val = val * self->maxval / 255;
-  if( val > self->maxval ) val = self->maxval;
-  if( val < 0 ) val = 0;
+  bool ack = false;
+
+  pthread_mutex_lock(&ps_fast_mutex);
 
-  dprintf(self->fd_val, "%d", val);
+  if( !ps_fast.tid || ps_fast.quit ) {
+    goto cleanup;
+  }
+
+  for( int i = 0; i < cnt; ++i ) {
+    if( ps_fast.cnt == PS_FAST_QUEUE_SIZE ) {
+      memmove(ps_fast.eve, ps_fast.eve + 1,
+              (PS_FAST_QUEUE_SIZE - 1) * sizeof *ps_fast.eve);
+      ps_fast.cnt -= 1;
+      ps_fast.dropped += 1;
+    }
+    ps_fast.eve[ps_fast.cnt++] = eve[i];
+  }
+
+  pthread_cond_signal(&ps_fast_cond);
+  ack = true;
+
+cleanup:
+  pthread_mutex_unlock(&ps_fast_mutex);
+
+  return ack;
 }
 
-/** Set LED blinking period
+/** Raise scheduling priority of the calling thread
  *
- * If both on and off are greater than zero, then the PWM generator
- * is used to full intensity blinking. Otherwise it is used for
- * adjusting the LED brightness.
+ * Real time scheduling needs privileges mce might not have; on failure
+ * the thread falls back to adjusted niceness.
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param priority SCHED_FIFO priority if positive, otherwise niceness
+ */
+static void ps_fast_set_priority(int priority)
+{
+  if( priority > 0 ) {
+    int lo = sched_get_priority_min(SCHED_FIFO);
+    int hi = sched_get_priority_max(SCHED_FIFO);
+    struct sched_param sp = {
+      .sched_priority = (priority < lo) ? lo : (priority > hi) ? hi : priority,
+    };
+
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if( err == 0 ) {
+      goto cleanup;
+    }
+
+    mce_log(LOG_WARNING, "SCHED_FIFO(%d) not allowed: %s; using nice %d",
+            sp.sched_priority, strerror(err), PS_FAST_NICE);
+    priority = PS_FAST_NICE;
+  }
+
+  /* On linux PRIO_PROCESS with a thread id affects just that thread */
+  if( setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), priority) == -1 ) {
+    mce_log(LOG_WARNING, "failed to set nice %d: %m", priority);
+  }
+
+cleanup:
+  return;
+}
+
+/** Fast lane thread for delivering proximity events
+ *
+ * Events queued before a stop request are delivered before exit.
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param aptr (thread parameter, not used)
+ */
+static void ps_fast_thread(void *aptr)
+{
+  (void)aptr;
+
+  mce_hybris_sensor_event_t eve[PS_FAST_QUEUE_SIZE];
+
+  /* Statistics from this thread go to a dedicated block */
+  sensor_stats_self = &sensor_stats_fast;
+
+  pthread_mutex_lock(&ps_fast_mutex);
+  int priority = ps_fast.priority;
+  pthread_mutex_unlock(&ps_fast_mutex);
+
+  ps_fast_set_priority(priority);
+
+  for( ;; ) {
+    pthread_mutex_lock(&ps_fast_mutex);
+
+    while( !ps_fast.quit && ps_fast.cnt == 0 ) {
+      pthread_cond_wait(&ps_fast_cond, &ps_fast_mutex);
+    }
+
+    int      cnt     = ps_fast.cnt;
+    unsigned dropped = ps_fast.dropped;
+    bool     quit    = ps_fast.quit;
+
+    memcpy(eve, ps_fast.eve, cnt * sizeof *eve);
+    ps_fast.cnt     = 0;
+    ps_fast.dropped = 0;
+
+    pthread_mutex_unlock(&ps_fast_mutex);
+
+    if( dropped ) {
+      mce_log(LOG_WARNING, "fast lane dropped %u proximity events", dropped);
+    }
+
+    mce_hybris_sensors_forward_fast(eve, cnt);
+
+    if( quit ) {
+      break;
+    }
+  }
+}
+
+/** Start proximity fast lane thread
+ *
+ * @param priority SCHED_FIFO priority if positive, otherwise niceness
+ *
+ * @return true if the thread is running, false otherwise
+ */
+static bool ps_fast_start(int priority)
+{
+  pthread_mutex_lock(&ps_fast_mutex);
+  bool running = ps_fast.tid != 0;
+  ps_fast.priority = priority;
+  ps_fast.quit     = false;
+  pthread_mutex_unlock(&ps_fast_mutex);
+
+  if( !running ) {
+    /* The thread takes the lock on startup; do not hold it here */
+    pthread_t tid = mce_hybris_start_thread(ps_fast_thread, 0);
+
+    pthread_mutex_lock(&ps_fast_mutex);
+    ps_fast.tid = tid;
+    running = tid != 0;
+    pthread_mutex_unlock(&ps_fast_mutex);
+  }
+
+  return running;
+}
+
+/** Stop proximity fast lane thread
+ *
+ * Already queued events are delivered before the thread exits, after
+ * that proximity events are delivered from the sensor worker thread.
+ */
+static void ps_fast_stop(void)
+{
+  pthread_mutex_lock(&ps_fast_mutex);
+  pthread_t tid = ps_fast.tid;
+  ps_fast.quit = true;
+  pthread_cond_broadcast(&ps_fast_cond);
+  pthread_mutex_unlock(&ps_fast_mutex);
+
+  if( tid ) {
+    pthread_join(tid, 0);
+
+    pthread_mutex_lock(&ps_fast_mutex);
+    ps_fast.tid = 0;
+    pthread_mutex_unlock(&ps_fast_mutex);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * sensor event pipeline
+ * ------------------------------------------------------------------------- */
+
+/** Pass a batch of sensor events through filters to mce
+ *
+ * Used both for live events from the sensor worker and for replayed
+ * recordings, so that both go through exactly the same path.
+ *
+ * @param out array of sensor events, modified in place
+ * @param k   number of sensor events
+ */
+static void mce_hybris_sensors_feed(mce_hybris_sensor_event_t *out, int k)
+{
+  mce_hybris_sensor_event_t due;
+
+  pthread_mutex_lock(&sensors_feed_mutex);
+
+  /* Events left over from main loop delivery go before anything newer */
+  if( mce_hybris_sensors_get_delivery() == MCE_HYBRIS_DELIVERY_THREAD &&
+      mce_hybris_sensors_ring_pending() ) {
+    mce_hybris_sensors_ring_drain(MCE_HYBRIS_DELIVERY_THREAD);
+  }
+
+  /* Held back ALS event goes before anything newer */
+  if( mce_hybris_als_filter_take_due(&due) ) {
+    if( mce_hybris_sensors_get_delivery() == MCE_HYBRIS_DELIVERY_MAINLOOP ) {
+      mce_hybris_sensors_ring_push(&due, 1);
+    }
+    else {
+      mce_hybris_sensors_forward(&due, 1);
+    }
+  }
+
+  /* Automatic brightness control sees unfiltered ALS data */
+  als_auto_feed(out, k);
+
+  /* Drop ALS events that carry no meaningful changes */
+  k = mce_hybris_als_filter_apply(out, k);
+
+  /* Proximity events are delivered before anything else */
+  int ps = ps_fast_partition(out, k);
+
+  if( mce_hybris_sensors_get_delivery() == MCE_HYBRIS_DELIVERY_MAINLOOP ) {
+    /* Pass data to the main loop without blocking */
+    mce_hybris_sensors_ring_push(out, k);
+  }
+  else {
+    /* Forward data via callback routines. The callbacks must handle
+     * the fact that they get called from the context of the worker
+     * thread - or, for the proximity callbacks only, the fast lane
+     * thread. */
+    if( ps > 0 && ps_fast_push(out, ps) ) {
+      mce_hybris_sensors_forward_rest(out, k, ps);
+    }
+    else {
+      mce_hybris_sensors_forward(out, k);
+    }
+  }
+
+  pthread_mutex_unlock(&sensors_feed_mutex);
+}
+
+/* ------------------------------------------------------------------------- *
+ * sensor recording
+ * ------------------------------------------------------------------------- */
+
+/* Recording file layout
+ *
+ * The file starts with srec_header_t, followed by srec_event_t records.
+ * Events are appended via shared memory mapping from the sensor worker
+ * thread, and the header count is updated after each poll batch, so a
+ * reader can follow the file while recording is in progress.
+ */
+
+/** Recording file magic: "MHSR" in little endian */
+#define SREC_FILE_MAGIC   0x5253484d
+
+/** Recording file format version */
+#define SREC_FILE_VERSION 1
+
+/** Default recording capacity */
+#define SREC_DEFAULT_EVENTS 65536
+
+/** Recording file header */
+typedef struct
+{
+  uint32_t magic;     // SREC_FILE_MAGIC
+  uint32_t version;   // SREC_FILE_VERSION
+  uint32_t size;      // size of srec_event_t
+  uint32_t reserved;
+  uint64_t count;     // number of complete records
+} srec_header_t;
+
+/** Recorded sensor event */
+typedef struct
+{
+  int64_t  timestamp; // hal time stamp [ns]
+  int32_t  type;      // SENSOR_TYPE_xxx
+  int32_t  handle;    // hal sensor handle
+  uint32_t batch;     // poll batch sequence number
+  float    value[3];  // sensor data
+} srec_event_t;
+
+/** Mutex protecting srec */
+static pthread_mutex_t srec_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Flag for: recording is active; for lockless check in worker thread */
+static bool srec_active = false;
+
+/** Recording state; protected by srec_mutex */
+static struct
+{
+  int            fd;     // recording file, or -1
+  void          *map;    // shared mapping of the whole file
+  size_t         size;   // size of the mapping
+  srec_header_t *hdr;    // header within the mapping
+  srec_event_t  *eve;    // records within the mapping
+  uint64_t       max;    // capacity of the file
+  uint32_t       batch;  // next batch sequence number
+  bool           full;   // capacity exceeded, events are dropped
+} srec =
+{
+  .fd = -1,
+};
+
+/** Append a batch of hal sensor events to the recording
+ *
+ * For use from the sensor worker thread.
+ *
+ * Meta data events and other types that can't be replayed are skipped.
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param eve array of hal sensor events
+ * @param cnt number of hal sensor events
+ */
+static void srec_append(const sensors_event_t *eve, int cnt)
+{
+  if( !__atomic_load_n(&srec_active, __ATOMIC_ACQUIRE) || cnt <= 0 ) {
+    goto cleanup;
+  }
+
+  pthread_mutex_lock(&srec_mutex);
+
+  if( !srec.hdr || srec.full ) {
+    goto unlock;
+  }
+
+  uint64_t n = srec.hdr->count;
+
+  for( int i = 0; i < cnt; ++i ) {
+    const sensors_event_t *e = &eve[i];
+
+    if( e->type <= 0 || e->type >= MCE_HYBRIS_SENSOR_TYPE_COUNT ) {
+      continue;
+    }
+
+    if( n >= srec.max ) {
+      mce_log(LOG_WARNING, "sensor recording full; %llu events",
+              (unsigned long long)n);
+      srec.full = true;
+      break;
+    }
+
+    srec_event_t *r = &srec.eve[n++];
+    r->timestamp = e->timestamp;
+    r->type      = e->type;
+    r->handle    = e->sensor;
+    r->batch     = srec.batch;
+    r->value[0]  = e->data[0];
+    r->value[1]  = e->data[1];
+    r->value[2]  = e->data[2];
+  }
+
+  __atomic_store_n(&srec.hdr->count, n, __ATOMIC_RELEASE);
+  srec.batch += 1;
+
+unlock:
+  pthread_mutex_unlock(&srec_mutex);
+
+cleanup:
+  return;
+}
+
+/** Stop sensor event recording
+ *
+ * The file is truncated to contain only the recorded events.
+ */
+void mce_hybris_sensors_record_stop(void)
+{
+  pthread_mutex_lock(&srec_mutex);
+
+  __atomic_store_n(&srec_active, false, __ATOMIC_RELEASE);
+
+  if( srec.fd == -1 ) {
+    goto cleanup;
+  }
+
+  uint64_t n = srec.hdr ? srec.hdr->count : 0;
+
+  if( srec.map ) {
+    munmap(srec.map, srec.size);
+  }
+
+  if( ftruncate(srec.fd, sizeof *srec.hdr + n * sizeof *srec.eve) == -1 ) {
+    mce_log(LOG_WARNING, "recording truncate failed: %m");
+  }
+
+  close(srec.fd);
+
+  mce_log(LOG_DEBUG, "recorded %llu sensor events", (unsigned long long)n);
+
+  srec.fd  = -1;
+  srec.map = 0;
+  srec.hdr = 0;
+  srec.eve = 0;
+
+cleanup:
+  pthread_mutex_unlock(&srec_mutex);
+}
+
+/** Start recording sensor events to a file
+ *
+ * All events from known sensors read by the worker thread are stored
+ * before any filtering, in a memory mapped file that is sized for the
+ * given number of events up front. Recording stops silently once the
+ * file is full. An ongoing recording is stopped first.
+ *
+ * @param path       file to write
+ * @param max_events capacity of the file, or 0 for default
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_sensors_record_start(const char *path, int max_events)
+{
+  bool ack = false;
+
+  mce_hybris_sensors_record_stop();
+
+  if( !path ) {
+    goto cleanup;
+  }
+
+  pthread_mutex_lock(&srec_mutex);
+
+  uint64_t max  = (max_events > 0) ? (uint64_t)max_events : SREC_DEFAULT_EVENTS;
+  size_t   size = sizeof *srec.hdr + max * sizeof *srec.eve;
+
+  if( (srec.fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) == -1 ) {
+    mce_log(LOG_WARNING, "%s: open failed: %m", path);
+    goto unlock;
+  }
+
+  if( ftruncate(srec.fd, size) == -1 ) {
+    mce_log(LOG_WARNING, "%s: truncate failed: %m", path);
+    goto unlock;
+  }
+
+  srec.map = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, srec.fd, 0);
+  if( srec.map == MAP_FAILED ) {
+    mce_log(LOG_WARNING, "%s: mmap failed: %m", path);
+    srec.map = 0;
+    goto unlock;
+  }
+
+  srec.size  = size;
+  srec.hdr   = srec.map;
+  srec.eve   = (srec_event_t *)(srec.hdr + 1);
+  srec.max   = max;
+  srec.batch = 0;
+  srec.full  = false;
+
+  srec.hdr->magic    = SREC_FILE_MAGIC;
+  srec.hdr->version  = SREC_FILE_VERSION;
+  srec.hdr->size     = sizeof *srec.eve;
+  srec.hdr->reserved = 0;
+  srec.hdr->count    = 0;
+
+  __atomic_store_n(&srec_active, true, __ATOMIC_RELEASE);
+  ack = true;
+
+unlock:
+  if( !ack && srec.fd != -1 ) {
+    close(srec.fd), srec.fd = -1;
+  }
+
+  pthread_mutex_unlock(&srec_mutex);
+
+cleanup:
+  mce_log(LOG_DEBUG, "%s(%s, %d) -> %s", __FUNCTION__, path ?: "(null)",
+          max_events, ack ? "success" : "failure");
+
+  return ack;
+}
+
+/* ------------------------------------------------------------------------- *
+ * sensor replay
+ * ------------------------------------------------------------------------- */
+
+/** Mutex protecting srpl */
+static pthread_mutex_t srpl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Condition for interrupting paced replay; uses CLOCK_MONOTONIC */
+static pthread_cond_t  srpl_cond;
+
+/** Replay state; protected by srpl_mutex */
+static struct
+{
+  pthread_t           tid;     // replay thread, or 0
+  bool                quit;    // thread should exit
+  bool                done;    // thread has finished replaying
+  bool                paced;   // follow original event timing
+  void               *map;     // read only mapping of the recording
+  size_t              size;    // size of the mapping
+  const srec_event_t *eve;     // recorded events
+  uint64_t            cnt;     // number of recorded events
+} srpl;
+
+/** Wait until given CLOCK_MONOTONIC time or replay stop request
+ *
+ * @param deadline wakeup time [ns]
+ *
+ * @return true if replay should continue, false if stopped
+ */
+static bool srpl_wait(int64_t deadline)
+{
+  struct timespec ts = {
+    .tv_sec  = deadline / 1000000000,
+    .tv_nsec = deadline % 1000000000,
+  };
+
+  pthread_mutex_lock(&srpl_mutex);
+  while( !srpl.quit ) {
+    if( pthread_cond_timedwait(&srpl_cond, &srpl_mutex, &ts) == ETIMEDOUT ) {
+      break;
+    }
+  }
+  bool cont = !srpl.quit;
+  pthread_mutex_unlock(&srpl_mutex);
+
+  return cont;
+}
+
+/** Replay thread for feeding recorded events to the sensor pipeline
+ *
+ * Events are grouped to batches as they were read from the hal, and
+ * time stamps are rebased to the time replay was started.
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param aptr (thread parameter, not used)
+ */
+static void srpl_thread(void *aptr)
+{
+  (void)aptr;
+
+  mce_hybris_sensor_event_t out[MCE_HYBRIS_SENSORS_BATCH_MAX];
+
+  /* Statistics from this thread go to a dedicated block */
+  sensor_stats_self = &sensor_stats_replay;
+
+  const srec_event_t *rec = srpl.eve;
+  uint64_t            cnt = srpl.cnt;
+  bool                paced = srpl.paced;
+
+  int64_t base = cnt ? rec[0].timestamp : 0;
+  int64_t boot = mce_hybris_sensor_stats_now();
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t mono = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+
+  uint64_t i = 0;
+  while( i < cnt ) {
+    uint32_t batch = rec[i].batch;
+    int64_t  delta = rec[i].timestamp - base;
+
+    if( paced && delta > 0 && !srpl_wait(mono + delta) ) {
+      break;
+    }
+    if( __atomic_load_n(&srpl.quit, __ATOMIC_ACQUIRE) ) {
+      break;
+    }
+
+    int k = 0;
+    for( ; i < cnt && rec[i].batch == batch; ++i ) {
+      const srec_event_t *r = &rec[i];
+
+      /* Recorded data is not trusted to be valid */
+      if( r->type <= 0 || r->type >= MCE_HYBRIS_SENSOR_TYPE_COUNT ) {
+        continue;
+      }
+      if( k == MCE_HYBRIS_SENSORS_BATCH_MAX ) {
+        break;
+      }
+
+      out[k].timestamp = boot + (r->timestamp - base);
+      out[k].type      = r->type;
+      out[k].value[0]  = r->value[0];
+      out[k].value[1]  = r->value[1];
+      out[k].value[2]  = r->value[2];
+      ++k;
+    }
+
+    mce_hybris_sensors_feed(out, k);
+  }
+
+  mce_log(LOG_DEBUG, "replayed %llu/%llu sensor events",
+          (unsigned long long)i, (unsigned long long)cnt);
+
+  __atomic_store_n(&srpl.done, true, __ATOMIC_RELEASE);
+}
+
+/** Stop sensor event replay
  *
- * @param self led state
- * @param on   milliseconds on
- * @param off  milliseconds off
+ * Waits for the replay thread to exit.
  */
-static void led_state_set_blink(const led_state_t *self, int on, int off)
+void mce_hybris_sensors_replay_stop(void)
 {
-  dprintf(self->fd_on,  "%d", on);
-  dprintf(self->fd_off, "%d", off);
+  pthread_mutex_lock(&srpl_mutex);
+  pthread_t tid = srpl.tid;
+  if( tid ) {
+    __atomic_store_n(&srpl.quit, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&srpl_cond);
+  }
+  pthread_mutex_unlock(&srpl_mutex);
+
+  if( !tid ) {
+    goto cleanup;
+  }
+
+  pthread_join(tid, 0);
+  pthread_cond_destroy(&srpl_cond);
+
+  munmap(srpl.map, srpl.size);
+  memset(&srpl, 0, sizeof srpl);
+
+cleanup:
+  return;
 }
 
-/** Clean up led state
+/** Check if sensor event replay is still in progress
  *
- * @param self led state
+ * @return true if events are being replayed, false otherwise
  */
-static void led_state_quit(led_state_t *self)
+bool mce_hybris_sensors_replay_is_active(void)
 {
-  if( self->fd_on  != -1 ) close(self->fd_on),  self->fd_on  = -1;
-  if( self->fd_off != -1 ) close(self->fd_off), self->fd_off = -1;
-  if( self->fd_val != -1 ) close(self->fd_val), self->fd_val = -1;
-  self->maxval = 255;
+  return srpl.tid && !__atomic_load_n(&srpl.done, __ATOMIC_ACQUIRE);
 }
 
-/** Initialize led state
+/** Start replaying recorded sensor events
  *
- * @param self led state
- * @param conf led config
+ * The events are fed from a separate thread through the same filters
+ * and callbacks as live events, so hal access is not needed. This
+ * makes it possible to reproduce load and latency off-device.
  *
- * @return true if required control files were available, false otherwise
+ * In as-fast-as-possible mode the recorded spacing of time stamps is
+ * retained, but delivery latencies in sensor statistics are meaningless.
+ *
+ * @param path  recording written via mce_hybris_sensors_record_start()
+ * @param paced true to follow original timing, false for full speed
+ *
+ * @return true on success, false on failure
  */
-static bool led_state_init(led_state_t *self, const led_paths_t *conf)
+bool mce_hybris_sensors_replay_start(const char *path, bool paced)
 {
-  bool success = false;
+  bool     ack  = false;
+  int      fd   = -1;
+  void    *map  = 0;
+  size_t   size = 0;
+  uint64_t cnt  = 0;
 
-  if( (self->maxval = read_number(conf->max)) <= 0 )
-  {
+  mce_hybris_sensors_replay_stop();
+
+  if( !path ) {
     goto cleanup;
   }
-  if( (self->fd_on = open(conf->on, O_WRONLY|O_APPEND)) == -1 )
-  {
+
+  if( (fd = open(path, O_RDONLY|O_CLOEXEC)) == -1 ) {
+    mce_log(LOG_WARNING, "%s: open failed: %m", path);
     goto cleanup;
   }
-  if( (self->fd_off = open(conf->off, O_WRONLY|O_APPEND)) == -1 )
-  {
+
+  struct stat st;
+  if( fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(srec_header_t) ) {
+    mce_log(LOG_WARNING, "%s: not a sensor recording", path);
     goto cleanup;
   }
-  if( (self->fd_val = open(conf->val, O_WRONLY|O_APPEND)) == -1 )
-  {
+
+  size = st.st_size;
+  map  = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if( map == MAP_FAILED ) {
+    mce_log(LOG_WARNING, "%s: mmap failed: %m", path);
+    map = 0;
     goto cleanup;
   }
 
-  success = true;
+  const srec_header_t *hdr = map;
+  if( hdr->magic != SREC_FILE_MAGIC || hdr->version != SREC_FILE_VERSION ||
+      hdr->size != sizeof(srec_event_t) ) {
+    mce_log(LOG_WARNING, "%s: unsupported recording format", path);
+    goto cleanup;
+  }
+
+  /* Trust only what fits in the file */
+  cnt = (size - sizeof *hdr) / sizeof(srec_event_t);
+  if( cnt > hdr->count ) {
+    cnt = hdr->count;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&srpl_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  srpl.quit  = false;
+  srpl.done  = false;
+  srpl.paced = paced;
+  srpl.map   = map;
+  srpl.size  = size;
+  srpl.eve   = (const srec_event_t *)(hdr + 1);
+  srpl.cnt   = cnt;
+
+  /* The replay thread reads the state set up above on startup */
+  pthread_t tid = mce_hybris_start_thread(srpl_thread, 0);
+
+  pthread_mutex_lock(&srpl_mutex);
+  srpl.tid = tid;
+  pthread_mutex_unlock(&srpl_mutex);
+
+  if( !tid ) {
+    pthread_cond_destroy(&srpl_cond);
+    memset(&srpl, 0, sizeof srpl);
+    goto cleanup;
+  }
+
+  /* The mapping stays valid after the file is closed */
+  map = 0;
+  ack = true;
 
 cleanup:
-  return success;
+  if( map ) munmap(map, size);
+  if( fd != -1 ) close(fd);
+
+  mce_log(LOG_DEBUG, "%s(%s, %s) -> %llu events, %s", __FUNCTION__,
+          path ?: "(null)", paced ? "paced" : "fast",
+          (unsigned long long)cnt, ack ? "success" : "failure");
+
+  return ack;
 }
 
-#define LED_PFIX "/sys/class/leds/led:rgb_"
+/* ------------------------------------------------------------------------- *
+ * poll device
+ * ------------------------------------------------------------------------- */
 
-/** Sysfs control paths for RGB leds */
-static const led_paths_t led_paths[3] =
-{
-  {
-    .on  = LED_PFIX"red/blink_delay_on",
-    .off = LED_PFIX"red/blink_delay_off",
-    .val = LED_PFIX"red/brightness",
-    .max = LED_PFIX"red/max_brightness",
-  },
-  {
-    .on  = LED_PFIX"green/blink_delay_on",
-    .off = LED_PFIX"green/blink_delay_off",
-    .val = LED_PFIX"green/brightness",
-    .max = LED_PFIX"green/max_brightness",
-  },
-  {
-    .on  = LED_PFIX"blue/blink_delay_on",
-    .off = LED_PFIX"blue/blink_delay_off",
-    .val = LED_PFIX"blue/brightness",
-    .max = LED_PFIX"blue/max_brightness",
-  }
-};
+/** Worker thread id */
+static pthread_t poll_tid = 0;
 
-/** Sysfs state data for RGB leds */
-static led_state_t led_states[3] =
-{
-  {
-    .fd_on  = -1,
-    .fd_off = -1,
-    .fd_val = -1,
-    .maxval = 255,
-  },
-  {
-    .fd_on  = -1,
-    .fd_off = -1,
-    .fd_val = -1,
-    .maxval = 255,
-  },
-  {
-    .fd_on  = -1,
-    .fd_off = -1,
-    .fd_val = -1,
-    .maxval = 255,
-  }
-};
+/** Flag for: worker thread should exit */
+static bool      poll_quit = false;
 
-/** Questimate of the duration of the kernel delayed work */
-#define LED_CTRL_KERNEL_DELAY 10 // [ms]
+/** Flag for: worker thread should wait instead of polling the hal */
+static bool      poll_parked = false;
 
-/** Minimum delay between breathing steps */
-#define LED_CTRL_BREATHING_DELAY 20 // [ms]
+/** Flag for: worker thread is about to call or is in dev_poll->poll() */
+static bool      poll_in_hal = false;
 
-/** Maximum number of breathing steps; rise and fall time combined */
-#define LED_CTRL_MAX_STEPS 256
+/** Mutex protecting poll_parked */
+static pthread_mutex_t poll_park_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/** Minimum number of breathing steps on rise/fall time */
-#define LED_CTRL_MIN_STEPS 7
+/** Condition for waking up parked worker thread */
+static pthread_cond_t  poll_park_cond  = PTHREAD_COND_INITIALIZER;
 
-/** Led request parameters */
-typedef struct
-{
-  int  r,g,b;    // color
-  int  on,off;   // blink timing
-  int  level;    // brightness [0 ... 255]
-  bool breathe;  // breathe instead of blinking
-} led_request_t;
+/** Signal used for interrupting blocking dev_poll->poll() calls */
+#define MCE_HYBRIS_WAKEUP_SIGNAL (SIGRTMIN + 5)
 
-/** Test for led request blink/breathing timing equality
- */
-static bool led_request_has_equal_timing(const led_request_t *self,
-                                         const led_request_t *that)
-{
-    return (self->on  == that->on &&
-            self->off == that->off);
-}
+/** Maximum time to wait for worker thread to exit */
+#define MCE_HYBRIS_WORKER_STOP_TIMEOUT 500 // [ms]
 
-/** Test for led request equality
- */
-static bool led_request_is_equal(const led_request_t *self,
-                                 const led_request_t *that)
-{
-    return (self->r       == that->r  &&
-            self->g       == that->g  &&
-            self->b       == that->b  &&
-            self->on      == that->on &&
-            self->off     == that->off &&
-            self->level   == that->level &&
-            self->breathe == that->breathe);
-}
+/** Interval for repeating worker thread wakeup attempts */
+#define MCE_HYBRIS_WORKER_WAKEUP_INTERVAL 20 // [ms]
 
-/** Test for active led request
+/** Dummy handler for the wakeup signal
+ *
+ * The signal is caught just to make blocking system calls made from
+ * within the sensor hal return with EINTR.
  */
-static bool led_request_has_color(const led_request_t *self)
+static void mce_hybris_sensors_wakeup_handler(int sig)
 {
-    return self->r > 0 || self->g > 0 || self->b > 0;
+  (void)sig;
 }
 
-/** Normalize/sanity check requested values
+/** Install handler for the worker thread wakeup signal
+ *
+ * @return true on success, false on failure
  */
-static void led_request_sanitize(led_request_t *self)
+static bool mce_hybris_sensors_wakeup_init(void)
 {
-  int min_period = LED_CTRL_BREATHING_DELAY * LED_CTRL_MIN_STEPS;
+  static bool done = false;
+  static bool ack  = false;
 
-  if( !led_request_has_color(self) ) {
-    /* blinking/breathing black and black makes no sense */
-    self->on  = 0;
-    self->off = 0;
-    self->breathe = false;
-  }
-  else if( self->on <= 0 || self->off <= 0) {
-    /* both on and off periods must be > 0 for blinking/breathing */
-    self->on  = 0;
-    self->off = 0;
-    self->breathe = false;
-  }
-  else if( self->on < min_period || self->off < min_period ) {
-    /* Whether a pattern should breathe or not is decided at mce side.
-     * But, since there are limitations on how often the led intensity
-     * can be changed, we must check that the rise/fall times are long
-     * enough to allow a reasonable amount of adjustments to be made. */
-    self->breathe = false;
+  if( !done ) {
+    done = true;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = mce_hybris_sensors_wakeup_handler;
+    /* No SA_RESTART: interrupted system calls must fail with EINTR */
+    sa.sa_flags   = 0;
+
+    if( sigaction(MCE_HYBRIS_WAKEUP_SIGNAL, &sa, 0) == -1 ) {
+      mce_log(LOG_ERR, "failed to install wakeup signal handler: %m");
+    }
+    else {
+      ack = true;
+    }
   }
-}
 
-/** Different styles of led patterns */
-typedef enum {
-  STYLE_OFF,     // led is off
-  STYLE_STATIC,  // led has constant color
-  STYLE_BLINK,   // led is blinking with on/off periods
-  STYLE_BREATH,  // led is breathing with rise/fall times
-} led_style_t;
+  return ack;
+}
 
-/** Evaluate request style
+/** Read events from the sensor hal
+ *
+ * The worker thread can be cancelled only while it is blocked in the
+ * hal. Elsewhere it might be holding locks - or running mce callbacks
+ * that do - and async cancel would leave them locked for good.
+ *
+ * @param eve array for events
+ * @param cnt size of the array
+ *
+ * @return dev_poll->poll() return value
  */
-static led_style_t led_request_get_style(const led_request_t *self)
+static int mce_hybris_sensors_poll(sensors_event_t *eve, int cnt)
 {
-  if( !led_request_has_color(self) ) {
-    return STYLE_OFF;
-  }
-
-  if( self->on <= 0 || self->off <= 0 ) {
-    return STYLE_STATIC;
-  }
+  __atomic_store_n(&poll_in_hal, true, __ATOMIC_RELEASE);
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+  int n = dev_poll->poll(dev_poll, eve, cnt);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+  __atomic_store_n(&poll_in_hal, false, __ATOMIC_RELEASE);
+  return n;
+}
 
-  if( self->breathe ) {
-    return STYLE_BREATH;
+/** Wait while the worker thread is parked
+ *
+ * @return true if the worker should poll the hal, false if it should exit
+ */
+static bool mce_hybris_sensors_wait_unparked(void)
+{
+  pthread_mutex_lock(&poll_park_mutex);
+  while( poll_parked && !__atomic_load_n(&poll_quit, __ATOMIC_ACQUIRE) ) {
+    pthread_cond_wait(&poll_park_cond, &poll_park_mutex);
   }
+  pthread_mutex_unlock(&poll_park_mutex);
 
-  return STYLE_BLINK;
+  return !__atomic_load_n(&poll_quit, __ATOMIC_ACQUIRE);
 }
 
-/** Intensity curve for sw breathing */
-static struct {
-  size_t  step;
-  size_t  steps;
-  int     delay;
-  uint8_t value[LED_CTRL_MAX_STEPS];
-} led_ctrl_breathe =
+/** Worker thread for reading sensor events via blocking libhybris interface
+ *
+ * Note: mce_log() calls from this function are deferred to the main loop
+ *
+ * @param aptr (thread parameter, not used)
+ */
+static void mce_hybris_sensors_thread(void *aptr)
 {
-  .step  = 0,
-  .steps = 0,
-  .delay = 0,
-};
-
-/** Flag for: controls for RGB leds exist in sysfs */
-static bool led_ctrl_uses_sysfs = false;
+  (void)aptr;
 
-/** Currently active RGB led state; initialize to invalid color */
-static led_request_t led_ctrl_curr =
-{
-  /* force 1st change to take effect by initializing to invalid color */
-  .r       = -1,
-  .g       = -1,
-  .b       = -1,
+  sensors_event_t           eve[MCE_HYBRIS_SENSORS_BATCH_MAX];
+  mce_hybris_sensor_event_t out[MCE_HYBRIS_SENSORS_BATCH_MAX];
 
-  /* not blinking or breathing */
-  .on      = 0,
-  .off     = 0,
-  .breathe = false,
+  /* The thread might have inherited blocked wakeup signal */
+  sigset_t ss;
+  sigemptyset(&ss);
+  sigaddset(&ss, MCE_HYBRIS_WAKEUP_SIGNAL);
+  pthread_sigmask(SIG_UNBLOCK, &ss, 0);
 
-  /* full brightness */
-  .level   = 255,
-};
+  /* Cancellation is allowed only from mce_hybris_sensors_poll() */
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
 
-/** Close all LED sysfs files */
-static void led_ctrl_close_sysfs_files(void)
-{
-  for( int i = 0; i < 3; ++i )
-  {
-    led_state_quit(led_states + i);
-  }
-}
+  /* Statistics from this thread go to a dedicated block */
+  sensor_stats_self = &sensor_stats_worker;
 
-/** Open sysfs control files for RGB leds
- *
- * @return true if required control files were available, false otherwise
- */
-static bool led_ctrl_probe_sysfs_files(void)
-{
-  bool res = false;
+  /* Last poll error, to avoid repeating the same message */
+  int poll_err = 0;
 
-  for( int i = 0; i < 3; ++i )
-  {
-    if( !led_state_init(led_states + i, led_paths + i) )
-    {
-      goto cleanup;
+  while( mce_hybris_sensors_wait_unparked() ) {
+    /* Deliver held back ALS event, and events left over from main
+     * loop delivery, before blocking in the hal */
+    if( mce_hybris_als_filter_has_due() ||
+        (mce_hybris_sensors_get_delivery() == MCE_HYBRIS_DELIVERY_THREAD &&
+         mce_hybris_sensors_ring_pending()) ) {
+      mce_hybris_sensors_feed(out, 0);
     }
-  }
 
-  res = true;
+    /* This blocks until there are events available, or possibly sooner
+     * if enabling/disabling sensors changes something. On cleanup the
+     * call is interrupted via flush() or wakeup signal. */
+    int n = TRACE_CALL(MCE_HYBRIS_TRACE_SENSOR_POLL, 0,
+                       mce_hybris_sensors_poll(eve, numof(eve)));
+    int k = 0;
 
-cleanup:
+    if( __atomic_load_n(&poll_quit, __ATOMIC_ACQUIRE) ) {
+      break;
+    }
 
-  if( !res )
-  {
-    led_ctrl_close_sysfs_files();
-  }
+    if( n >= 0 ) {
+      mce_hybris_sensor_stats_poll(n);
+    }
+    else if( n != poll_err ) {
+      mce_log(LOG_ERR, "sensor poll failed: %d", n);
+    }
+    poll_err = (n < 0) ? n : 0;
 
-  return res;
-}
+    /* Collect events from sensors we know about to a compact array */
+    for( int i = 0; i < n; ++i ) {
+      const sensors_event_t *e = &eve[i];
 
-/** Helper for scaling values in 0-255 range
- *
- * @param value input value in [0...255] range
- * @param scale scaling factor [0...255]
- *
- * @return scaled value [0...255]
- */
-static inline int led_ctrl_scale_value(int value, int scale)
-{
-  /* round up */
-  return (value * scale + 255 - 1) / 255;
-}
+      /* Skip meta data and other events from unknown sensors */
+      if( !mce_hybris_modsensors_get_slot_by_handle(e->sensor, e->type) ) {
+        continue;
+      }
+      if( !mce_hybris_modsensors_get_slot(e->type) ) {
+        continue;
+      }
 
-/** Change blinking attributes of a LED channel */
-static void led_ctrl_set_channel_blink(int chn, int on, int off)
-{
-  led_state_set_blink(led_states + chn, on, off);
-}
+      out[k].timestamp = e->timestamp;
+      out[k].type      = e->type;
+      out[k].value[0]  = e->data[0];
+      out[k].value[1]  = e->data[1];
+      out[k].value[2]  = e->data[2];
+      trace_add_event(&out[k]);
+      ++k;
+    }
 
-/** Change intensity attribute of a LED channel */
-static void led_ctrl_set_channel_value(int chn, int val)
-{
-  led_state_set_value(led_states + chn, val);
-}
+    /* Keep a copy of raw data if requested */
+    srec_append(eve, n);
 
-/** Change blinking attributes of RGB led */
-static void led_ctrl_set_rgb_blink(int on, int off)
-{
-  led_ctrl_set_channel_blink(0, on, off);
-  led_ctrl_set_channel_blink(1, on, off);
-  led_ctrl_set_channel_blink(2, on, off);
+    mce_hybris_sensors_feed(out, k);
+  }
 }
 
-/** Change intensity attributes of RGB led */
-static void led_ctrl_set_rgb_value(int r, int g, int b)
-{
-  led_ctrl_set_channel_value(0, r);
-  led_ctrl_set_channel_value(1, g);
-  led_ctrl_set_channel_value(2, b);
-}
 
-/** Generate intensity curve for use from breathing timer
+/** Try to make the worker thread return from dev_poll->poll()
  */
-static void led_ctrl_generate_ramp(int ms_on, int ms_off)
+static void mce_hybris_sensors_wakeup_worker(void)
 {
-  int t = ms_on + ms_off;
-  int s = (t + LED_CTRL_MAX_STEPS - 1) / LED_CTRL_MAX_STEPS;
-
-  if( s < LED_CTRL_BREATHING_DELAY ) {
-    s = LED_CTRL_BREATHING_DELAY;
+#ifdef SENSORS_DEVICE_API_VERSION_1_1
+  /* Flushing an active sensor generates a meta data event */
+  if( dev_poll_version >= SENSORS_DEVICE_API_VERSION_1_1 ) {
+    sensors_poll_device_1_t *dev = (sensors_poll_device_1_t *)dev_poll;
+
+    for( int type = 0; type < MCE_HYBRIS_SENSOR_TYPE_COUNT; ++type ) {
+      const sensor_slot_t *slot = &sensor_slots[type];
+      if( slot->active && dev->flush ) {
+        TRACE_CALL(MCE_HYBRIS_TRACE_SENSOR_FLUSH, slot->sensor->handle,
+                   dev->flush(dev, slot->sensor->handle));
+        break;
+      }
+    }
   }
-  int n = (t + s - 1) / s;
-
-  int steps_on  = (n * ms_on + t / 2) / t;
-  int steps_off = n - steps_on;
-
-  const float m_pi_2 = (float)M_PI_2;
-
-  int k = 0;
+#endif
 
-  for( int i = 0; i < steps_on; ++i ) {
-    float a = i * m_pi_2 / steps_on;
-    led_ctrl_breathe.value[k++] = (uint8_t)(sinf(a) * 255.0f);
-  }
-  for( int i = 0; i < steps_off; ++i ) {
-    float a = m_pi_2 + i * m_pi_2 / steps_off;
-    led_ctrl_breathe.value[k++] = (uint8_t)(sinf(a) * 255.0f);
+  /* Interrupt whatever blocking system call the hal is making; the
+   * signal is not sent while the worker might be running mce code */
+  if( __atomic_load_n(&poll_in_hal, __ATOMIC_ACQUIRE) ) {
+    pthread_kill(poll_tid, MCE_HYBRIS_WAKEUP_SIGNAL);
   }
-
-  led_ctrl_breathe.delay = s;
-  led_ctrl_breathe.steps = k;
-
-  mce_log(LOG_DEBUG, "delay=%d, steps_on=%d, steps_off=%d",
-          led_ctrl_breathe.delay, steps_on, steps_off);
 }
 
-/** Timer id for stopping led */
-static guint led_ctrl_stop_id = 0;
-
-/** Timer id for breathing/setting led */
-static guint led_ctrl_step_id = 0;
-
-/** Timer callback for setting led
+/** Make sensor worker thread stop polling the hal without waiting
+ *
+ * The thread is kept around, waiting on a condition, so that
+ * disabling the last sensor does not block the main loop.
  */
-static gboolean led_ctrl_static_cb(gpointer aptr)
+static void mce_hybris_sensors_park_worker(void)
 {
-  (void) aptr;
-
-  if( !led_ctrl_step_id ) {
+  if( !poll_tid ) {
     goto cleanup;
   }
 
-  led_ctrl_step_id = 0;
-
-  // get configured color
-  int r = led_ctrl_curr.r;
-  int g = led_ctrl_curr.g;
-  int b = led_ctrl_curr.b;
-
-  // adjust by brightness level
-  int l = led_ctrl_curr.level;
-
-  r = led_ctrl_scale_value(r, l);
-  g = led_ctrl_scale_value(g, l);
-  b = led_ctrl_scale_value(b, l);
+  pthread_mutex_lock(&poll_park_mutex);
+  poll_parked = true;
+  pthread_mutex_unlock(&poll_park_mutex);
 
-  // set led blinking and color
-  led_ctrl_set_rgb_blink(led_ctrl_curr.on, led_ctrl_curr.off);
-  led_ctrl_set_rgb_value(r, g, b);
+  /* Leave poll() now rather than on the next hal event */
+  mce_hybris_sensors_wakeup_worker();
 
 cleanup:
-  return FALSE;
+  return;
 }
 
-/** Timer callback for taking a led breathing step
+/** Make parked sensor worker thread resume polling the hal
  */
-static gboolean led_ctrl_step_cb(gpointer aptr)
+static void mce_hybris_sensors_unpark_worker(void)
 {
-  (void)aptr;
+  pthread_mutex_lock(&poll_park_mutex);
+  poll_parked = false;
+  pthread_cond_broadcast(&poll_park_cond);
+  pthread_mutex_unlock(&poll_park_mutex);
+}
 
-  if( !led_ctrl_step_id ) {
+/** Start sensor worker thread
+ *
+ * @return true if the worker is running, false otherwise
+ */
+static bool mce_hybris_sensors_start_worker(void)
+{
+  if( !dev_poll ) {
     goto cleanup;
   }
 
-  if( led_ctrl_breathe.step >= led_ctrl_breathe.steps ) {
-    led_ctrl_breathe.step = 0;
+  if( poll_tid ) {
+    goto cleanup;
   }
 
-  // get configured color
-  int r = led_ctrl_curr.r;
-  int g = led_ctrl_curr.g;
-  int b = led_ctrl_curr.b;
-
-  // adjust by brightness level
-  int l = led_ctrl_curr.level;
-
-  r = led_ctrl_scale_value(r, l);
-  g = led_ctrl_scale_value(g, l);
-  b = led_ctrl_scale_value(b, l);
-
-  // adjust by curve position
-  size_t i = led_ctrl_breathe.step++;
-  int    v = led_ctrl_breathe.value[i];
+  mce_hybris_sensors_wakeup_init();
 
-  r = led_ctrl_scale_value(r, v);
-  g = led_ctrl_scale_value(g, v);
-  b = led_ctrl_scale_value(b, v);
-
-  // set led color
-  led_ctrl_set_rgb_value(r, g, b);
+  __atomic_store_n(&poll_quit, false, __ATOMIC_RELEASE);
+  poll_parked = false;
+  poll_tid = mce_hybris_start_thread(mce_hybris_sensors_thread, 0);
 
 cleanup:
-  return led_ctrl_step_id != 0;
+  return poll_tid != 0;
 }
 
-static bool reset_blinking = true;
-
-/** Timer callback from stopping/restarting led
+/** Stop sensor worker thread
+ *
+ * The thread is asked to exit and woken up from dev_poll->poll().
+ * Only if that does not succeed within MCE_HYBRIS_WORKER_STOP_TIMEOUT,
+ * the thread is cancelled. The thread stays cancellable only while it
+ * is blocked in the hal, so cancelling never interrupts event delivery
+ * and the locks held there.
  */
-static gboolean led_ctrl_stop_cb(gpointer aptr)
+static void mce_hybris_sensors_stop_worker(void)
 {
-  (void) aptr;
-
-  if( !led_ctrl_stop_id ) {
+  if( !poll_tid ) {
     goto cleanup;
   }
-  led_ctrl_stop_id = 0;
 
-  if( reset_blinking ) {
-    // blinking off - must be followed by rgb set to have an effect
-    led_ctrl_set_rgb_blink(0, 0);
+  mce_log(LOG_DEBUG, "stopping worker thread");
+
+  /* Wake up also if parked */
+  pthread_mutex_lock(&poll_park_mutex);
+  __atomic_store_n(&poll_quit, true, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&poll_park_cond);
+  pthread_mutex_unlock(&poll_park_mutex);
+
+  int64_t started = mce_hybris_get_tick();
+  bool    joined  = false;
+
+  for( ;; ) {
+    mce_hybris_sensors_wakeup_worker();
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += MCE_HYBRIS_WORKER_WAKEUP_INTERVAL * 1000000l;
+    if( ts.tv_nsec >= 1000000000l ) {
+      ts.tv_nsec -= 1000000000l;
+      ts.tv_sec  += 1;
+    }
+
+    int err = pthread_timedjoin_np(poll_tid, 0, &ts);
+    if( err == 0 ) {
+      joined = true;
+      break;
+    }
+    if( err != ETIMEDOUT ) {
+      mce_log(LOG_ERR, "failed to join worker thread: %s", strerror(err));
+      break;
+    }
+    if( mce_hybris_get_tick() - started >= MCE_HYBRIS_WORKER_STOP_TIMEOUT ) {
+      break;
+    }
   }
 
-  if( !led_request_has_color(&led_ctrl_curr) ) {
-    // set rgb to black before returning
-    reset_blinking = true;
+  if( joined ) {
+    mce_log(LOG_DEBUG, "worker stopped in %d ms",
+            (int)(mce_hybris_get_tick() - started));
   }
   else {
-    if( led_ctrl_breathe.delay > 0 ) {
-      // start breathing timer
-      led_ctrl_step_id = g_timeout_add(led_ctrl_breathe.delay,
-                                       led_ctrl_step_cb, 0);
+    /* Last resort; resources reserved by the hal might be lost */
+    mce_log(LOG_WARNING, "worker did not stop; cancelling");
+    if( pthread_cancel(poll_tid) != 0 ) {
+      mce_log(LOG_ERR, "failed to stop worker thread");
     }
     else {
-      // set rgb to target after timer delay
-      led_ctrl_step_id = g_timeout_add(LED_CTRL_KERNEL_DELAY,
-                                       led_ctrl_static_cb, 0);
+      void *status = 0;
+      pthread_join(poll_tid, &status);
+      mce_log(LOG_DEBUG, "worker cancelled, status = %p", status);
     }
   }
 
-  if( reset_blinking ) {
-    // set rgb to black
-    led_ctrl_set_rgb_value(0, 0, 0);
-    reset_blinking = false;
-  }
+  poll_tid = 0;
 
 cleanup:
+  return;
+}
 
-  return FALSE;
+/** Check if the sensor poll device supports batch() and flush()
+ *
+ * @return true if sensors_poll_device_1 interface is available
+ */
+static bool mce_hybris_sensors_has_batch(void)
+{
+#ifdef SENSORS_DEVICE_API_VERSION_1_0
+  return dev_poll && dev_poll_version >= SENSORS_DEVICE_API_VERSION_1_0;
+#else
+  return false;
+#endif
 }
 
-/** Start static/blinking/breathing led
+/** Enable / disable sensor at hal level
+ *
+ * @param handle sensor handle
+ * @param enable true to enable, false to disable
+ *
+ * @return hal return value
  */
-static void
-led_ctrl_start(const led_request_t *next)
+static int mce_hybris_sensors_dev_activate(int handle, bool enable)
 {
-  led_request_t work = *next;
+  return TRACE_CALL(enable ? MCE_HYBRIS_TRACE_SENSOR_ENABLE
+                           : MCE_HYBRIS_TRACE_SENSOR_DISABLE, handle,
+                    dev_poll->activate(dev_poll, handle, enable));
+}
 
-  led_request_sanitize(&work);
+/** Apply sampling period and report latency to a sensor
+ *
+ * On sensors_poll_device_1 the parameters are passed via batch(),
+ * older hals get just the sampling period via setDelay().
+ *
+ * @param slot sensor dispatch data
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_sensors_set_rate(const sensor_slot_t *slot)
+{
+  bool ack = false;
 
-  if( led_request_is_equal(&led_ctrl_curr, &work) ) {
+  const struct sensor_t *sensor = slot->sensor;
+  const sensor_rate_t   *rate   = &slot->rate;
+
+  /* Leave hal defaults in place unless something has been requested */
+  if( rate->period <= 0 && rate->latency <= 0 ) {
+    ack = true;
     goto cleanup;
   }
 
-  /* Assumption: Before changing the led state, we need to wait a bit
-   * for kernel side to finish with last change we made and then possibly
-   * reset the blinking status and wait a bit more */
-  bool restart = true;
+#ifdef SENSORS_DEVICE_API_VERSION_1_0
+  if( mce_hybris_sensors_has_batch() ) {
+    sensors_poll_device_1_t *dev = (sensors_poll_device_1_t *)dev_poll;
 
-  led_style_t old_style = led_request_get_style(&led_ctrl_curr);
-  led_style_t new_style = led_request_get_style(&work);
+    if( TRACE_CALL(MCE_HYBRIS_TRACE_SENSOR_BATCH, sensor->handle,
+                   dev->batch(dev, sensor->handle, 0, rate->period,
+                              rate->latency)) == 0 ) {
+      ack = true;
+    }
+    else if( rate->latency > 0 &&
+             TRACE_CALL(MCE_HYBRIS_TRACE_SENSOR_BATCH, sensor->handle,
+                        dev->batch(dev, sensor->handle, 0,
+                                   rate->period, 0)) == 0 ) {
+      /* Hal refuses batching mode, but accepts the sampling rate */
+      ack = true;
+    }
+    goto cleanup;
+  }
+#endif
 
-  /* Exception: When we are already breathing and continue to
-   * breathe, the blinking is not in use and the breathing timer
-   * is keeping the updates far enough from each other */
-  if( old_style == STYLE_BREATH && new_style == STYLE_BREATH &&
-      led_request_has_equal_timing(&led_ctrl_curr, &work) ) {
-    restart = false;
+  if( rate->period > 0 && dev_poll->setDelay ) {
+    if( TRACE_CALL(MCE_HYBRIS_TRACE_SENSOR_BATCH, sensor->handle,
+                   dev_poll->setDelay(dev_poll, sensor->handle,
+                                      rate->period)) < 0 ) {
+      goto cleanup;
+    }
   }
 
-  led_ctrl_curr = work;
+  ack = true;
 
-  if( restart ) {
-    // stop existing breathing timer
-    if( led_ctrl_step_id ) {
-      g_source_remove(led_ctrl_step_id), led_ctrl_step_id = 0;
-    }
+cleanup:
+  return ack;
+}
 
-    // re-evaluate breathing constants
-    led_ctrl_breathe.delay = 0;
-    if( new_style == STYLE_BREATH ) {
-      led_ctrl_generate_ramp(work.on, work.off);
-    }
+/** Number of currently enabled sensors */
+static int sensors_active_cnt = 0;
 
-    /* Schedule led off after kernel settle timeout; once that
-     * is done, new led color/blink/breathing will be started */
-    if( !led_ctrl_stop_id ) {
-      reset_blinking = (old_style == STYLE_BLINK ||
-                        new_style == STYLE_BLINK);
-      led_ctrl_stop_id = g_timeout_add(LED_CTRL_KERNEL_DELAY,
-                                       led_ctrl_stop_cb, 0);
-    }
+/** Count a sensor as enabled; starts or resumes worker thread if needed
+ *
+ * @param active pointer to sensor enabled flag
+ */
+static void mce_hybris_sensors_acquire(bool *active)
+{
+  if( *active ) {
+    goto cleanup;
   }
 
-cleanup:
+  *active = true;
 
+  if( ++sensors_active_cnt == 1 ) {
+    if( poll_tid )
+      mce_hybris_sensors_unpark_worker();
+    else
+      mce_hybris_sensors_start_worker();
+  }
+
+cleanup:
   return;
 }
 
-/** Nanosleep helper
+/** Count a sensor as disabled; parks worker thread if no longer needed
+ *
+ * The thread is stopped only from mce_hybris_sensors_quit(), so that
+ * toggling sensors does not block the main loop.
+ *
+ * @param active pointer to sensor enabled flag
  */
-static void led_ctrl_wait_kernel(void)
+static void mce_hybris_sensors_release(bool *active)
 {
-  struct timespec ts = { 0, LED_CTRL_KERNEL_DELAY * 1000000l };
-  TEMP_FAILURE_RETRY(nanosleep(&ts, &ts));
+  if( !*active ) {
+    goto cleanup;
+  }
+
+  /* Park the worker while the sensor is still active, so that
+   * flush() can be used for waking up the thread */
+  if( sensors_active_cnt == 1 ) {
+    mce_hybris_sensors_park_worker();
+  }
+
+  *active = false;
+  --sensors_active_cnt;
+
+cleanup:
+  return;
 }
 
-/** Initialize libhybris indicator led device object
+/** Enable / disable a sensor
+ *
+ * Sampling parameters are applied before enabling the sensor.
+ *
+ * The worker thread polls the hal only while at least one
+ * sensor is enabled.
+ *
+ * @param slot  sensor dispatch data
+ * @param state true to enable, or false to disable
  *
  * @return true on success, false on failure
  */
-bool mce_hybris_indicator_init(void)
+static bool mce_hybris_sensors_activate(sensor_slot_t *slot, bool state)
 {
-  static bool done = false;
-  static bool ack  = false;
-
-  if( done ) {
-    goto cleanup;
-  }
+  bool ack = false;
 
-  done = true;
+  const struct sensor_t *sensor = slot->sensor;
 
-  led_ctrl_uses_sysfs = led_ctrl_probe_sysfs_files();
+  if( state ) {
+    mce_hybris_sensors_acquire(&slot->active);
 
-  if( led_ctrl_uses_sysfs ) {
-    /* Use raw sysfs controls */
+    if( !mce_hybris_sensors_set_rate(slot) ) {
+      mce_log(LOG_WARNING, "%s: failed to set sampling rate", sensor->name);
+    }
 
-    /* adjust current state to: color=black */
-    led_request_t req = led_ctrl_curr;
-    req.r = 0;
-    req.g = 0;
-    req.b = 0;
-    led_ctrl_start(&req);
+    if( mce_hybris_sensors_dev_activate(sensor->handle, true) >= 0 ) {
+      ack = true;
+    }
+    else {
+      mce_hybris_sensors_release(&slot->active);
+    }
   }
   else {
-    /* Fall back to libhybris */
+    mce_hybris_sensors_release(&slot->active);
 
-    if( !mce_hybris_modlights_load() ) {
-      goto cleanup;
+    if( mce_hybris_sensors_dev_activate(sensor->handle, false) >= 0 ) {
+      ack = true;
     }
+  }
 
-    mce_light_device_open(mod_lights, LIGHT_ID_NOTIFICATIONS, &dev_indicator);
+  return ack;
+}
 
-    if( !dev_indicator ) {
-      mce_log(LOG_WARNING, "failed to open indicator led device");
+/** Helper for converting sampling parameters from ms to ns
+ */
+static void sensor_rate_set(sensor_rate_t *self, int period_ms, int latency_ms)
+{
+  self->period  = clamp_to_range(0, 60000, period_ms)  * (int64_t)1000000;
+  self->latency = clamp_to_range(0, 60000, latency_ms) * (int64_t)1000000;
+}
+
+/** Initialize libhybris sensor poll device object
+ *
+ * Also disables ALS and PS sensor inputs if possible. The worker
+ * thread for handling sensor input events is started on demand
+ * when sensors are enabled.
+ *
+ * Can be called again after mce_hybris_sensors_quit() to reopen
+ * the device.
+ *
+ * @return true on success, false on failure
+ */
+static bool mce_hybris_sensors_init(void)
+{
+  /* Do not retry opening of a device that is known to be missing */
+  static bool failed = false;
+
+  if( !dev_poll && !failed ) {
+    if( !mce_hybris_modsensors_load() ) {
       goto cleanup;
     }
+
+    if( !probe_cache_is_missing(PROBE_DEV_POLL) ) {
+      mce_sensors_open(&mod_sensors->common, &dev_poll);
+      probe_cache_update(PROBE_DEV_POLL, dev_poll != 0);
+    }
+
+    if( !dev_poll ) {
+      mce_log(LOG_WARNING, "failed to open sensor poll device");
+      failed = true;
+    }
+    else {
+      dev_poll_version = dev_poll->common.version;
+      mce_log(LOG_DEBUG, "dev_poll = %p, version = 0x%x, batching = %s",
+              dev_poll, (unsigned)dev_poll_version,
+              mce_hybris_sensors_has_batch() ? "yes" : "no");
+
+      if( ps_sensor ) {
+        mce_hybris_sensors_dev_activate(ps_sensor->handle, false);
+      }
+      if( als_sensor ) {
+        mce_hybris_sensors_dev_activate(als_sensor->handle, false);
+      }
+
+      /* Worker thread is started when sensors are enabled */
+    }
   }
 
-  ack = true;
-
 cleanup:
-  return ack;
+  return dev_poll != 0;
 }
 
-/** Release libhybris indicator led device object
+/** Release libhybris display backlight device object
+ *
+ * Also:
+ * - stops the sensor input worker thread
+ * - disables ALS and PS sensor inputs if possible
  */
-void mce_hybris_indicator_quit(void)
+static void mce_hybris_sensors_quit(void)
 {
-  /* Release libhybris controls */
-
-  if( dev_indicator ) {
-    mce_light_device_close(dev_indicator), dev_indicator = 0;
-  }
+  mce_hybris_sensors_replay_stop();
 
-  /* Release sysfs controls */
+  if( dev_poll ) {
+    mce_hybris_sensors_stop_worker();
 
-  if( led_ctrl_uses_sysfs ) {
-    // cancel timers
-    if( led_ctrl_step_id ) {
-      g_source_remove(led_ctrl_step_id), led_ctrl_step_id = 0;
+    if( ps_sensor ) {
+      mce_hybris_sensors_dev_activate(ps_sensor->handle, false);
     }
-    if( led_ctrl_stop_id ) {
-      g_source_remove(led_ctrl_stop_id), led_ctrl_stop_id = 0;
+    if( als_sensor ) {
+      mce_hybris_sensors_dev_activate(als_sensor->handle, false);
     }
 
-    // allow kernel side to settle down
-    led_ctrl_wait_kernel();
-
-    // blink off
-    led_ctrl_set_rgb_blink(0, 0);
-
-    // zero brightness
-    led_ctrl_set_rgb_value(0, 0, 0);
+    for( int type = 0; type < MCE_HYBRIS_SENSOR_TYPE_COUNT; ++type ) {
+      sensor_slot_t *slot = &sensor_slots[type];
+      if( slot->active ) {
+        mce_hybris_sensors_dev_activate(slot->sensor->handle, false);
+        slot->active = false;
+      }
+    }
+    sensors_active_cnt = 0;
 
-    // close sysfs files
-    led_ctrl_close_sysfs_files();
+    mce_sensors_close(dev_poll), dev_poll = 0;
   }
-}
 
-/** Clamp integer values to given range
- *
- * @param lo  minimum value allowed
- * @param hi  maximum value allowed
- * @param val value to clamp
- *
- * @return val clamped to [lo, hi]
- */
-static inline int clamp_to_range(int lo, int hi, int val)
-{
-  return val <= lo ? lo : val <= hi ? val : hi;
+  mce_hybris_sensors_record_stop();
+  ps_fast_stop();
+  als_auto_quit();
+  mce_hybris_sensors_ring_quit();
 }
 
-/** Set indicator led pattern via libhybris
- *
- * @param r     red intensity 0 ... 255
- * @param g     green intensity 0 ... 255
- * @param b     blue intensity 0 ... 255
- * @param ms_on milliseconds to keep the led on, or 0 for no flashing
- * @param ms_on milliseconds to keep the led off, or 0 for no flashing
+/* ------------------------------------------------------------------------- *
+ * proximity sensor
+ * ------------------------------------------------------------------------- */
+
+/** Start using proximity sensor via libhybris
  *
  * @return true on success, false on failure
  */
-bool mce_hybris_indicator_set_pattern(int r, int g, int b,
-                                      int ms_on, int ms_off)
+bool mce_hybris_ps_init(void)
 {
-  bool     ack = false;
+  bool res = false;
 
-  /* Sanitize input values */
+  if( probe_cache_lacks_sensor(SENSOR_TYPE_PROXIMITY) ) {
+    goto cleanup;
+  }
 
-  /* Clamp time periods to [0, 60] second range.
-   *
-   * While periods longer than few seconds might not count as "blinking",
-   * we need to leave some slack to allow beacon style patterns with
-   * relatively long off periods */
-  ms_on  = clamp_to_range(0, 60000, ms_on);
-  ms_off = clamp_to_range(0, 60000, ms_off);
+  if( !mce_hybris_sensors_init() ) {
+    goto cleanup;
+  }
 
-  /* Both on and off periods need to be non-zero for the blinking
-   * to happen in the first place. And if the periods are too
-   * short it starts to look like led failure more than indication
-   * of something. */
-  if( ms_on < 50 || ms_off < 50 ) {
-    ms_on = ms_off = 0;
+  if( !ps_sensor ) {
+    goto cleanup;
   }
 
-  /* Clamp rgb values to [0, 255] range */
-  r = clamp_to_range(0, 255, r);
-  g = clamp_to_range(0, 255, g);
-  b = clamp_to_range(0, 255, b);
+  res = true;
 
-  /* Use raw sysfs controls if possible */
+cleanup:
+  return res;
+}
 
-  if( led_ctrl_uses_sysfs ) {
+/** Stop using proximity sensor via libhybris
+ *
+ * @return true on success, false on failure
+ */
+void mce_hybris_ps_quit(void)
+{
+  ps_hook = 0;
+}
 
-    /* adjust current state to: color & timing as requested */
-    led_request_t req = led_ctrl_curr;
-    req.r   = r;
-    req.g   = g;
-    req.b   = b;
-    req.on  = ms_on;
-    req.off = ms_off;
-    led_ctrl_start(&req);
+/** Set proximity sensort input enabled state
+ *
+ * @param state true to enable input, or false to disable input
+ */
+bool mce_hybris_ps_set_active(bool state)
+{
+  bool res = false;
 
-    ack = true;
+  if( !mce_hybris_ps_init() ) {
     goto cleanup;
   }
 
-  /* Fall back to libhybris API */
-
-  struct light_state_t lst;
+  sensor_slot_t *slot = mce_hybris_modsensors_get_slot(SENSOR_TYPE_PROXIMITY);
 
-  if( !mce_hybris_indicator_init() ) {
+  if( !mce_hybris_sensors_activate(slot, state) ) {
     goto cleanup;
   }
 
-  memset(&lst, 0, sizeof lst);
+  res = true;
 
-  lst.color          = (0xff << 24) | (r << 16) | (g << 8) | (b << 0);
-  lst.brightnessMode = BRIGHTNESS_MODE_USER;
+cleanup:
+  return res;
+}
 
-  if( ms_on > 0 && ms_off > 0 ) {
-    lst.flashMode    = LIGHT_FLASH_HARDWARE;
-    lst.flashOnMS    = ms_on;
-    lst.flashOffMS   = ms_off;
+/** Set proximity sensor sampling period and maximum report latency
+ *
+ * On hals that support batching, the sensor hub can queue events for
+ * up to latency_ms before waking up the application processor. Older
+ * hals get only the sampling period.
+ *
+ * @param period_ms  sampling period, or 0 for hal default
+ * @param latency_ms maximum report latency, or 0 for no batching
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_ps_set_batching(int period_ms, int latency_ms)
+{
+  return mce_hybris_sensor_set_batching(SENSOR_TYPE_PROXIMITY,
+                                        period_ms, latency_ms);
+}
+
+/** Enable / disable proximity sensor fast lane
+ *
+ * Proximity events are always moved ahead of other events in each
+ * batch read from the hal. With the fast lane enabled, and when the
+ * callbacks are called from the worker thread, proximity events are
+ * delivered from a separate dispatch thread with raised priority, so
+ * that slow handling of ambient light events on the mce side does not
+ * delay proximity state changes.
+ *
+ * In MCE_HYBRIS_DELIVERY_MAINLOOP mode all events are delivered from
+ * the main loop and only the ordering applies.
+ *
+ * Note: only the proximity callbacks - mce_hybris_ps_set_hook() and
+ *       the MCE_HYBRIS_SENSOR_TYPE_PROXIMITY hook set via
+ *       mce_hybris_sensor_set_hook() - are called from the dispatch
+ *       thread. They can run concurrently with callbacks for other
+ *       sensors. The batch callback still gets whole batches,
+ *       proximity events included, from the worker thread.
+ *
+ * @param enable   true to start the dispatch thread, false to stop it
+ * @param priority SCHED_FIFO priority if positive, otherwise niceness
+ *                 to use for the dispatch thread
+ *
+ * @return true on success, false on failure
+ */
+bool mce_hybris_ps_set_fast_lane(bool enable, int priority)
+{
+  bool ack = true;
+
+  if( enable ) {
+    ack = ps_fast_start(priority);
   }
   else {
-    lst.flashMode    = LIGHT_FLASH_NONE;
-    lst.flashOnMS    = 0;
-    lst.flashOffMS   = 0;
+    ps_fast_stop();
   }
 
-  if( dev_indicator->set_light(dev_indicator, &lst) < 0 ) {
-    goto cleanup;
-  }
-
-  ack = true;
-
-cleanup:
-
-  mce_log(LOG_DEBUG, "%s(%d,%d,%d,%d,%d) -> %s", __FUNCTION__,
-         r,g,b, ms_on, ms_off , ack ? "success" : "failure");
+  mce_log(LOG_DEBUG, "%s(%d, %d) -> %s", __FUNCTION__, enable, priority,
+          ack ? "success" : "failure");
 
   return ack;
 }
 
-/** Enable/disable sw breathing
+/** Set callback function for handling proximity sensor events
  *
- * @param enable true to enable sw breathing, false to disable
+ * Note: the callback function will be called from worker thread,
+ *       or from the fast lane thread when enabled via
+ *       mce_hybris_ps_set_fast_lane(), unless main loop delivery
+ *       has been selected via mce_hybris_sensors_set_delivery().
  */
-void mce_hybris_indicator_enable_breathing(bool enable)
+void mce_hybris_ps_set_hook(mce_hybris_ps_fn cb)
 {
-  if( !led_ctrl_uses_sysfs ) {
-    // no breathing control via hybris api
-    goto cleanup;
-  }
-
-  /* adjust current state to: breathing as requested */
-  led_request_t work = led_ctrl_curr;
-  work.breathe = enable;
-  led_ctrl_start(&work);
-
-cleanup:
-  return;
+  ps_hook = cb;
 }
 
-/** Set indicator led brightness
- *
- * @param level 1=minimum, 255=maximum
+/* ------------------------------------------------------------------------- *
+ * ambient light sensor
+ * ------------------------------------------------------------------------- */
+
+/** Start using ambient light sensor via libhybris
  *
- * @return true on success, or false on failure
+ * @return true on success, false on failure
  */
-bool mce_hybris_indicator_set_brightness(int level)
+bool mce_hybris_als_init(void)
 {
-  if( !led_ctrl_uses_sysfs ) {
-    // no breathing control via hybris api
+  bool res = false;
+
+  if( probe_cache_lacks_sensor(SENSOR_TYPE_LIGHT) ) {
     goto cleanup;
   }
 
-  /* Clamp brightness values to [1, 255] range */
-  level = clamp_to_range(1, 255, level);
+  if( !mce_hybris_sensors_init() ) {
+    goto cleanup;
+  }
 
-  /* adjust current state to: brightness as requested */
-  led_request_t work = led_ctrl_curr;
-  work.level = level;
-  led_ctrl_start(&work);
+  if( !als_sensor ) {
+    goto cleanup;
+  }
+
+  res = true;
 
 cleanup:
-  /* Note: failure means this function is not available - which is
-   * handled at mce side stub. From this plugin we always return true */
-  return true;
+  return res;
 }
 
-/* ========================================================================= *
- * SENSORS module
- * ========================================================================= */
-
-/** Convenience function for opening sensors device
+/** Stop using ambient light sensor via libhybris
  *
- * Similar to what we might or might not have available from hardware/sensors.h
+ * @return true on success, false on failure
  */
-static int
-mce_sensors_open(const struct hw_module_t* module,
-                 struct sensors_poll_device_t** device)
+void mce_hybris_als_quit(void)
 {
-  return module->methods->open(module, SENSORS_HARDWARE_POLL,
-                               (struct hw_device_t**)device);
+  als_hook = 0;
 }
 
-/** Convenience function for closing sensors device
+/** Set ambient light sensor input enabled state
  *
- * Similar to what we might or might not have available from hardware/sensors.h
+ * @param state true to enable input, or false to disable input
  */
-static int
-mce_sensors_close(struct sensors_poll_device_t* device)
+bool mce_hybris_als_set_active(bool state)
 {
-  return device->common.close(&device->common);
-}
-
-/** Handle for libhybris sensors plugin */
-static struct sensors_module_t       *mod_sensors = 0;
-
-/** Pointer to libhybris sensor poll device object */
-static struct sensors_poll_device_t  *dev_poll = 0;
+  bool res = false;
 
-/** Array of sensors available via mod_sensors */
-static const struct sensor_t         *sensor_lut = 0;
+  if( !mce_hybris_als_init() ) {
+    goto cleanup;
+  }
 
-/** Number of sensors available via mod_sensors */
-static int                            sensor_cnt = 0;
+  if( state ) {
+    mce_hybris_als_filter_reset();
+    als_auto_reset();
+  }
 
-/** Pointer to libhybris proximity sensor object */
-static const struct sensor_t *ps_sensor = 0;
+  sensor_slot_t *slot = mce_hybris_modsensors_get_slot(SENSOR_TYPE_LIGHT);
 
-/** Callback for forwarding proximity sensor events */
-static mce_hybris_ps_fn       ps_hook   = 0;
+  if( !mce_hybris_sensors_activate(slot, state) ) {
+    goto cleanup;
+  }
 
-/** Pointer to libhybris ambient light sensor object */
-static const struct sensor_t *als_sensor = 0;
+  res = true;
 
-/** Callback for forwarding ambient light sensor events */
-static mce_hybris_als_fn      als_hook   = 0;
+cleanup:
+  return res;
+}
 
-/** Helper for locating sensor objects by type
+/** Configure ambient light sensor event filtering
  *
- * @param type SENSOR_TYPE_LIGHT etc
+ * ALS events are forwarded to mce only if the value has changed by
+ * at least the larger of the absolute and relative limits since the
+ * previously forwarded event, and not more often than allowed by the
+ * minimum interval. The latest held back value is forwarded after
+ * the sensor has been quiet for the given period.
  *
- * @return sensor pointer, or NULL if not available
+ * The quiet period is timed in the glib main loop, but delivery of
+ * the held back value happens from the same thread as for other
+ * events, as determined by mce_hybris_sensors_set_delivery().
+ *
+ * @param delta_abs       minimum change in lux, or 0 for any change
+ * @param delta_rel       minimum change relative to previous value,
+ *                        e.g. 0.1 for 10 percent, or 0 for any change
+ * @param min_interval_ms minimum time between events, or 0 for no limit
+ * @param quiet_flush_ms  deliver held back value after quiet period,
+ *                        or 0 to drop small changes
+ *
+ * @return true on success, false on failure
  */
-static const struct sensor_t *mce_hybris_modsensors_get_sensor(int type)
+bool mce_hybris_als_set_filter(float delta_abs, float delta_rel,
+                               int min_interval_ms, int quiet_flush_ms)
 {
-  const struct sensor_t *res = 0;
+  pthread_mutex_lock(&als_filter_mutex);
 
-  for( int i = 0; i < sensor_cnt; ++i ) {
+  als_filter.delta_abs = (delta_abs > 0) ? delta_abs : 0;
+  als_filter.delta_rel = (delta_rel > 0) ? delta_rel : 0;
+  als_filter.interval  = clamp_to_range(0, 60000, min_interval_ms);
+  als_filter.quiet     = clamp_to_range(0, 60000, quiet_flush_ms);
 
-    if( sensor_lut[i].type == type ) {
-      res = &sensor_lut[i];
-      break;
-    }
+  /* Re-evaluate held back value against the new settings */
+  if( als_filter.have_pend ) {
+    mce_hybris_als_filter_schedule(mce_hybris_get_tick());
   }
 
-  return res;
+  pthread_mutex_unlock(&als_filter_mutex);
+
+  mce_log(LOG_DEBUG, "%s(%g, %g, %d, %d)", __FUNCTION__,
+          delta_abs, delta_rel, min_interval_ms, quiet_flush_ms);
+
+  return true;
 }
 
-/** Load libhybris sensors plugin
+/** Configure in-plugin automatic brightness control
+ *
+ * The lux to backlight level mapping and filter parameters are
+ * uploaded once, after which the plugin can drive the display
+ * backlight directly from ALS data without involving mce; see
+ * mce_hybris_als_set_auto_active().
  *
- * Also initializes look up table for supported sensors.
+ * The points are sorted by lux value, and levels in between are
+ * interpolated linearly.
+ *
+ * @param lut    array of lux / level points, or NULL to clear
+ * @param cnt    number of points, up to 32
+ * @param params filter parameters, or NULL for defaults
  *
  * @return true on success, false on failure
  */
-static bool mce_hybris_modsensors_load(void)
+bool mce_hybris_als_set_auto_brightness(const mce_hybris_als_point_t *lut,
+                                        int cnt,
+                                        const mce_hybris_als_auto_t *params)
 {
-  static bool done = false;
+  bool ack = false;
 
-  if( done ) goto cleanup;
+  if( cnt < 0 || cnt > ALS_AUTO_MAX_POINTS || (cnt > 0 && !lut) ) {
+    goto cleanup;
+  }
 
-  done = true;
+  pthread_mutex_lock(&als_auto_mutex);
 
-  {
-    const struct hw_module_t *mod = 0;
-    hw_get_module(SENSORS_HARDWARE_MODULE_ID, &mod);
-    mod_sensors = (struct sensors_module_t *)mod;
+  als_auto.cnt = 0;
+
+  if( !lut || cnt == 0 ) {
+    /* Clearing the table also stops the control loop */
+    als_auto.active = false;
   }
 
-  if( !mod_sensors ) {
-    mce_log(LOG_WARNING, "failed top open sensors module");
+  for( int i = 0; i < cnt; ++i ) {
+    mce_hybris_als_point_t pt = {
+      .lux   = (lut[i].lux > 0) ? lut[i].lux : 0,
+      .level = clamp_to_range(0, 255, lut[i].level),
+    };
+
+    /* Insertion sort by lux value */
+    int j = als_auto.cnt++;
+    for( ; j > 0 && als_auto.lut[j-1].lux > pt.lux; --j ) {
+      als_auto.lut[j] = als_auto.lut[j-1];
+    }
+    als_auto.lut[j] = pt;
+  }
+
+  if( params ) {
+    als_auto.smoothing  = clamp_to_range(0, 60000, params->smoothing_ms);
+    als_auto.hysteresis = (params->hysteresis > 0) ? params->hysteresis : 0;
+    als_auto.fade       = clamp_to_range(0, 60000, params->fade_ms);
+    als_auto.notify     = clamp_to_range(0, 600000, params->notify_ms);
   }
   else {
-    mce_log(LOG_DEBUG, "mod_sensors = %p", mod_sensors);
+    als_auto.smoothing  = ALS_AUTO_DEFAULT_SMOOTHING;
+    als_auto.hysteresis = ALS_AUTO_DEFAULT_HYSTERESIS;
+    als_auto.fade       = ALS_AUTO_DEFAULT_FADE;
+    als_auto.notify     = ALS_AUTO_DEFAULT_NOTIFY;
   }
 
-  if( !mod_sensors ) {
-    goto cleanup;
-  }
+  /* Apply the new mapping if already running */
+  als_auto_evaluate(true);
 
-  sensor_cnt = mod_sensors->get_sensors_list(mod_sensors, &sensor_lut);
+  pthread_mutex_unlock(&als_auto_mutex);
 
-  als_sensor = mce_hybris_modsensors_get_sensor(SENSOR_TYPE_LIGHT);
-  ps_sensor  = mce_hybris_modsensors_get_sensor(SENSOR_TYPE_PROXIMITY);
+  ack = true;
 
 cleanup:
+  mce_log(LOG_DEBUG, "%s(%p, %d, %p) -> %s", __FUNCTION__, lut, cnt,
+          params, ack ? "success" : "failure");
 
-  return mod_sensors != 0;
+  return ack;
 }
 
-/** Unload libhybris sensors plugin
+/** Start / stop in-plugin automatic brightness control
+ *
+ * While active, ALS events are mapped to backlight levels in the
+ * sensor pipeline and the backlight is faded to the chosen level
+ * from the glib main loop without involving mce. ALS events are
+ * still forwarded to mce as usual.
+ *
+ * Explicit mce_hybris_backlight_set_brightness() and
+ * mce_hybris_backlight_fade() calls stop the control loop; it must
+ * be reactivated after e.g. display has been unblanked.
+ *
+ * @param active true to start, false to stop
+ *
+ * @return true on success, false on failure
  */
-static void mce_hybris_modsensors_unload(void)
+bool mce_hybris_als_set_auto_active(bool active)
 {
-  /* cleanup dependencies */
-  mce_hybris_sensors_quit();
+  bool ack = false;
 
-  /* actually unload the module */
-  // FIXME: how to unload libhybris modules?
-}
+  pthread_mutex_lock(&als_auto_mutex);
 
-/* ------------------------------------------------------------------------- *
- * poll device
- * ------------------------------------------------------------------------- */
+  if( active && als_auto.cnt == 0 ) {
+    /* Nothing to map with */
+  }
+  else if( active != als_auto.active ) {
+    als_auto.active = active;
+    als_auto.apply  = false;
+    if( active ) {
+      als_auto.level = -1;
+      als_auto_evaluate(true);
+    }
+    ack = true;
+  }
+  else {
+    ack = true;
+  }
 
-/** Worker thread id */
-static pthread_t poll_tid = 0;
+  pthread_mutex_unlock(&als_auto_mutex);
 
-/** Worker thread for reading sensor events via blocking libhybris interface
+  mce_log(LOG_DEBUG, "%s(%s) -> %s", __FUNCTION__,
+          active ? "true" : "false", ack ? "success" : "failure");
+
+  return ack;
+}
+
+/** Set callback function for reporting automatically chosen levels
  *
- * Note: no mce_log() calls from this function - they are not thread safe
+ * Notifications are rate limited according to the configured
+ * interval, and only the latest level is reported.
  *
- * @param aptr (thread parameter, not used)
+ * Note: the callback function will be called from the glib main loop.
  */
-static void mce_hybris_sensors_thread(void *aptr)
+void mce_hybris_als_set_level_hook(mce_hybris_als_level_fn cb)
 {
-  (void)aptr;
-
-  sensors_event_t eve[32];
-
-  while( dev_poll ) {
-    /* This blocks until there are events available, or possibly sooner
-     * if enabling/disabling sensors changes something. Since we can't
-     * guarantee that we ever return from the call, the thread is cancelled
-     * asynchronously on cleanup - and any resources possibly reserved by
-     * the dev_poll->poll() are lost. */
-    int n = dev_poll->poll(dev_poll, eve, numof(eve));
-
-    for( int i = 0; i < n; ++i ) {
-      sensors_event_t *e = &eve[i];
-
-      /* Forward data via per sensor callback routines. The callbacks must
-       * handle the fact that they get called from the context of the worker
-       * thread. */
-      switch( e->type ) {
-      case SENSOR_TYPE_LIGHT:
-        if( als_hook ) {
-          als_hook(e->timestamp, e->distance);
-        }
-        break;
-      case SENSOR_TYPE_PROXIMITY:
-        if( ps_hook ) {
-          ps_hook(e->timestamp, e->light);
-        }
-        break;
-
-      case SENSOR_TYPE_ACCELEROMETER:
-      case SENSOR_TYPE_MAGNETIC_FIELD:
-      case SENSOR_TYPE_ORIENTATION:
-      case SENSOR_TYPE_GYROSCOPE:
-      case SENSOR_TYPE_PRESSURE:
-      case SENSOR_TYPE_TEMPERATURE:
-      case SENSOR_TYPE_GRAVITY:
-      case SENSOR_TYPE_LINEAR_ACCELERATION:
-      case SENSOR_TYPE_ROTATION_VECTOR:
-      case SENSOR_TYPE_RELATIVE_HUMIDITY:
-      case SENSOR_TYPE_AMBIENT_TEMPERATURE:
-        break;
-      }
-    }
-  }
+  als_level_hook = cb;
 }
 
-/** Initialize libhybris sensor poll device object
+/** Set ambient light sensor sampling period and maximum report latency
  *
- * Also:
- * - disables ALS and PS sensor inputs if possible
- * - starts worker thread to handle sensor input events
+ * On hals that support batching, the sensor hub can queue events for
+ * up to latency_ms before waking up the application processor. Older
+ * hals get only the sampling period.
+ *
+ * @param period_ms  sampling period, or 0 for hal default
+ * @param latency_ms maximum report latency, or 0 for no batching
  *
  * @return true on success, false on failure
  */
-static bool mce_hybris_sensors_init(void)
+bool mce_hybris_als_set_batching(int period_ms, int latency_ms)
 {
-  static bool done = false;
-
-  if( !done ) {
-    done = true;
-
-    if( !mce_hybris_modsensors_load() ) {
-      goto cleanup;
-    }
-
-    mce_sensors_open(&mod_sensors->common, &dev_poll);
-
-    if( !dev_poll ) {
-      mce_log(LOG_WARNING, "failed to open sensor poll device");
-    }
-    else {
-      mce_log(LOG_DEBUG, "dev_poll = %p", dev_poll);
+  return mce_hybris_sensor_set_batching(SENSOR_TYPE_LIGHT,
+                                        period_ms, latency_ms);
+}
 
-      if( ps_sensor ) {
-        dev_poll->activate(dev_poll, ps_sensor->handle, false);
-      }
-      if( als_sensor ) {
-        dev_poll->activate(dev_poll, als_sensor->handle, false);
-      }
+/** Set callback function for handling ambient light sensor events
+ *
+ * Note: the callback function will be called from worker thread,
+ *       unless main loop delivery has been selected via
+ *       mce_hybris_sensors_set_delivery().
+ */
+void mce_hybris_als_set_hook(mce_hybris_als_fn cb)
+{
+  als_hook = cb;
+}
 
-      poll_tid = mce_hybris_start_thread(mce_hybris_sensors_thread, 0);
-    }
-  }
+/* ------------------------------------------------------------------------- *
+ * sensor event batches
+ * ------------------------------------------------------------------------- */
 
-cleanup:
-  return dev_poll != 0;
+/** Set callback function for handling batches of sensor events
+ *
+ * The callback is called once per sensor poll cycle with all the
+ * sensor events that were received.
+ *
+ * Note: the callback function will be called from worker thread,
+ *       unless main loop delivery has been selected via
+ *       mce_hybris_sensors_set_delivery().
+ */
+void mce_hybris_sensors_set_batch_hook(mce_hybris_batch_fn cb)
+{
+  batch_hook = cb;
 }
 
-/** Release libhybris display backlight device object
+/** Select the context in which sensor callbacks are called
  *
- * Also:
- * - stops the sensor input worker thread
- * - disables ALS and PS sensor inputs if possible
+ * In MCE_HYBRIS_DELIVERY_THREAD mode all sensor callbacks are called
+ * directly from the worker thread.
+ *
+ * In MCE_HYBRIS_DELIVERY_MAINLOOP mode the worker thread passes the
+ * events via lock free ring buffer and eventfd wakeup to a glib source
+ * attached to the default main context, and the callbacks get called
+ * from the main loop. The worker thread never blocks on mce.
+ *
+ * Events queued but not yet delivered when switching back to thread
+ * mode are delivered from the worker thread before newer ones.
+ *
+ * Note: must be called from the thread running the default main context,
+ *       but it can be called also from within sensor callbacks.
+ *
+ * @param mode MCE_HYBRIS_DELIVERY_THREAD or MCE_HYBRIS_DELIVERY_MAINLOOP
+ *
+ * @return true on success, false on failure
  */
-static void mce_hybris_sensors_quit(void)
+bool mce_hybris_sensors_set_delivery(mce_hybris_delivery_t mode)
 {
+  bool ack = false;
 
-  if( dev_poll ) {
-    /* Looks like there is no nice way to get the thread to return from
-     * dev_poll->poll(), so we need to just cancel the thread ... */
-    if( poll_tid != 0 ) {
-      mce_log(LOG_DEBUG, "stopping worker thread");
-      if( pthread_cancel(poll_tid) != 0 ) {
-        mce_log(LOG_ERR, "failed to stop worker thread");
-      }
-      else {
-        void *status = 0;
-        pthread_join(poll_tid, &status);
-        mce_log(LOG_DEBUG, "worker stopped, status = %p", status);
-      }
-      poll_tid = 0;
-    }
-
-    if( ps_sensor ) {
-      dev_poll->activate(dev_poll, ps_sensor->handle, false);
+  switch( mode ) {
+  case MCE_HYBRIS_DELIVERY_THREAD:
+    /* Stop main loop side consuming, then hand whatever was queued
+     * before the mode change over to the worker thread, which
+     * delivers it before any newer events. No callbacks are made
+     * from here, so this is safe to call also from a callback. */
+    mce_hybris_sensors_ring_detach();
+    __atomic_store_n(&sensors_delivery, mode, __ATOMIC_RELEASE);
+    if( poll_tid ) {
+      mce_hybris_sensors_wakeup_worker();
     }
-    if( als_sensor ) {
-      dev_poll->activate(dev_poll, als_sensor->handle, false);
+    ack = true;
+    break;
+
+  case MCE_HYBRIS_DELIVERY_MAINLOOP:
+    /* Wait for the worker to finish with left over events */
+    pthread_mutex_lock(&sensors_feed_mutex);
+    if( mce_hybris_sensors_ring_attach() ) {
+      __atomic_store_n(&sensors_delivery, mode, __ATOMIC_RELEASE);
+      ack = true;
     }
+    pthread_mutex_unlock(&sensors_feed_mutex);
+    break;
 
-    mce_sensors_close(dev_poll), dev_poll = 0;
+  default:
+    break;
   }
+
+  mce_log(LOG_DEBUG, "%s(%d) -> %s", __FUNCTION__, mode,
+          ack ? "success" : "failure");
+
+  return ack;
 }
 
 /* ------------------------------------------------------------------------- *
- * proximity sensor
+ * generic sensor access
  * ------------------------------------------------------------------------- */
 
-/** Start using proximity sensor via libhybris
+/** Start using a sensor of given type via libhybris
  *
- * @return true on success, false on failure
+ * @param type MCE_HYBRIS_SENSOR_TYPE_xxx
+ *
+ * @return true if sensor is available, false otherwise
  */
-bool mce_hybris_ps_init(void)
+bool mce_hybris_sensor_init(int type)
 {
   bool res = false;
 
+  if( probe_cache_lacks_sensor(type) ) {
+    goto cleanup;
+  }
+
   if( !mce_hybris_sensors_init() ) {
     goto cleanup;
   }
 
-  if( !ps_sensor ) {
+  if( !mce_hybris_modsensors_get_sensor(type) ) {
     goto cleanup;
   }
 
@@ -1704,110 +8703,213 @@ cleanup:
   return res;
 }
 
-/** Stop using proximity sensor via libhybris
+/** Set sensor input enabled state
  *
- * @return true on success, false on failure
- */
-void mce_hybris_ps_quit(void)
-{
-  ps_hook = 0;
-}
-
-/** Set proximity sensort input enabled state
+ * All sensors share the same worker thread and sensor poll device.
  *
+ * @param type  MCE_HYBRIS_SENSOR_TYPE_xxx
  * @param state true to enable input, or false to disable input
+ *
+ * @return true on success, false on failure
  */
-bool mce_hybris_ps_set_active(bool state)
+bool mce_hybris_sensor_set_active(int type, bool state)
 {
   bool res = false;
 
-  if( !mce_hybris_ps_init() ) {
+  if( !mce_hybris_sensor_init(type) ) {
     goto cleanup;
   }
 
-  if( dev_poll->activate(dev_poll, ps_sensor->handle, state) < 0 ) {
+  if( type == SENSOR_TYPE_LIGHT && state ) {
+    mce_hybris_als_filter_reset();
+    als_auto_reset();
+  }
+
+  if( !mce_hybris_sensors_activate(&sensor_slots[type], state) ) {
     goto cleanup;
   }
 
   res = true;
 
 cleanup:
+  mce_log(LOG_DEBUG, "%s(%d, %s) -> %s", __FUNCTION__, type,
+          state ? "true" : "false", res ? "success" : "failure");
   return res;
 }
 
-/** Set callback function for handling proximity sensor events
+/** Set sensor sampling period and maximum report latency
  *
- * Note: the callback function will be called from worker thread.
- */
-void mce_hybris_ps_set_hook(mce_hybris_ps_fn cb)
-{
-  ps_hook = cb;
-}
-
-/* ------------------------------------------------------------------------- *
- * ambient light sensor
- * ------------------------------------------------------------------------- */
-
-/** Start using ambient light sensor via libhybris
+ * On hals that support batching, the sensor hub can queue events for
+ * up to latency_ms before waking up the application processor. Older
+ * hals get only the sampling period.
+ *
+ * @param type       MCE_HYBRIS_SENSOR_TYPE_xxx
+ * @param period_ms  sampling period, or 0 for hal default
+ * @param latency_ms maximum report latency, or 0 for no batching
  *
  * @return true on success, false on failure
  */
-bool mce_hybris_als_init(void)
+bool mce_hybris_sensor_set_batching(int type, int period_ms, int latency_ms)
 {
   bool res = false;
 
-  if( !mce_hybris_sensors_init() ) {
+  if( !mce_hybris_sensor_init(type) ) {
     goto cleanup;
   }
 
-  if( !als_sensor ) {
+  sensor_slot_t *slot = &sensor_slots[type];
+
+  sensor_rate_set(&slot->rate, period_ms, latency_ms);
+
+  /* Changes are applied on the next enable, or immediately if active */
+  if( slot->active && !mce_hybris_sensors_set_rate(slot) ) {
     goto cleanup;
   }
 
   res = true;
 
 cleanup:
+  mce_log(LOG_DEBUG, "%s(%d, %d, %d) -> %s", __FUNCTION__, type,
+          period_ms, latency_ms, res ? "success" : "failure");
   return res;
 }
 
-/** Stop using ambient light sensor via libhybris
+/** Set callback function for handling events from sensor of given type
  *
- * @return true on success, false on failure
+ * Note: the callback function will be called from worker thread,
+ *       unless main loop delivery has been selected via
+ *       mce_hybris_sensors_set_delivery(). Proximity sensor callback
+ *       is called from the fast lane thread when that is enabled via
+ *       mce_hybris_ps_set_fast_lane().
+ *
+ * @param type MCE_HYBRIS_SENSOR_TYPE_xxx
+ * @param cb   callback function, or NULL to remove
  */
-void mce_hybris_als_quit(void)
+void mce_hybris_sensor_set_hook(int type, mce_hybris_sensor_fn cb)
 {
-  als_hook = 0;
+  sensor_slot_t *slot = mce_hybris_modsensors_get_slot(type);
+
+  if( slot ) {
+    slot->hook = cb;
+  }
 }
 
-/** Set ambient light sensor input enabled state
+/* ========================================================================= *
+ * CAPABILITIES
+ * ========================================================================= */
+
+/** Fill in sensor details
  *
- * @param state true to enable input, or false to disable input
+ * @param info   where to store the details
+ * @param sensor sensor to describe
  */
-bool mce_hybris_als_set_active(bool state)
+static void mce_hybris_caps_describe_sensor(mce_hybris_sensor_info_t *info,
+                                            const struct sensor_t *sensor)
 {
-  bool res = false;
+  info->type         = sensor->type;
+  info->max_range    = sensor->maxRange;
+  info->resolution   = sensor->resolution;
+  info->power        = sensor->power;
+  info->min_delay_us = sensor->minDelay;
+  info->fifo_max     = 0;
+
+#ifdef SENSORS_DEVICE_API_VERSION_1_1
+  if( mce_hybris_sensors_has_batch() ) {
+    info->fifo_max = sensor->fifoMaxEventCount;
+  }
+#endif
+}
 
-  if( !mce_hybris_als_init() ) {
-    goto cleanup;
+/** Probe all hardware and describe what is available
+ *
+ * All devices are initialized as a side effect, so that mce can
+ * select code paths once at startup instead of finding out about
+ * missing features by calling them. The setter functions remain
+ * safe to call for unavailable features; they just fail.
+ *
+ * @param caps where to store details, or NULL if only bits are needed
+ *
+ * @return MCE_HYBRIS_CAP_xxx bits
+ */
+uint32_t mce_hybris_get_capabilities(mce_hybris_caps_t *caps)
+{
+  mce_hybris_caps_t tmp;
+
+  if( !caps ) {
+    caps = &tmp;
   }
 
-  if( dev_poll->activate(dev_poll, als_sensor->handle, state) < 0 ) {
-    goto cleanup;
+  memset(caps, 0, sizeof *caps);
+
+  /* Display */
+
+  if( mce_hybris_framebuffer_init() ) {
+    caps->caps |= MCE_HYBRIS_CAP_FRAMEBUFFER_POWER;
   }
 
-  res = true;
+  if( mce_hybris_backlight_init() ) {
+    caps->caps |= MCE_HYBRIS_CAP_BACKLIGHT;
+    if( backlight_uses_sysfs ) {
+      caps->caps |= MCE_HYBRIS_CAP_BACKLIGHT_SYSFS;
+    }
+  }
 
-cleanup:
-  return res;
-}
+  if( mce_hybris_keypad_init() ) {
+    caps->caps |= MCE_HYBRIS_CAP_KEYPAD;
+  }
 
-/** Set callback function for handling ambient light sensor events
- *
- * Note: the callback function will be called from worker thread.
- */
-void mce_hybris_als_set_hook(mce_hybris_als_fn cb)
-{
-  als_hook = cb;
+  /* Indicator led */
+
+  if( mce_hybris_indicator_init() ) {
+    caps->caps |= MCE_HYBRIS_CAP_INDICATOR;
+
+    if( led_ctrl_uses_sysfs ) {
+      caps->led_backend = MCE_HYBRIS_LED_BACKEND_SYSFS;
+      caps->led_count   = led_states_cnt;
+      caps->caps |= MCE_HYBRIS_CAP_BREATHING;
+      caps->caps |= MCE_HYBRIS_CAP_INDICATOR_LEVEL;
+
+      bool kernel = led_states_cnt > 0;
+      for( int i = 0; i < led_states_cnt; ++i ) {
+        kernel = kernel && led_states[i].has_pattern;
+      }
+      if( kernel ) {
+        caps->caps |= MCE_HYBRIS_CAP_BREATHING_KERNEL;
+      }
+    }
+    else {
+      caps->led_backend = MCE_HYBRIS_LED_BACKEND_HYBRIS;
+    }
+  }
+
+  /* Sensors */
+
+  if( mce_hybris_sensors_init() ) {
+    if( mce_hybris_sensors_has_batch() ) {
+      caps->caps |= MCE_HYBRIS_CAP_SENSOR_BATCHING;
+    }
+
+    for( int type = 1; type < MCE_HYBRIS_SENSOR_TYPE_COUNT; ++type ) {
+      const struct sensor_t *sensor = mce_hybris_modsensors_get_sensor(type);
+
+      if( sensor ) {
+        mce_hybris_caps_describe_sensor(&caps->sensor[type], sensor);
+        ++caps->sensor_count;
+      }
+    }
+
+    if( ps_sensor ) {
+      caps->caps |= MCE_HYBRIS_CAP_PROXIMITY;
+    }
+    if( als_sensor ) {
+      caps->caps |= MCE_HYBRIS_CAP_AMBIENT_LIGHT;
+    }
+  }
+
+  mce_log(LOG_DEBUG, "caps=0x%x, leds=%d, sensors=%d",
+          (unsigned)caps->caps, caps->led_count, caps->sensor_count);
+
+  return caps->caps;
 }
 
 /* ------------------------------------------------------------------------- *
@@ -1817,7 +8919,11 @@ void mce_hybris_als_set_hook(mce_hybris_als_fn cb)
 /** Release all resources allocated by this module */
 void mce_hybris_quit(void)
 {
+  mod_prefetch_join();
+
   mce_hybris_modfb_unload();
   mce_hybris_modlights_unload();
   mce_hybris_modsensors_unload();
+
+  dlog_quit();
 }
@@ -33,6 +33,11 @@ bool mce_hybris_framebuffer_init(void);
 void mce_hybris_framebuffer_quit(void);
 bool mce_hybris_framebuffer_set_power(bool on);
 
+typedef void (*mce_hybris_fb_power_fn)(bool on, bool success, int duration_ms);
+
+bool mce_hybris_framebuffer_set_power_async(bool on);
+bool mce_hybris_framebuffer_set_power_callback(mce_hybris_fb_power_fn cb);
+
 /* - - - - - - - - - - - - - - - - - - - *
  * display backlight brightness
  * - - - - - - - - - - - - - - - - - - - */
@@ -41,6 +46,18 @@ bool mce_hybris_backlight_init(void);
 void mce_hybris_backlight_quit(void);
 bool mce_hybris_backlight_set_brightness(int level);
 
+/** Intensity curves for brightness transitions */
+typedef enum
+{
+  MCE_HYBRIS_CURVE_LINEAR,    // constant rate of change
+  MCE_HYBRIS_CURVE_EASE_OUT,  // fast start, slow end (quarter sine)
+  MCE_HYBRIS_CURVE_EASE_IN,   // slow start, fast end
+  MCE_HYBRIS_CURVE_SMOOTH,    // slow start and end (half cosine)
+} mce_hybris_curve_t;
+
+bool mce_hybris_backlight_fade(int level, int duration_ms,
+                               mce_hybris_curve_t curve);
+
 /* - - - - - - - - - - - - - - - - - - - *
  * keypad backlight brightness
  * - - - - - - - - - - - - - - - - - - - */
@@ -53,12 +70,79 @@ bool mce_hybris_keypad_init(void);
  * indicator led pattern
  * - - - - - - - - - - - - - - - - - - - */
 
+/** What drives an indicator led found in /sys/class/leds */
+typedef enum
+{
+  MCE_HYBRIS_LED_ROLE_RED,    // red component of the pattern color
+  MCE_HYBRIS_LED_ROLE_GREEN,  // green component of the pattern color
+  MCE_HYBRIS_LED_ROLE_BLUE,   // blue component of the pattern color
+  MCE_HYBRIS_LED_ROLE_WHITE,  // brightest component, for single color leds
+
+  MCE_HYBRIS_LED_ROLE_COUNT
+} mce_hybris_led_role_t;
+
+bool mce_hybris_indicator_set_led_pattern(mce_hybris_led_role_t role,
+                                          const char *pattern);
+typedef void (*mce_hybris_indicator_done_fn)(void);
+
 bool mce_hybris_indicator_init(void);
 void mce_hybris_indicator_quit(void);
+bool mce_hybris_indicator_quit_async(mce_hybris_indicator_done_fn cb);
 bool mce_hybris_indicator_set_pattern(int r, int g, int b, int ms_on, int ms_off);
 void mce_hybris_indicator_enable_breathing(bool enable);
 bool mce_hybris_indicator_set_brightness(int level);
 
+/* - - - - - - - - - - - - - - - - - - - *
+ * asynchronous light device writes
+ * - - - - - - - - - - - - - - - - - - - */
+
+/** Light devices controlled via this plugin */
+typedef enum
+{
+  MCE_HYBRIS_LIGHT_BACKLIGHT,
+  MCE_HYBRIS_LIGHT_KEYPAD,
+  MCE_HYBRIS_LIGHT_INDICATOR,
+
+  MCE_HYBRIS_LIGHT_COUNT
+} mce_hybris_light_t;
+
+typedef void (*mce_hybris_light_done_fn)(mce_hybris_light_t light,
+                                         bool success);
+
+bool mce_hybris_lights_set_async(bool enable);
+bool mce_hybris_lights_set_done_callback(mce_hybris_light_done_fn cb);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * light transactions
+ * - - - - - - - - - - - - - - - - - - - */
+
+/** Bit for selecting a light in mce_hybris_lights_state_t mask */
+# define MCE_HYBRIS_LIGHTS_MASK(light) (1u << (light))
+
+/** Requested state of lights for mce_hybris_lights_apply() */
+typedef struct
+{
+  unsigned mask;        // MCE_HYBRIS_LIGHTS_MASK() bits of lights to set
+
+  int      backlight;   // display backlight, 0=off ... 255=maximum
+  int      keypad;      // keypad backlight, 0=off ... 255=maximum
+
+  int      led_r;       // indicator led red intensity 0 ... 255
+  int      led_g;       // indicator led green intensity 0 ... 255
+  int      led_b;       // indicator led blue intensity 0 ... 255
+  int      led_on_ms;   // indicator led on period, or 0 for no flashing
+  int      led_off_ms;  // indicator led off period, or 0 for no flashing
+  bool     led_breathe; // breathe instead of blinking, if supported
+} mce_hybris_lights_state_t;
+
+bool mce_hybris_lights_apply(const mce_hybris_lights_state_t *state);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * brightness calibration
+ * - - - - - - - - - - - - - - - - - - - */
+
+bool mce_hybris_lights_set_calibration(const char *path);
+
 /* - - - - - - - - - - - - - - - - - - - *
  * proximity sensor
  * - - - - - - - - - - - - - - - - - - - */
@@ -68,7 +152,9 @@ typedef void (*mce_hybris_ps_fn)(int64_t timestamp, float distance);
 bool mce_hybris_ps_init(void);
 void mce_hybris_ps_quit(void);
 bool mce_hybris_ps_set_active(bool active);
+bool mce_hybris_ps_set_batching(int period_ms, int latency_ms);
 bool mce_hybris_ps_set_callback(mce_hybris_ps_fn cb);
+bool mce_hybris_ps_set_fast_lane(bool enable, int priority);
 
 /* - - - - - - - - - - - - - - - - - - - *
  * ambient light sensor
@@ -79,12 +165,249 @@ typedef void (*mce_hybris_als_fn)(int64_t timestamp, float light);
 bool mce_hybris_als_init(void);
 void mce_hybris_als_quit(void);
 bool mce_hybris_als_set_active(bool active);
+bool mce_hybris_als_set_batching(int period_ms, int latency_ms);
+bool mce_hybris_als_set_filter(float delta_abs, float delta_rel,
+                               int min_interval_ms, int quiet_flush_ms);
 bool mce_hybris_als_set_callback(mce_hybris_als_fn cb);
 
+/** Point in lux to backlight level mapping */
+typedef struct
+{
+  float lux;    // ambient light level [lux]
+  int   level;  // backlight level, 0=off ... 255=maximum brightness
+} mce_hybris_als_point_t;
+
+/** Filter parameters for automatic brightness control */
+typedef struct
+{
+  int   smoothing_ms;  // time constant for smoothing ALS data, or 0
+  float hysteresis;    // relative lux change needed, e.g. 0.1 = 10%
+  int   fade_ms;       // duration of brightness transitions
+  int   notify_ms;     // minimum delay between level notifications
+} mce_hybris_als_auto_t;
+
+typedef void (*mce_hybris_als_level_fn)(float lux, int level);
+
+bool mce_hybris_als_set_auto_brightness(const mce_hybris_als_point_t *lut,
+                                        int cnt,
+                                        const mce_hybris_als_auto_t *params);
+bool mce_hybris_als_set_auto_active(bool active);
+bool mce_hybris_als_set_level_callback(mce_hybris_als_level_fn cb);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * sensor event batches
+ * - - - - - - - - - - - - - - - - - - - */
+
+/** Sensor types; numerically equal to android SENSOR_TYPE_xxx values */
+enum
+{
+  MCE_HYBRIS_SENSOR_TYPE_ACCELEROMETER               = 1,
+  MCE_HYBRIS_SENSOR_TYPE_MAGNETIC_FIELD              = 2,
+  MCE_HYBRIS_SENSOR_TYPE_ORIENTATION                 = 3,
+  MCE_HYBRIS_SENSOR_TYPE_GYROSCOPE                   = 4,
+  MCE_HYBRIS_SENSOR_TYPE_LIGHT                       = 5,
+  MCE_HYBRIS_SENSOR_TYPE_PRESSURE                    = 6,
+  MCE_HYBRIS_SENSOR_TYPE_TEMPERATURE                 = 7,
+  MCE_HYBRIS_SENSOR_TYPE_PROXIMITY                   = 8,
+  MCE_HYBRIS_SENSOR_TYPE_GRAVITY                     = 9,
+  MCE_HYBRIS_SENSOR_TYPE_LINEAR_ACCELERATION         = 10,
+  MCE_HYBRIS_SENSOR_TYPE_ROTATION_VECTOR             = 11,
+  MCE_HYBRIS_SENSOR_TYPE_RELATIVE_HUMIDITY           = 12,
+  MCE_HYBRIS_SENSOR_TYPE_AMBIENT_TEMPERATURE         = 13,
+  MCE_HYBRIS_SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED = 14,
+  MCE_HYBRIS_SENSOR_TYPE_GAME_ROTATION_VECTOR        = 15,
+  MCE_HYBRIS_SENSOR_TYPE_GYROSCOPE_UNCALIBRATED      = 16,
+  MCE_HYBRIS_SENSOR_TYPE_SIGNIFICANT_MOTION          = 17,
+  MCE_HYBRIS_SENSOR_TYPE_STEP_DETECTOR               = 18,
+  MCE_HYBRIS_SENSOR_TYPE_STEP_COUNTER                = 19,
+  MCE_HYBRIS_SENSOR_TYPE_GEOMAGNETIC_ROTATION_VECTOR = 20,
+
+  /** Sensor types at or above this are not supported */
+  MCE_HYBRIS_SENSOR_TYPE_COUNT                       = 32,
+};
+
+/** Compact sensor event record
+ *
+ * Scalar sensors (ALS: lux, PS: distance) use only value[0], vector
+ * sensors (accelerometer, orientation, etc) have x, y, z in value[].
+ */
+typedef struct
+{
+  int64_t timestamp;  // event time stamp [ns]
+  int32_t type;       // MCE_HYBRIS_SENSOR_TYPE_xxx
+  float   value[3];   // sensor data
+} mce_hybris_sensor_event_t;
+
+typedef void (*mce_hybris_batch_fn)(const mce_hybris_sensor_event_t *eve,
+                                    int cnt);
+
+bool mce_hybris_sensors_set_batch_callback(mce_hybris_batch_fn cb);
+
+/** Sensor event delivery modes */
+typedef enum
+{
+  /** Callbacks are called directly from the sensor worker thread */
+  MCE_HYBRIS_DELIVERY_THREAD,
+
+  /** Callbacks are called from the glib main loop of the process */
+  MCE_HYBRIS_DELIVERY_MAINLOOP,
+} mce_hybris_delivery_t;
+
+bool mce_hybris_sensors_set_delivery(mce_hybris_delivery_t mode);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * sensor recording and replay
+ * - - - - - - - - - - - - - - - - - - - */
+
+bool mce_hybris_sensors_record_start(const char *path, int max_events);
+void mce_hybris_sensors_record_stop(void);
+bool mce_hybris_sensors_replay_start(const char *path, bool paced);
+void mce_hybris_sensors_replay_stop(void);
+bool mce_hybris_sensors_replay_is_active(void);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * generic sensor access
+ * - - - - - - - - - - - - - - - - - - - */
+
+typedef void (*mce_hybris_sensor_fn)(const mce_hybris_sensor_event_t *eve);
+
+bool mce_hybris_sensor_init(int type);
+bool mce_hybris_sensor_set_active(int type, bool active);
+bool mce_hybris_sensor_set_batching(int type, int period_ms, int latency_ms);
+bool mce_hybris_sensor_set_callback(int type, mce_hybris_sensor_fn cb);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * sensor statistics
+ * - - - - - - - - - - - - - - - - - - - */
+
+enum
+{
+  /** Histogram slots for delivery latency: slot i counts latencies
+   *  in [2^i, 2^(i+1)) microseconds, the last slot anything larger */
+  MCE_HYBRIS_STATS_LATENCY_SLOTS = 24,
+
+  /** Histogram slots for events per poll: slot i counts poll cycles
+   *  that returned i events, the last slot anything larger */
+  MCE_HYBRIS_STATS_BATCH_SLOTS   = 33,
+};
+
+/** Event statistics for one sensor type */
+typedef struct
+{
+  uint64_t events;        // number of events delivered
+  uint64_t latency_sum;   // sum of delivery latencies [us]
+  uint64_t latency_max;   // largest delivery latency [us]
+  uint64_t latency[MCE_HYBRIS_STATS_LATENCY_SLOTS];
+} mce_hybris_sensor_type_stats_t;
+
+/** Sensor worker statistics
+ *
+ * Delivery latency = CLOCK_BOOTTIME time at callback invocation
+ * minus the event time stamp assigned by the sensor hal.
+ */
+typedef struct
+{
+  uint64_t polls;         // number of dev_poll->poll() returns
+  uint64_t batch[MCE_HYBRIS_STATS_BATCH_SLOTS];
+  mce_hybris_sensor_type_stats_t type[MCE_HYBRIS_SENSOR_TYPE_COUNT];
+} mce_hybris_sensor_stats_t;
+
+bool mce_hybris_get_sensor_stats(mce_hybris_sensor_stats_t *stats);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * capabilities
+ * - - - - - - - - - - - - - - - - - - - */
+
+/** Capability bits returned by mce_hybris_get_capabilities() */
+enum
+{
+  MCE_HYBRIS_CAP_FRAMEBUFFER_POWER = 1u << 0,
+  MCE_HYBRIS_CAP_BACKLIGHT         = 1u << 1,
+  MCE_HYBRIS_CAP_BACKLIGHT_SYSFS   = 1u << 2,
+  MCE_HYBRIS_CAP_KEYPAD            = 1u << 3,
+  MCE_HYBRIS_CAP_INDICATOR         = 1u << 4,
+  MCE_HYBRIS_CAP_BREATHING         = 1u << 5,
+  MCE_HYBRIS_CAP_BREATHING_KERNEL  = 1u << 6,
+  MCE_HYBRIS_CAP_INDICATOR_LEVEL   = 1u << 7,
+  MCE_HYBRIS_CAP_PROXIMITY         = 1u << 8,
+  MCE_HYBRIS_CAP_AMBIENT_LIGHT     = 1u << 9,
+  MCE_HYBRIS_CAP_SENSOR_BATCHING   = 1u << 10,
+};
+
+/** How the indicator led is controlled */
+typedef enum
+{
+  MCE_HYBRIS_LED_BACKEND_NONE,    // no indicator led
+  MCE_HYBRIS_LED_BACKEND_SYSFS,   // raw sysfs controls
+  MCE_HYBRIS_LED_BACKEND_HYBRIS,  // libhybris lights module
+} mce_hybris_led_backend_t;
+
+/** Details of an available sensor */
+typedef struct
+{
+  int32_t  type;          // MCE_HYBRIS_SENSOR_TYPE_xxx, or 0 if not present
+  float    max_range;     // in sensor units
+  float    resolution;    // in sensor units
+  float    power;         // [mA]
+  int32_t  min_delay_us;  // 0 = reports only on change
+  uint32_t fifo_max;      // hw fifo size [events], 0 = no batching
+} mce_hybris_sensor_info_t;
+
+/** Hardware capabilities */
+typedef struct
+{
+  uint32_t                 caps;         // MCE_HYBRIS_CAP_xxx bits
+  mce_hybris_led_backend_t led_backend;
+  int                      led_count;    // number of sysfs leds driven
+  int                      sensor_count; // number of sensor[] entries used
+  mce_hybris_sensor_info_t sensor[MCE_HYBRIS_SENSOR_TYPE_COUNT];
+} mce_hybris_caps_t;
+
+uint32_t mce_hybris_get_capabilities(mce_hybris_caps_t *caps);
+
+/* - - - - - - - - - - - - - - - - - - - *
+ * hal call trace
+ * - - - - - - - - - - - - - - - - - - - */
+
+/** Traced operations */
+enum
+{
+  MCE_HYBRIS_TRACE_SET_LIGHT       = 1,  // arg=MCE_HYBRIS_LIGHT_xxx
+  MCE_HYBRIS_TRACE_FB_POWER        = 2,  // arg=1 for on, 0 for off
+  MCE_HYBRIS_TRACE_BACKLIGHT_SYSFS = 3,  // result=value written or -errno
+  MCE_HYBRIS_TRACE_LED_VALUE       = 4,  // arg=led, result=value or -1
+  MCE_HYBRIS_TRACE_LED_BLINK_ON    = 5,  // arg=led, result=ms or -1
+  MCE_HYBRIS_TRACE_LED_BLINK_OFF   = 6,  // arg=led, result=ms or -1
+  MCE_HYBRIS_TRACE_LED_PATTERN     = 7,  // arg=led, result=bytes or -1
+  MCE_HYBRIS_TRACE_SENSOR_ENABLE   = 8,  // arg=sensor handle
+  MCE_HYBRIS_TRACE_SENSOR_DISABLE  = 9,  // arg=sensor handle
+  MCE_HYBRIS_TRACE_SENSOR_BATCH    = 10, // arg=sensor handle
+  MCE_HYBRIS_TRACE_SENSOR_FLUSH    = 11, // arg=sensor handle
+  MCE_HYBRIS_TRACE_SENSOR_POLL     = 12, // result=number of events
+  MCE_HYBRIS_TRACE_SENSOR_EVENT    = 13, // arg=type, result=value[0] bits
+};
+
+/** Trace record; hal calls record the hal return value as result */
+typedef struct
+{
+  uint32_t seq;        // sequence number, for detecting gaps
+  int16_t  op;         // MCE_HYBRIS_TRACE_xxx
+  int16_t  arg;        // operation specific argument
+  int32_t  result;     // operation specific result
+  uint32_t duration;   // time spent [us]
+  int64_t  timestamp;  // CLOCK_MONOTONIC time at start [us]
+} mce_hybris_trace_t;
+
+int  mce_hybris_trace_dump(mce_hybris_trace_t *buf, int max);
+bool mce_hybris_trace_write(const char *path);
+
 /* - - - - - - - - - - - - - - - - - - - *
  * generic
  * - - - - - - - - - - - - - - - - - - - */
 
+bool mce_hybris_set_probe_cache(const char *path);
+void mce_hybris_set_probe_retry(bool enable);
+bool mce_hybris_prefetch_modules(void);
 void mce_hybris_quit(void);
 
 /* - - - - - - - - - - - - - - - - - - - *
@@ -98,8 +421,14 @@ typedef void (*mce_hybris_log_fn)(int lev, const char *file, const char *func,
 
 # if MCE_HYBRIS_INTERNAL >= 2
 void mce_hybris_set_log_hook(mce_hybris_log_fn cb);
+void mce_hybris_set_log_level(int lev);
 void mce_hybris_ps_set_hook(mce_hybris_ps_fn cb);
 void mce_hybris_als_set_hook(mce_hybris_als_fn cb);
+void mce_hybris_als_set_level_hook(mce_hybris_als_level_fn cb);
+void mce_hybris_sensors_set_batch_hook(mce_hybris_batch_fn cb);
+void mce_hybris_sensor_set_hook(int type, mce_hybris_sensor_fn cb);
+void mce_hybris_lights_set_done_hook(mce_hybris_light_done_fn cb);
+void mce_hybris_framebuffer_set_power_hook(mce_hybris_fb_power_fn cb);
 # endif
 
 # ifdef __cplusplus